@@ -18,6 +18,7 @@
 #include <string.h>
 
 #include "errors.h"
+#include "sha1.h"
 #include "sort.h"
 #include "waddir.h"
 #include "wadptr.h"
@@ -31,9 +32,16 @@
 // the sentinel value to end a block list.
 #define EXTENDED_MAX_BLOCKMAP_OFFSET 0xfffe
 
+// Block lists are hashed with FNV-1a, working back from the 0xffff at the
+// end of the list, so that the hash of each suffix of a list can be found
+// from the hash of the next shorter one.
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME        16777619
+
 typedef struct {
     uint16_t *elements;
     size_t len;
+    uint32_t hash;
 } block_t;
 
 typedef struct {
@@ -43,36 +51,170 @@ typedef struct {
 } blockmap_t;
 
 static blockmap_t ReadBlockmap(wad_file_t *wf, unsigned int lumpnum);
-static uint32_t WriteBlockmap(const blockmap_t *blockmap, FILE *fp);
+static void EncodeBlockmap(blockmap_t *blockmap, lump_t *lump);
+
+#ifdef SYS_BIG_ENDIAN
+static void SwapBlockmapElements(uint16_t *elements, size_t len)
+{
+    size_t i;
 
-static blockmap_t blockmap_result;
+    for (i = 0; i < len; i++)
+    {
+        elements[i] = (uint16_t) ((elements[i] << 8) | (elements[i] >> 8));
+    }
+}
+#endif
 
+// Finds the list of each block, along with its length and hash. This is
+// done in a single pass back over the lump that finds the end and hash of
+// the list starting at every element, so that lists shared by many blocks
+// (as in a stacked blockmap) are only scanned once. Returns NULL if the
+// offset of any block is outside the lump, or its list runs off the end.
 static block_t *MakeBlocklist(const blockmap_t *blockmap)
 {
     block_t *blocklist;
-    block_t *block;
-    unsigned int i, start_index, end_index;
+    uint32_t *ends, *hashes;
+    uint32_t h = FNV_OFFSET_BASIS;
+    size_t i, start, end = blockmap->len;
+
+    ends = ALLOC_ARRAY(uint32_t, blockmap->len);
+    hashes = ALLOC_ARRAY(uint32_t, blockmap->len);
+
+    for (i = blockmap->len; i > 0; i--)
+    {
+        if (blockmap->elements[i - 1] == 0xffff)
+        {
+            end = i - 1;
+            h = FNV_OFFSET_BASIS;
+        }
+        h = (h ^ blockmap->elements[i - 1]) * FNV_PRIME;
+        ends[i - 1] = end;
+        hashes[i - 1] = h;
+    }
 
     blocklist = ALLOC_ARRAY(block_t, blockmap->num_blocks);
 
     for (i = 0; i < blockmap->num_blocks; i++)
     {
-        block = &blocklist[i];
-        // TODO: Need to do some array bounds checking here.
-        start_index = blockmap->elements[4 + i];
-        block->elements = &blockmap->elements[start_index];
-
-        end_index = start_index;
-        while (blockmap->elements[end_index] != 0xffff)
+        start = blockmap->elements[4 + i];
+        if (start >= blockmap->len || ends[start] == blockmap->len)
         {
-            ++end_index;
+            free(blocklist);
+            blocklist = NULL;
+            break;
         }
-        block->len = end_index - start_index + 1;
+        blocklist[i].elements = &blockmap->elements[start];
+        blocklist[i].len = ends[start] - start + 1;
+        blocklist[i].hash = hashes[start];
     }
 
+    free(ends);
+    free(hashes);
     return blocklist;
 }
 
+static uint32_t HashBlockList(const uint16_t *elements, size_t len)
+{
+    uint32_t h = FNV_OFFSET_BASIS;
+    size_t i;
+
+    for (i = len; i > 0; i--)
+    {
+        h = (h ^ elements[i - 1]) * FNV_PRIME;
+    }
+
+    return h;
+}
+
+// Block lists normally start with a 0 entry. Vanilla Doom treats this as
+// a reference to linedef 0, and Boom-derived ports skip it. Returns true
+// if every list in the given blockmap starts with one.
+static bool HasLeadingZeros(const block_t *blocklist, unsigned int num_blocks)
+{
+    unsigned int i;
+
+    for (i = 0; i < num_blocks; i++)
+    {
+        if (blocklist[i].len < 2 || blocklist[i].elements[0] != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// With -blockmap-nozero, the 0 at the start of each block list is dropped.
+// This is only done if the result can be told apart from a normal
+// blockmap, which it cannot if every list would still start with a 0.
+static void StripLeadingZeros(block_t *blocklist, unsigned int num_blocks)
+{
+    unsigned int i;
+
+    if (!HasLeadingZeros(blocklist, num_blocks))
+    {
+        return;
+    }
+
+    for (i = 0; i < num_blocks; i++)
+    {
+        if (blocklist[i].elements[1] != 0)
+        {
+            break;
+        }
+    }
+    if (i == num_blocks)
+    {
+        return;
+    }
+
+    for (i = 0; i < num_blocks; i++)
+    {
+        ++blocklist[i].elements;
+        --blocklist[i].len;
+        blocklist[i].hash =
+            HashBlockList(blocklist[i].elements, blocklist[i].len);
+    }
+}
+
+// Makes a copy of a blockmap whose leading zeros have been stripped, with
+// a 0 put back at the start of each block list. As with BuildBlockmap(),
+// the lists are not stacked and no offset table is included.
+static blockmap_t AddLeadingZeros(const blockmap_t *blockmap,
+                                  const block_t *blocklist,
+                                  block_t **new_blocklist)
+{
+    blockmap_t result;
+    unsigned int i;
+
+    result.num_blocks = blockmap->num_blocks;
+    result.size = 4;
+    for (i = 0; i < blockmap->num_blocks; i++)
+    {
+        result.size += blocklist[i].len + 1;
+    }
+    result.elements = ALLOC_ARRAY(uint16_t, result.size);
+    memcpy(result.elements, blockmap->elements, 4 * sizeof(uint16_t));
+    result.len = 4;
+
+    // The array is allocated at its full size, so the lists never move.
+    *new_blocklist = ALLOC_ARRAY(block_t, blockmap->num_blocks);
+    for (i = 0; i < blockmap->num_blocks; i++)
+    {
+        block_t *block = &(*new_blocklist)[i];
+
+        block->elements = &result.elements[result.len];
+        block->len = blocklist[i].len + 1;
+        block->elements[0] = 0;
+        memcpy(block->elements + 1, blocklist[i].elements,
+               blocklist[i].len * sizeof(uint16_t));
+        block->hash = HashBlockList(block->elements, block->len);
+        result.len += block->len;
+    }
+
+    return result;
+}
+
 // TODO: We don't really need it right now, but this doesn't update the
 // blockmap->blocklist[]->elements pointers when reallocating.
 static void AppendBlockmapElements(blockmap_t *blockmap, uint16_t *elements,
@@ -90,34 +232,157 @@ static void AppendBlockmapElements(blockmap_t *blockmap, uint16_t *elements,
     blockmap->len += count;
 }
 
-static int FindIdenticalBlock(const block_t *blocklist,
-                              unsigned int *sorted_map, size_t num_blocks,
-                              const block_t *block)
+// Index of every suffix of the block lists added to the blockmap so far,
+// so that a block that is identical to, or a suffix of, an earlier block
+// can be found without comparing it against every one of them. Each
+// distinct suffix is only indexed once, for the first block it was found
+// in; empty slots have a len of zero.
+typedef struct {
+    uint32_t hash;
+    unsigned int block, len;
+} suffix_t;
+
+typedef struct {
+    suffix_t *slots;
+    size_t mask, count;
+
+    // Hashes of the suffixes of the block being looked up or added, by
+    // the index of the first element of each suffix.
+    uint32_t *hashes;
+    size_t hashes_size;
+} suffix_index_t;
+
+static void InitSuffixIndex(suffix_index_t *index, size_t size)
 {
-    unsigned int i;
+    index->mask = size - 1;
+    index->count = 0;
+    index->slots = ALLOC_ARRAY(suffix_t, size);
+    memset(index->slots, 0, sizeof(suffix_t) * size);
+    index->hashes_size = 16;
+    index->hashes = ALLOC_ARRAY(uint32_t, index->hashes_size);
+}
 
-    for (i = 0; i < num_blocks; i++)
+static void FreeSuffixIndex(suffix_index_t *index)
+{
+    free(index->slots);
+    free(index->hashes);
+}
+
+// Calculates the hashes of every suffix of the given block, working back
+// from the end so that each is calculated from the next in one step.
+static void HashSuffixes(suffix_index_t *index, const block_t *block)
+{
+    uint32_t h = FNV_OFFSET_BASIS;
+    size_t i;
+
+    if (block->len > index->hashes_size)
     {
-        unsigned int bi = sorted_map[i];
-        const block_t *ib = &blocklist[bi];
+        index->hashes_size = block->len;
+        index->hashes =
+            REALLOC_ARRAY(uint32_t, index->hashes, index->hashes_size);
+    }
+
+    for (i = block->len; i > 0; i--)
+    {
+        h = (h ^ block->elements[i - 1]) * FNV_PRIME;
+        index->hashes[i - 1] = h;
+    }
+}
 
-        // We allow suffixes, but unless the blockmap is in "engine
-        // format" it probably won't make a difference.
-        if (block->len > ib->len)
+static void InsertSuffix(suffix_index_t *index, const suffix_t *suffix)
+{
+    size_t i;
+
+    for (i = suffix->hash & index->mask; index->slots[i].len != 0;
+         i = (i + 1) & index->mask)
+    {
+    }
+    index->slots[i] = *suffix;
+}
+
+static void ResizeSuffixIndex(suffix_index_t *index)
+{
+    suffix_t *old_slots = index->slots;
+    size_t i, old_size = index->mask + 1;
+
+    index->mask = old_size * 2 - 1;
+    index->slots = ALLOC_ARRAY(suffix_t, old_size * 2);
+    memset(index->slots, 0, sizeof(suffix_t) * old_size * 2);
+    for (i = 0; i < old_size; i++)
+    {
+        if (old_slots[i].len != 0)
         {
-            continue;
+            InsertSuffix(index, &old_slots[i]);
         }
+    }
+    free(old_slots);
+}
 
-        if (!memcmp(block->elements, ib->elements + ib->len - block->len,
-                    block->len * 2))
+// Returns the block that the given elements are a suffix of, or -1 if
+// they are not a suffix of any block in the index.
+static int LookupSuffix(const suffix_index_t *index, const block_t *blocklist,
+                        const uint16_t *elements, size_t len, uint32_t hash)
+{
+    size_t i;
+
+    for (i = hash & index->mask; index->slots[i].len != 0;
+         i = (i + 1) & index->mask)
+    {
+        const suffix_t *suffix = &index->slots[i];
+        const block_t *ib = &blocklist[suffix->block];
+
+        if (suffix->hash == hash && suffix->len == len &&
+            !memcmp(elements, ib->elements + ib->len - len, len * 2))
         {
-            return (int) bi;
+            return (int) suffix->block;
         }
     }
 
     return -1;
 }
 
+// Adds the suffixes of the given block to the index. Once one is found
+// that is already there, all the shorter ones must be there too.
+static void AddSuffixes(suffix_index_t *index, const block_t *blocklist,
+                        unsigned int bi)
+{
+    const block_t *block = &blocklist[bi];
+    suffix_t suffix;
+    size_t i;
+
+    HashSuffixes(index, block);
+
+    for (i = 0; i < block->len; i++)
+    {
+        if (LookupSuffix(index, blocklist, block->elements + i,
+                         block->len - i, index->hashes[i]) >= 0)
+        {
+            break;
+        }
+
+        if ((index->count + 1) * 2 > index->mask + 1)
+        {
+            ResizeSuffixIndex(index);
+        }
+        suffix.hash = index->hashes[i];
+        suffix.block = bi;
+        suffix.len = block->len - i;
+        InsertSuffix(index, &suffix);
+        ++index->count;
+    }
+}
+
+// Finds the first block added to the index that the given block is
+// identical to, or a suffix of.
+static int FindIdenticalBlock(const suffix_index_t *index,
+                              const block_t *blocklist, const block_t *block)
+{
+    // We allow suffixes, but unless the blockmap is in "engine format" it
+    // probably won't make a difference.
+    return LookupSuffix(index, blocklist, block->elements, block->len,
+                        block->hash);
+}
+
 static int LargestBlockCompare(unsigned int i1, unsigned int i2,
                                const void *callback_data)
 {
@@ -138,17 +403,18 @@ static size_t BlockmapLimit(void)
     return VANILLA_MAX_BLOCKMAP_OFFSET;
 }
 
-static blockmap_t RebuildBlockmap(const blockmap_t *blockmap, bool compress)
+static blockmap_t RebuildBlockmap(const blockmap_t *blockmap,
+                                  const block_t *blocklist, bool compress)
 {
     blockmap_t result;
-    block_t *blocklist;
+    suffix_index_t index;
     uint16_t *block_offsets;
     unsigned int *sorted_map;
     unsigned int i;
 
-    blocklist = MakeBlocklist(blockmap);
+    InitSuffixIndex(&index, 1024);
 
-    result.size = blockmap->len;
+    result.size = MAX(blockmap->len, 4 + blockmap->num_blocks);
     result.elements = ALLOC_ARRAY(uint16_t, result.size);
     result.len = 4 + blockmap->num_blocks;
     result.num_blocks = blockmap->num_blocks;
@@ -179,6 +445,7 @@ static blockmap_t RebuildBlockmap(const blockmap_t *blockmap, bool compress)
         unsigned int bi = sorted_map[i];
         const block_t *block = &blocklist[bi];
         int match_index = -1;
+        size_t offset;
 
         PrintProgress(i, blockmap->num_blocks);
 #ifdef DEBUG
@@ -186,36 +453,47 @@ static blockmap_t RebuildBlockmap(const blockmap_t *blockmap, bool compress)
 #endif
         if (compress)
         {
-            match_index = FindIdenticalBlock(blocklist, sorted_map, i, block);
+            match_index = FindIdenticalBlock(&index, blocklist, block);
         }
 
+        // Copy the offset of the other block, but if it's a suffix match
+        // then we need to offset. If the other block crosses the limit,
+        // the suffix may still be over it.
         if (match_index >= 0)
         {
-            // Copy the offset of the other block, but if it's a suffix
-            // match then we need to offset.
-            block_offsets[bi] = block_offsets[match_index] +
-                                blocklist[match_index].len - block->len;
+            offset = block_offsets[match_index] + blocklist[match_index].len -
+                     block->len;
 #ifdef DEBUG
             printf("\tmatches block %d (+%d offset)\n", match_index,
                    blocklist[match_index].len - block->len);
 #endif
         }
-        else if (result.len > BlockmapLimit())
+        else
+        {
+            offset = result.len;
+        }
+
+        if (offset > BlockmapLimit())
         {
             free(result.elements);
             result.elements = NULL;
             result.len = 0;
             break;
         }
-        else
+
+        block_offsets[bi] = offset;
+        if (match_index < 0)
         {
-            block_offsets[bi] = result.len;
             AppendBlockmapElements(&result, block->elements, block->len);
             block_offsets = &result.elements[4];
+            if (compress)
+            {
+                AddSuffixes(&index, blocklist, bi);
+            }
         }
     }
 
-    free(blocklist);
+    FreeSuffixIndex(&index);
     free(sorted_map);
 #ifdef DEBUG
     printf("total blockmap length=%d elements (%d bytes)\n", result.len,
@@ -225,6 +503,545 @@ static blockmap_t RebuildBlockmap(const blockmap_t *blockmap, bool compress)
     return result;
 }
 
+// When RebuildBlockmap() cannot fit a stacked blockmap within the offset
+// limit, LayoutBlockmap() tries harder. Block lists can only share
+// elements when one is a suffix of another, so the size of the lump is
+// fixed by the set of lists that are not a suffix of any other; only the
+// order in which these lists appear can change. Every block points either
+// at the start of one of these lists or into it, and it is these offsets
+// that must be within the limit. The part of a list after the last offset
+// that points into it (its "tail") can lie beyond the limit, so lists are
+// placed in increasing order of tail length: for a given choice of list
+// for each block to point into, this fits if any order does. Changing the
+// order can change which list a block is best pointed into, so this is
+// repeated for a few passes.
+#define LAYOUT_PASSES 8
+
+// Finds the block lists that are not identical to or a suffix of another
+// list, largest first.
+static unsigned int *FindMaximalLists(const block_t *blocklist,
+                                      unsigned int num_blocks,
+                                      unsigned int *num_lists)
+{
+    suffix_index_t index;
+    unsigned int *sorted_map, *lists;
+    unsigned int i;
+
+    sorted_map = MakeSortedMap(num_blocks, LargestBlockCompare, blocklist);
+    lists = ALLOC_ARRAY(unsigned int, num_blocks);
+    *num_lists = 0;
+
+    InitSuffixIndex(&index, 1024);
+    for (i = 0; i < num_blocks; i++)
+    {
+        unsigned int bi = sorted_map[i];
+
+        if (FindIdenticalBlock(&index, blocklist, &blocklist[bi]) < 0)
+        {
+            lists[*num_lists] = bi;
+            ++*num_lists;
+            AddSuffixes(&index, blocklist, bi);
+        }
+    }
+    FreeSuffixIndex(&index);
+    free(sorted_map);
+
+    return lists;
+}
+
+// Points each block into the first list in the given order that contains
+// it, so that as many offsets as possible are near the start of the lump.
+static void AssignHosts(const block_t *blocklist, unsigned int num_blocks,
+                        const unsigned int *lists, unsigned int num_lists,
+                        unsigned int *hosts)
+{
+    suffix_index_t index;
+    unsigned int i;
+
+    InitSuffixIndex(&index, 1024);
+    for (i = 0; i < num_lists; i++)
+    {
+        AddSuffixes(&index, blocklist, lists[i]);
+    }
+    for (i = 0; i < num_blocks; i++)
+    {
+        hosts[i] = FindIdenticalBlock(&index, blocklist, &blocklist[i]);
+    }
+    FreeSuffixIndex(&index);
+}
+
+static int TailLengthCompare(unsigned int i1, unsigned int i2,
+                             const void *callback_data)
+{
+    const unsigned int *tails = callback_data;
+
+    return (int) tails[i1] - (int) tails[i2];
+}
+
+// Sorts the lists into increasing order of tail length, where the tail of
+// a list is the shortest block that points into it.
+static void OrderLists(const block_t *blocklist, unsigned int num_blocks,
+                       const unsigned int *hosts, unsigned int *lists,
+                       unsigned int num_lists)
+{
+    unsigned int *positions, *tails, *sorted_map, *old_lists;
+    unsigned int i;
+
+    positions = ALLOC_ARRAY(unsigned int, num_blocks);
+    tails = ALLOC_ARRAY(unsigned int, num_lists);
+    for (i = 0; i < num_lists; i++)
+    {
+        positions[lists[i]] = i;
+        tails[i] = blocklist[lists[i]].len;
+    }
+    for (i = 0; i < num_blocks; i++)
+    {
+        unsigned int pos = positions[hosts[i]];
+        tails[pos] = MIN(tails[pos], blocklist[i].len);
+    }
+
+    sorted_map = MakeSortedMap(num_lists, TailLengthCompare, tails);
+    old_lists = ALLOC_ARRAY(unsigned int, num_lists);
+    memcpy(old_lists, lists, sizeof(unsigned int) * num_lists);
+    for (i = 0; i < num_lists; i++)
+    {
+        lists[i] = old_lists[sorted_map[i]];
+    }
+
+    free(old_lists);
+    free(sorted_map);
+    free(tails);
+    free(positions);
+}
+
+// Calculates the offset of every block when the lists are placed in the
+// given order, returning the largest offset.
+static size_t PlaceBlocks(const block_t *blocklist, unsigned int num_blocks,
+                          const unsigned int *hosts, const unsigned int *lists,
+                          unsigned int num_lists, size_t *offsets)
+{
+    size_t offset = 4 + num_blocks, max_offset = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_lists; i++)
+    {
+        offsets[lists[i]] = offset;
+        offset += blocklist[lists[i]].len;
+    }
+    for (i = 0; i < num_blocks; i++)
+    {
+        const block_t *host = &blocklist[hosts[i]];
+
+        offsets[i] = offsets[hosts[i]] + host->len - blocklist[i].len;
+        max_offset = MAX(max_offset, offsets[i]);
+    }
+
+    return max_offset;
+}
+
+static blockmap_t LayoutBlockmap(const blockmap_t *blockmap,
+                                 const block_t *blocklist)
+{
+    blockmap_t result;
+    unsigned int *lists, *best_lists, *hosts, *best_hosts;
+    unsigned int num_blocks = blockmap->num_blocks, num_lists, i;
+    size_t *offsets, max_offset, best_offset = SIZE_MAX;
+
+    lists = FindMaximalLists(blocklist, num_blocks, &num_lists);
+    best_lists = ALLOC_ARRAY(unsigned int, num_lists);
+    hosts = ALLOC_ARRAY(unsigned int, num_blocks);
+    best_hosts = ALLOC_ARRAY(unsigned int, num_blocks);
+    offsets = ALLOC_ARRAY(size_t, num_blocks);
+
+    for (i = 0; i < LAYOUT_PASSES && best_offset > BlockmapLimit(); i++)
+    {
+        AssignHosts(blocklist, num_blocks, lists, num_lists, hosts);
+        OrderLists(blocklist, num_blocks, hosts, lists, num_lists);
+        max_offset = PlaceBlocks(blocklist, num_blocks, hosts, lists,
+                                 num_lists, offsets);
+#ifdef DEBUG
+        printf("layout pass %d: largest offset=%d\n", i, (int) max_offset);
+#endif
+        if (max_offset >= best_offset)
+        {
+            break;
+        }
+        best_offset = max_offset;
+        memcpy(best_lists, lists, sizeof(unsigned int) * num_lists);
+        memcpy(best_hosts, hosts, sizeof(unsigned int) * num_blocks);
+    }
+
+    result.len = 0;
+    result.elements = NULL;
+    result.num_blocks = num_blocks;
+
+    if (best_offset > BlockmapLimit())
+    {
+        Warning("Stacked lump would need offsets of up to %d, over the "
+                "limit of %d",
+                (int) best_offset, (int) BlockmapLimit());
+    }
+    else
+    {
+        PlaceBlocks(blocklist, num_blocks, best_hosts, best_lists, num_lists,
+                    offsets);
+        result.size = 4 + num_blocks;
+        result.elements = ALLOC_ARRAY(uint16_t, result.size);
+        result.len = 4 + num_blocks;
+        memcpy(result.elements, blockmap->elements, 4 * sizeof(uint16_t));
+        for (i = 0; i < num_blocks; i++)
+        {
+            result.elements[4 + i] = offsets[i];
+        }
+        for (i = 0; i < num_lists; i++)
+        {
+            const block_t *block = &blocklist[best_lists[i]];
+            AppendBlockmapElements(&result, block->elements, block->len);
+        }
+    }
+
+    free(offsets);
+    free(best_hosts);
+    free(hosts);
+    free(best_lists);
+    free(lists);
+
+    return result;
+}
+
+// Stacks the given blockmap, returning a blockmap with a len of zero if it
+// cannot be made to fit within the offset limit.
+static blockmap_t StackBlockmap(const blockmap_t *blockmap,
+                                const block_t *blocklist)
+{
+    blockmap_t result = RebuildBlockmap(blockmap, blocklist, true);
+
+    if (result.len == 0)
+    {
+        result = LayoutBlockmap(blockmap, blocklist);
+    }
+
+    return result;
+}
+
+// Building a new blockmap from the linedefs and vertices of the level,
+// for -buildblocks. Only the vertex numbers of the linedefs are needed,
+// which are in the same place in Doom and Hexen format linedefs.
+#define LDEF_VERT1     0
+#define LDEF_VERT2     2
+#define LDEF_SIZE      14
+#define HX_LDEF_SIZE   16
+#define VERTEX_SIZE    4
+#define BLOCK_SHIFT    7
+
+typedef struct {
+    int x1, y1, x2, y2;
+} block_line_t;
+
+// Reads the linedefs of the level that the given BLOCKMAP lump belongs
+// to, as pairs of points. Returns NULL if the level is in a format that
+// is not understood, or is invalid.
+static block_line_t *ReadBlockLines(wad_file_t *wf, unsigned int lumpnum,
+                                    size_t *num_lines)
+{
+    unsigned int linedef_num = lumpnum - 8, vertex_num = lumpnum - 6;
+    uint8_t *linedefs, *vertexes;
+    block_line_t *lines;
+    size_t i, linedef_size, num_vertices;
+
+    if (lumpnum < 8 ||
+        strncmp(wf->entries[linedef_num].name, "LINEDEFS", 8) != 0 ||
+        strncmp(wf->entries[vertex_num].name, "VERTEXES", 8) != 0)
+    {
+        return NULL;
+    }
+
+    // As in sidedefs.c, the lump after BLOCKMAP tells us the format.
+    // Console levels have vertices in fixed point, and are skipped.
+    linedef_size = LDEF_SIZE;
+    if (lumpnum + 1 < wf->num_entries)
+    {
+        if (!strncmp(wf->entries[lumpnum + 1].name, "BEHAVIOR", 8))
+        {
+            linedef_size = HX_LDEF_SIZE;
+        }
+        else if (!strncmp(wf->entries[lumpnum + 1].name, "LEAFS", 8))
+        {
+            return NULL;
+        }
+    }
+
+    if (wf->entries[linedef_num].length == 0 ||
+        (wf->entries[linedef_num].length % linedef_size) != 0 ||
+        (wf->entries[vertex_num].length % VERTEX_SIZE) != 0)
+    {
+        return NULL;
+    }
+
+    *num_lines = wf->entries[linedef_num].length / linedef_size;
+    num_vertices = wf->entries[vertex_num].length / VERTEX_SIZE;
+    linedefs = CacheLump(wf, linedef_num);
+    vertexes = CacheLump(wf, vertex_num);
+    lines = ALLOC_ARRAY(block_line_t, *num_lines);
+
+    for (i = 0; i < *num_lines; i++)
+    {
+        const uint8_t *ld = linedefs + i * linedef_size;
+        unsigned int v1 = READ_SHORT(ld + LDEF_VERT1);
+        unsigned int v2 = READ_SHORT(ld + LDEF_VERT2);
+        const uint8_t *p1 = vertexes + v1 * VERTEX_SIZE;
+        const uint8_t *p2 = vertexes + v2 * VERTEX_SIZE;
+
+        if (v1 >= num_vertices || v2 >= num_vertices)
+        {
+            free(lines);
+            lines = NULL;
+            break;
+        }
+
+        lines[i].x1 = (int16_t) READ_SHORT(p1);
+        lines[i].y1 = (int16_t) READ_SHORT(p1 + 2);
+        lines[i].x2 = (int16_t) READ_SHORT(p2);
+        lines[i].y2 = (int16_t) READ_SHORT(p2 + 2);
+    }
+
+    free(linedefs);
+    free(vertexes);
+    return lines;
+}
+
+// Finds the range of block columns that the given line crosses within the
+// row of blocks whose bottom edge is at y (relative to the origin). As with
+// other node builders, each block includes its bottom and left edges but
+// not its top and right ones. The x coordinates of the points where the
+// line enters and leaves the row are calculated exactly, as fractions.
+static void LineColumns(const block_line_t *line, int y, int *col1,
+                        int *col2)
+{
+    int64_t x1 = line->x1, y1 = line->y1, x2 = line->x2, y2 = line->y2;
+    int64_t dx, dy, lo, num, c1, c2;
+
+    if (y1 > y2)
+    {
+        x1 = line->x2;
+        y1 = line->y2;
+        x2 = line->x1;
+        y2 = line->y1;
+    }
+
+    if (y1 == y2)
+    {
+        c1 = x1 >> BLOCK_SHIFT;
+        c2 = x2 >> BLOCK_SHIFT;
+    }
+    else
+    {
+        dx = x2 - x1;
+        dy = y2 - y1;
+        lo = MAX(y1, y);
+        c1 = (x1 * dy + (lo - y1) * dx) / (dy << BLOCK_SHIFT);
+        if (y2 < y + (1 << BLOCK_SHIFT))
+        {
+            c2 = (x1 * dy + (y2 - y1) * dx) / (dy << BLOCK_SHIFT);
+        }
+        else
+        {
+            // The line leaves through the top edge, which is in the next
+            // row. If it meets the edge exactly on a column boundary while
+            // heading right, it never gets into the column to the right.
+            num = x1 * dy + (y + (1 << BLOCK_SHIFT) - y1) * dx;
+            c2 = num / (dy << BLOCK_SHIFT);
+            if (dx > 0 && num % (dy << BLOCK_SHIFT) == 0)
+            {
+                --c2;
+            }
+        }
+    }
+
+    *col1 = (int) MIN(c1, c2);
+    *col2 = (int) MAX(c1, c2);
+}
+
+// Builds the block lists for a single row of blocks, appending them to the
+// given elements array and recording where each one starts. The lines
+// that cross the row are given in increasing order, so each list is too.
+static void BuildBlockRow(const block_line_t *lines, const uint32_t *row_lines,
+                          size_t num_row_lines, int row, unsigned int width,
+                          blockmap_t *result, size_t *list_starts)
+{
+    unsigned int *counts, *fill;
+    uint16_t *sorted;
+    size_t i, total = 0;
+    unsigned int col;
+    int c, col1, col2;
+
+    counts = ALLOC_ARRAY(unsigned int, width + 1);
+    memset(counts, 0, sizeof(unsigned int) * (width + 1));
+    for (i = 0; i < num_row_lines; i++)
+    {
+        LineColumns(&lines[row_lines[i]], row << BLOCK_SHIFT, &col1, &col2);
+        for (c = col1; c <= col2; c++)
+        {
+            ++counts[c + 1];
+        }
+        total += col2 - col1 + 1;
+    }
+    for (col = 0; col < width; col++)
+    {
+        counts[col + 1] += counts[col];
+    }
+
+    // Counting sort of the (column, line) pairs by column.
+    sorted = ALLOC_ARRAY(uint16_t, MAX(total, 1));
+    fill = ALLOC_ARRAY(unsigned int, width);
+    memcpy(fill, counts, sizeof(unsigned int) * width);
+    for (i = 0; i < num_row_lines; i++)
+    {
+        LineColumns(&lines[row_lines[i]], row << BLOCK_SHIFT, &col1, &col2);
+        for (c = col1; c <= col2; c++)
+        {
+            sorted[fill[c]++] = row_lines[i];
+        }
+    }
+
+    for (col = 0; col < width; col++)
+    {
+        uint16_t zero = 0, sentinel = 0xffff;
+
+        list_starts[col] = result->len;
+        AppendBlockmapElements(result, &zero, 1);
+        AppendBlockmapElements(result, sorted + counts[col],
+                               counts[col + 1] - counts[col]);
+        AppendBlockmapElements(result, &sentinel, 1);
+    }
+
+    free(fill);
+    free(sorted);
+    free(counts);
+}
+
+// Builds a new blockmap for the level that the given BLOCKMAP lump belongs
+// to. A line is put in every block that any part of it passes through.
+// Returns false if the level cannot be read. The new blockmap is not
+// stacked; each block has its own list, and no offset table is included.
+static bool BuildBlockmap(wad_file_t *wf, unsigned int lumpnum,
+                          blockmap_t *result, block_t **blocklist)
+{
+    block_line_t *lines;
+    uint32_t *row_counts, *row_lines, *row_fill;
+    size_t *list_starts;
+    size_t i, num_lines;
+    int min_x, min_y, max_x, max_y, org_x, org_y;
+    unsigned int width, height, row, r1, r2;
+
+    lines = ReadBlockLines(wf, lumpnum, &num_lines);
+    if (lines == NULL || num_lines > 0xffff)
+    {
+        free(lines);
+        return false;
+    }
+
+    min_x = max_x = lines[0].x1;
+    min_y = max_y = lines[0].y1;
+    for (i = 0; i < num_lines; i++)
+    {
+        min_x = MIN(min_x, MIN(lines[i].x1, lines[i].x2));
+        min_y = MIN(min_y, MIN(lines[i].y1, lines[i].y2));
+        max_x = MAX(max_x, MAX(lines[i].x1, lines[i].x2));
+        max_y = MAX(max_y, MAX(lines[i].y1, lines[i].y2));
+    }
+
+    // Like most node builders, put the origin at the bottom left corner
+    // of the level. From here on all coordinates are relative to it.
+    org_x = min_x;
+    org_y = min_y;
+    width = ((max_x - org_x) >> BLOCK_SHIFT) + 1;
+    height = ((max_y - org_y) >> BLOCK_SHIFT) + 1;
+
+    // The origin always fits in the header, since it is the position of a
+    // vertex, but there must also be room for the offset of every block
+    // before the limit.
+    if (4 + width * height > BlockmapLimit())
+    {
+        free(lines);
+        return false;
+    }
+
+    for (i = 0; i < num_lines; i++)
+    {
+        lines[i].x1 -= org_x;
+        lines[i].y1 -= org_y;
+        lines[i].x2 -= org_x;
+        lines[i].y2 -= org_y;
+    }
+
+    // Find the lines that cross each row, in increasing order.
+    row_counts = ALLOC_ARRAY(uint32_t, height + 1);
+    memset(row_counts, 0, sizeof(uint32_t) * (height + 1));
+    for (i = 0; i < num_lines; i++)
+    {
+        r1 = MIN(lines[i].y1, lines[i].y2) >> BLOCK_SHIFT;
+        r2 = MAX(lines[i].y1, lines[i].y2) >> BLOCK_SHIFT;
+        for (row = r1; row <= r2; row++)
+        {
+            ++row_counts[row + 1];
+        }
+    }
+    for (row = 0; row < height; row++)
+    {
+        row_counts[row + 1] += row_counts[row];
+    }
+    row_lines = ALLOC_ARRAY(uint32_t, MAX(row_counts[height], 1));
+    row_fill = ALLOC_ARRAY(uint32_t, height);
+    memcpy(row_fill, row_counts, sizeof(uint32_t) * height);
+    for (i = 0; i < num_lines; i++)
+    {
+        r1 = MIN(lines[i].y1, lines[i].y2) >> BLOCK_SHIFT;
+        r2 = MAX(lines[i].y1, lines[i].y2) >> BLOCK_SHIFT;
+        for (row = r1; row <= r2; row++)
+        {
+            row_lines[row_fill[row]++] = i;
+        }
+    }
+    free(row_fill);
+
+    result->num_blocks = width * height;
+    result->size = 4 + result->num_blocks * 2;
+    result->elements = ALLOC_ARRAY(uint16_t, result->size);
+    result->elements[0] = org_x;
+    result->elements[1] = org_y;
+    result->elements[2] = width;
+    result->elements[3] = height;
+    result->len = 4;
+
+    // Each row of blocks only depends on the lines that cross it, so the
+    // rows are built one at a time.
+    list_starts = ALLOC_ARRAY(size_t, result->num_blocks + 1);
+    for (row = 0; row < height; row++)
+    {
+        BuildBlockRow(lines, row_lines + row_counts[row],
+                      row_counts[row + 1] - row_counts[row], row, width,
+                      result, list_starts + row * width);
+    }
+    list_starts[result->num_blocks] = result->len;
+
+    *blocklist = ALLOC_ARRAY(block_t, result->num_blocks);
+    for (i = 0; i < result->num_blocks; i++)
+    {
+        block_t *block = &(*blocklist)[i];
+
+        block->elements = result->elements + list_starts[i];
+        block->len = list_starts[i + 1] - list_starts[i];
+        block->hash = HashBlockList(block->elements, block->len);
+    }
+
+    free(list_starts);
+    free(row_lines);
+    free(row_counts);
+    free(lines);
+    return true;
+}
+
 // Bad node builders can generate invalid BLOCKMAP lumps for very large
 // levels. We can detect this case by looking for sentinel values beyond
 // the 16-bit offset range; it is okay to go a little bit beyond the
@@ -281,13 +1098,47 @@ static bool IsValidBlockmap(blockmap_t *blockmap)
     return true;
 }
 
-bool B_Stack(wad_file_t *wf, unsigned int lumpnum)
+// Builds a new, stacked blockmap to replace the BLOCKMAP lump at the given
+// index, from the LINEDEFS and VERTEXES lumps of the same level. Returns
+// false if the level cannot be read or the result would not fit.
+bool B_Build(wad_file_t *wf, unsigned int lumpnum, lump_t *result)
 {
-    blockmap_t blockmap = ReadBlockmap(wf, lumpnum);
+    blockmap_t blockmap, stacked;
+    block_t *blocklist;
 
+    if (!BuildBlockmap(wf, lumpnum, &blockmap, &blocklist))
+    {
+        return false;
+    }
+
+    if (nozeroblocks)
+    {
+        StripLeadingZeros(blocklist, blockmap.num_blocks);
+    }
+
+    stacked = StackBlockmap(&blockmap, blocklist);
+    free(blocklist);
+    free(blockmap.elements);
+    if (stacked.len == 0)
+    {
+        return false;
+    }
+
+    EncodeBlockmap(&stacked, result);
+    return true;
+}
+
+// Stacks the given BLOCKMAP lump, returning the new contents of the lump
+// in the given lump_t structure, which the caller must free.
+bool B_Stack(wad_file_t *wf, unsigned int lumpnum, lump_t *result)
+{
+    blockmap_t blockmap, stacked;
+    block_t *blocklist;
+
+    blockmap = ReadBlockmap(wf, lumpnum);
     if (!IsValidBlockmap(&blockmap))
     {
-        blockmap_result = blockmap;
+        EncodeBlockmap(&blockmap, result);
         return true;
     }
 
@@ -299,51 +1150,107 @@ bool B_Stack(wad_file_t *wf, unsigned int lumpnum)
                 "trying to stack this BLOCKMAP. You should maybe try using "
                 "a tool like ZokumBSP to fit this level within the vanilla "
                 "limit.");
-        blockmap_result = blockmap;
+        EncodeBlockmap(&blockmap, result);
         return false;
     }
 
-    blockmap_result = RebuildBlockmap(&blockmap, true);
-    if (blockmap_result.len == 0)
+    blocklist = MakeBlocklist(&blockmap);
+    if (blocklist == NULL)
     {
-        blockmap_result = blockmap;
+        Warning("Block list runs past the end of the lump; not trying to "
+                "stack this BLOCKMAP.");
+        EncodeBlockmap(&blockmap, result);
+        return false;
+    }
+
+    if (nozeroblocks)
+    {
+        StripLeadingZeros(blocklist, blockmap.num_blocks);
+    }
+
+    stacked = StackBlockmap(&blockmap, blocklist);
+    free(blocklist);
+    if (stacked.len == 0)
+    {
+        EncodeBlockmap(&blockmap, result);
         return false;
     }
 
     // Check the rebuilt blockmap really is smaller. If it was built
     // using eg. ZokumBSP, the original is probably better than what
     // we've produced.
-    if (blockmap_result.len > blockmap.len)
+    if (stacked.len > blockmap.len)
     {
-        free(blockmap_result.elements);
-        blockmap_result = blockmap;
+        free(stacked.elements);
+        EncodeBlockmap(&blockmap, result);
         return true;
     }
 
     free(blockmap.elements);
+    EncodeBlockmap(&stacked, result);
     return true;
 }
 
-bool B_Unstack(wad_file_t *wf, unsigned int lumpnum)
+bool B_Unstack(wad_file_t *wf, unsigned int lumpnum, lump_t *result)
 {
     blockmap_t blockmap = ReadBlockmap(wf, lumpnum);
+    blockmap_t unstacked;
+    block_t *blocklist;
 
     if (!IsValidBlockmap(&blockmap))
     {
-        blockmap_result = blockmap;
+        EncodeBlockmap(&blockmap, result);
         return true;
     }
 
     blockmap.num_blocks = blockmap.elements[2] * blockmap.elements[3];
 
-    blockmap_result = RebuildBlockmap(&blockmap, false);
-    if (blockmap_result.len == 0)
+    blocklist = MakeBlocklist(&blockmap);
+    if (blocklist == NULL)
+    {
+        Warning("Block list runs past the end of the lump; not trying to "
+                "unstack this BLOCKMAP.");
+        EncodeBlockmap(&blockmap, result);
+        return false;
+    }
+
+    // With -blockmap-nozero, put back the leading zeros if they were
+    // stripped. Other blockmaps are left alone, since some node builders
+    // leave the zeros out too. If the result is too big to unstack, it is
+    // at least stacked with the zeros back in.
+    if (nozeroblocks && !HasLeadingZeros(blocklist, blockmap.num_blocks))
+    {
+        blockmap_t zeroed, restacked;
+        block_t *zeroed_list;
+
+        zeroed = AddLeadingZeros(&blockmap, blocklist, &zeroed_list);
+        free(blocklist);
+        unstacked = RebuildBlockmap(&zeroed, zeroed_list, false);
+        if (unstacked.len == 0)
+        {
+            restacked = StackBlockmap(&zeroed, zeroed_list);
+            if (restacked.len != 0)
+            {
+                free(blockmap.elements);
+                blockmap = restacked;
+            }
+        }
+        free(zeroed_list);
+        free(zeroed.elements);
+    }
+    else
     {
-        blockmap_result = blockmap;
+        unstacked = RebuildBlockmap(&blockmap, blocklist, false);
+        free(blocklist);
+    }
+    if (unstacked.len == 0)
+    {
+        EncodeBlockmap(&blockmap, result);
         return false;
     }
 
     free(blockmap.elements);
+    EncodeBlockmap(&unstacked, result);
     return true;
 }
 
@@ -382,49 +1289,90 @@ bool B_IsStacked(wad_file_t *wf, unsigned int lumpnum)
             break;
         }
     }
-
     free(sorted_map);
+
     free(blockmap.elements);
     return result;
 }
 
-void B_WriteBlockmap(FILE *fstream, entry_t *entry)
-{
-    entry->offset = WriteBlockmap(&blockmap_result, fstream);
-    entry->length = blockmap_result.len * 2;
-    free(blockmap_result.elements);
-}
-
-static blockmap_t ReadBlockmap(wad_file_t *wf, unsigned int lumpnum)
+// Calculates a hash of the given BLOCKMAP lump that is the same whether or
+// not the blockmap is stacked: it covers the header and the contents of each
+// block list, but not the offsets of the lists within the lump. With
+// -blockmap-nozero, stripped leading zeros are hashed as if they were still
+// there. Returns false if the lump is not a valid blockmap.
+bool B_HashBlockmap(wad_file_t *wf, unsigned int lumpnum, sha1_digest_t hash)
 {
-    blockmap_t result;
+    sha1_context_t ctx;
+    block_t *blocklist;
+    uint8_t zero[2] = {0, 0};
+    bool stripped;
     unsigned int i;
 
-    result.len = wf->entries[lumpnum].length / sizeof(uint16_t);
-    result.elements = CacheLump(wf, lumpnum);
-    for (i = 0; i < result.len; i++)
+    blockmap_t blockmap = ReadBlockmap(wf, lumpnum);
+
+    if (!IsValidBlockmap(&blockmap))
     {
-        result.elements[i] = READ_SHORT((uint8_t *) &result.elements[i]);
+        free(blockmap.elements);
+        return false;
     }
 
-    return result;
-}
+    blockmap.num_blocks = blockmap.elements[2] * blockmap.elements[3];
+    blocklist = MakeBlocklist(&blockmap);
+    if (blocklist == NULL)
+    {
+        free(blockmap.elements);
+        return false;
+    }
 
-static uint32_t WriteBlockmap(const blockmap_t *blockmap, FILE *fp)
-{
-    uint8_t *buffer;
-    uint32_t result;
-    unsigned int i;
+    stripped = nozeroblocks &&
+               !HasLeadingZeros(blocklist, blockmap.num_blocks);
 
-    buffer = ALLOC_ARRAY(uint8_t, blockmap->len * 2);
+    // The lists are hashed as they appear in the lump.
+#ifdef SYS_BIG_ENDIAN
+    SwapBlockmapElements(blockmap.elements, blockmap.len);
+#endif
 
-    for (i = 0; i < blockmap->len; i++)
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, (uint8_t *) blockmap.elements, 4 * sizeof(uint16_t));
+    for (i = 0; i < blockmap.num_blocks; i++)
     {
-        WRITE_SHORT(&buffer[i * 2], blockmap->elements[i]);
+        if (stripped)
+        {
+            SHA1_Update(&ctx, zero, sizeof(zero));
+        }
+        SHA1_Update(&ctx, (uint8_t *) blocklist[i].elements,
+                    blocklist[i].len * sizeof(uint16_t));
     }
+    SHA1_Final(hash, &ctx);
 
-    result = WriteWadLump(fp, buffer, blockmap->len * 2);
-    free(buffer);
+    free(blocklist);
+    free(blockmap.elements);
+    return true;
+}
+
+// Blockmaps are worked on as arrays of 16-bit integers in host byte order.
+// That is the same as the order in the lump on little-endian hosts, so the
+// lump is used as it is read, and only needs converting on big-endian ones.
+static blockmap_t ReadBlockmap(wad_file_t *wf, unsigned int lumpnum)
+{
+    blockmap_t result;
+
+    result.len = wf->entries[lumpnum].length / sizeof(uint16_t);
+    result.elements = CacheLump(wf, lumpnum);
+#ifdef SYS_BIG_ENDIAN
+    SwapBlockmapElements(result.elements, result.len);
+#endif
 
     return result;
 }
+
+// Converts the given blockmap to its on-disk form. The lump takes over the
+// blockmap's elements, which are converted in place.
+static void EncodeBlockmap(blockmap_t *blockmap, lump_t *lump)
+{
+#ifdef SYS_BIG_ENDIAN
+    SwapBlockmapElements(blockmap->elements, blockmap->len);
+#endif
+    lump->data = (uint8_t *) blockmap->elements;
+    lump->len = blockmap->len * sizeof(uint16_t);
+}
@@ -17,11 +17,13 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#include "sha1.h"
 #include "waddir.h"
 
-bool B_Stack(wad_file_t *wf, unsigned int lumpnum);
-bool B_Unstack(wad_file_t *wf, unsigned int lumpnum);
+bool B_Build(wad_file_t *wf, unsigned int lumpnum, lump_t *result);
+bool B_Stack(wad_file_t *wf, unsigned int lumpnum, lump_t *result);
+bool B_Unstack(wad_file_t *wf, unsigned int lumpnum, lump_t *result);
 bool B_IsStacked(wad_file_t *wf, unsigned int lumpnum);
-void B_WriteBlockmap(FILE *fstream, entry_t *entry);
+bool B_HashBlockmap(wad_file_t *wf, unsigned int lumpnum, sha1_digest_t hash);
 
 #endif
@@ -14,28 +14,40 @@
 
 #include "graphics.h"
 
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "errors.h"
+#include "sha1.h"
 #include "sort.h"
 #include "waddir.h"
 #include "wadptr.h"
 
-static bool ParseLump(uint8_t *lump, size_t lump_len);
+static bool ParseLump(squash_context_t *ctx, uint8_t *lump, size_t lump_len,
+                      const graphic_header_t *header);
 static bool FindColumnLength(unsigned int x, const uint8_t *column, size_t len,
                              unsigned *result);
 
-// True when we are inside an S_Unsquash call.
-static bool unsquash_mode = false;
-
-// Picture width, height, etc. from header.
-static unsigned short height, width;
-static unsigned short loffset, toffset;
+// Sets up a context for working on graphics. It can be used for any number
+// of graphics, one at a time, and must be freed with S_FreeContext().
+void S_InitContext(squash_context_t *ctx)
+{
+    memset(ctx, 0, sizeof(squash_context_t));
+}
 
-static uint8_t **columns = NULL;
-static unsigned int *colsize = NULL;
+void S_FreeContext(squash_context_t *ctx)
+{
+    free(ctx->columns);
+    free(ctx->colsize);
+    free(ctx->suffixes);
+    free(ctx->suffix_hashes);
+    free(ctx->split_costs);
+    free(ctx->combined);
+    free(ctx->resplit);
+    S_InitContext(ctx);
+}
 
 static void AppendBytes(uint8_t **ptr, size_t *len, size_t *sz,
                         const uint8_t *newdata, const size_t newdata_len)
@@ -53,60 +65,474 @@ static void AppendBytes(uint8_t **ptr, size_t *len, size_t *sz,
 static int LargestColumnCompare(unsigned int index1, unsigned int index2,
                                 const void *callback_data)
 {
-    (void) callback_data;
-    return colsize[index2] - colsize[index1];
+    const squash_context_t *ctx = callback_data;
+    return ctx->colsize[index2] - ctx->colsize[index1];
+}
+
+static void ResetSuffixIndex(squash_context_t *ctx)
+{
+    ctx->suffixes_mask = 1023;
+    ctx->suffixes_count = 0;
+    ctx->suffixes = REALLOC_ARRAY(column_suffix_t, ctx->suffixes,
+                                  ctx->suffixes_mask + 1);
+    memset(ctx->suffixes, 0,
+           sizeof(column_suffix_t) * (ctx->suffixes_mask + 1));
+}
+
+// Calculates the hashes of every suffix of the given column, working back
+// from the end so that each is calculated from the next in one step.
+static void HashColumnSuffixes(squash_context_t *ctx, unsigned int x)
+{
+    const uint8_t *column = ctx->columns[x];
+    uint32_t h = 2166136261u;
+    unsigned int i;
+
+    ctx->suffix_hashes =
+        REALLOC_ARRAY(uint32_t, ctx->suffix_hashes, ctx->colsize[x]);
+    for (i = ctx->colsize[x]; i > 0; i--)
+    {
+        h = (h ^ column[i - 1]) * 16777619;
+        ctx->suffix_hashes[i - 1] = h;
+    }
+}
+
+static void InsertSuffix(squash_context_t *ctx,
+                         const column_suffix_t *suffix)
+{
+    size_t i;
+
+    for (i = suffix->hash & ctx->suffixes_mask; ctx->suffixes[i].len != 0;
+         i = (i + 1) & ctx->suffixes_mask)
+    {
+    }
+    ctx->suffixes[i] = *suffix;
+}
+
+static void GrowSuffixIndex(squash_context_t *ctx)
+{
+    column_suffix_t *old_suffixes = ctx->suffixes;
+    size_t i, old_size = ctx->suffixes_mask + 1;
+
+    ctx->suffixes_mask = old_size * 2 - 1;
+    ctx->suffixes = ALLOC_ARRAY(column_suffix_t, old_size * 2);
+    memset(ctx->suffixes, 0, sizeof(column_suffix_t) * old_size * 2);
+    for (i = 0; i < old_size; i++)
+    {
+        if (old_suffixes[i].len != 0)
+        {
+            InsertSuffix(ctx, &old_suffixes[i]);
+        }
+    }
+    free(old_suffixes);
+}
+
+// Returns the column that the given data is a suffix of, or -1 if it is
+// not a suffix of any column in the index.
+static int LookupSuffix(const squash_context_t *ctx, const uint8_t *data,
+                        unsigned int len, uint32_t hash)
+{
+    size_t i;
+
+    for (i = hash & ctx->suffixes_mask; ctx->suffixes[i].len != 0;
+         i = (i + 1) & ctx->suffixes_mask)
+    {
+        const column_suffix_t *suffix = &ctx->suffixes[i];
+        unsigned int x = suffix->column;
+
+        if (suffix->hash == hash && suffix->len == len &&
+            !memcmp(data, ctx->columns[x] + ctx->colsize[x] - len, len))
+        {
+            return (int) x;
+        }
+    }
+
+    return -1;
+}
+
+// Adds the suffixes of the given column, whose hashes have already been
+// calculated, to the index. Once one is found that is already there, all
+// the shorter ones must be there too.
+static void AddColumnSuffixes(squash_context_t *ctx, unsigned int x)
+{
+    column_suffix_t suffix;
+    unsigned int i, len = ctx->colsize[x];
+
+    for (i = 0; i < len; i++)
+    {
+        if (LookupSuffix(ctx, ctx->columns[x] + i, len - i,
+                         ctx->suffix_hashes[i]) >= 0)
+        {
+            break;
+        }
+
+        if ((ctx->suffixes_count + 1) * 2 > ctx->suffixes_mask + 1)
+        {
+            GrowSuffixIndex(ctx);
+        }
+        suffix.hash = ctx->suffix_hashes[i];
+        suffix.column = x;
+        suffix.len = len - i;
+        InsertSuffix(ctx, &suffix);
+        ++ctx->suffixes_count;
+    }
 }
 
 // Certain tools (though I'm not sure which?) generate inefficient columns
 // that get split across multiple posts unnecessarily. An example can be
 // found in eg. btsx_e2a.wad's TITLEPIC and CREDITS lumps. We can save a
-// few bytes by combining them.
-static void CombinePosts(void)
+// few bytes by combining them. The columns are copied rather than changed
+// in place, since in a squashed graphic they can share the same bytes.
+static void CombinePosts(squash_context_t *ctx)
 {
-    uint8_t *post, *next_post;
+    size_t *starts, combined_len = 0;
     unsigned int x, i;
 
-    for (x = 0; x < width; x++)
+    if (ctx->combined_size == 0)
+    {
+        ctx->combined_size = 1024;
+        ctx->combined = ALLOC_ARRAY(uint8_t, ctx->combined_size);
+    }
+    starts = ALLOC_ARRAY(size_t, ctx->width + 1);
+
+    for (x = 0; x < ctx->width; x++)
     {
-        post = columns[x];
+        const uint8_t *post = ctx->columns[x];
+        size_t last_i = 0;
 
-        i = 0;
-        while (post[i] != 0xff)
+        starts[x] = combined_len;
+
+        for (i = 0; post[i] != 0xff; i += post[i + 1] + 4)
         {
-            uint8_t off = post[0], len = post[1];
-            unsigned int next_i = i + post[i + 1] + 4;
+            uint8_t next_off = post[i], next_len = post[i + 1];
 
-            next_post = post + next_i;
-            if (next_post[0] != 0xff)
+            // If this post exactly follows on from the last one, and the
+            // new length won't overflow, we can merge.
+            if (combined_len > starts[x])
             {
-                uint8_t next_off = next_post[0], next_len = next_post[1];
+                uint8_t *last_post = ctx->combined + last_i;
+                if (((int) last_post[0] + (int) last_post[1]) == next_off &&
+                    ((int) last_post[1] + (int) next_len) < 0x100)
+                {
+                    last_post[1] += next_len;
+                    --combined_len;
+                    AppendBytes(&ctx->combined, &combined_len,
+                                &ctx->combined_size, post + i + 3,
+                                next_len + 1);
+                    continue;
+                }
+            }
+
+            last_i = combined_len;
+            AppendBytes(&ctx->combined, &combined_len, &ctx->combined_size,
+                        post + i, next_len + 4);
+        }
+
+        // The 0xff that ends the column.
+        AppendBytes(&ctx->combined, &combined_len, &ctx->combined_size,
+                    post + i, 1);
+    }
+    starts[ctx->width] = combined_len;
+
+    for (x = 0; x < ctx->width; x++)
+    {
+        ctx->columns[x] = ctx->combined + starts[x];
+        ctx->colsize[x] = starts[x + 1] - starts[x];
+    }
+
+    free(starts);
+}
+
+// Hashes the top row and length of a post onto the hash of the bytes that
+// follow its header, in the same way as HashColumnSuffixes(). The unused
+// byte in the header is skipped; a post that is split off from another
+// gets a new one.
+static uint32_t HashPostStart(uint32_t h, uint8_t top, uint8_t len)
+{
+    h = (h ^ len) * 16777619;
+    return (h ^ top) * 16777619;
+}
+
+// Returns the column in the index that starts with a post at the given row
+// and of the given length, followed by the given data, or -1 if there is
+// none. While re-splitting posts, the index holds the columns this way.
+static int LookupPost(const squash_context_t *ctx, uint8_t top, uint8_t len,
+                      const uint8_t *data, unsigned int data_len,
+                      uint32_t hash)
+{
+    size_t i;
+
+    for (i = hash & ctx->suffixes_mask; ctx->suffixes[i].len != 0;
+         i = (i + 1) & ctx->suffixes_mask)
+    {
+        const column_suffix_t *entry = &ctx->suffixes[i];
+        const uint8_t *column = ctx->columns[entry->column];
+
+        if (entry->hash == hash && entry->len == data_len + 3 &&
+            column[0] == top && column[1] == len &&
+            !memcmp(column + 3, data, data_len))
+        {
+            return (int) entry->column;
+        }
+    }
+
+    return -1;
+}
 
-                // If the next post exactly follows on from this one,
-                // and the new length won't overflow, we can merge.
-                if (((int) off + (int) len) == next_off &&
-                    ((int) len + (int) next_len) < 0x100)
+static void IndexColumnPosts(squash_context_t *ctx)
+{
+    column_suffix_t entry;
+    unsigned int x;
+
+    ResetSuffixIndex(ctx);
+
+    for (x = 0; x < ctx->width; x++)
+    {
+        const uint8_t *column = ctx->columns[x];
+
+        if (column[0] == 0xff)
+        {
+            continue;
+        }
+
+        HashColumnSuffixes(ctx, x);
+        entry.hash =
+            HashPostStart(ctx->suffix_hashes[3], column[0], column[1]);
+        if (LookupPost(ctx, column[0], column[1], column + 3,
+                       ctx->colsize[x] - 3, entry.hash) >= 0)
+        {
+            continue;
+        }
+
+        if ((ctx->suffixes_count + 1) * 2 > ctx->suffixes_mask + 1)
+        {
+            GrowSuffixIndex(ctx);
+        }
+        entry.column = x;
+        entry.len = ctx->colsize[x];
+        InsertSuffix(ctx, &entry);
+        ++ctx->suffixes_count;
+    }
+}
+
+// Looks for a column that would be a suffix of column y if a post started
+// at byte p of it, with the pixel in the given row, and continued for len
+// rows. Returns -1 if there is none. The suffix hashes of column y must
+// already have been calculated.
+static int FindPostMatch(const squash_context_t *ctx, unsigned int y,
+                         unsigned int p, unsigned int top, unsigned int len)
+{
+    int x;
+
+    // 0xff would mark the end of the column.
+    if (top >= 0xff)
+    {
+        return -1;
+    }
+
+    x = LookupPost(ctx, top, len, ctx->columns[y] + p, ctx->colsize[y] - p,
+                   HashPostStart(ctx->suffix_hashes[p], top, len));
+
+    return x == (int) y ? -1 : x;
+}
+
+// Tall patches (as made by DeePsea and read by most source ports) can have
+// more than 254 rows: a post whose top row is not below that of the post
+// before it is placed relative to it instead. Splitting a post in such a
+// column would move the posts after it, so these columns are left alone,
+// along with any column that has a post reaching past row 254.
+static bool IsTallColumn(const uint8_t *column)
+{
+    int prev_top = -1;
+    unsigned int i;
+
+    for (i = 0; column[i] != 0xff; i += column[i + 1] + 4)
+    {
+        if (column[i] <= prev_top || column[i] + column[i + 1] > 0xff)
+        {
+            return true;
+        }
+        prev_top = column[i];
+    }
+
+    return false;
+}
+
+// Splitting a post costs four bytes, for the new post header and the
+// unused byte that ends the post before it.
+static bool SplitWorthwhile(const squash_context_t *ctx, int x)
+{
+    unsigned int cost = ctx->split_costs[x];
+    return cost > 0 && cost != UINT_MAX && ctx->colsize[x] > cost * 4;
+}
+
+// Works out the split costs of every column. A column that is already a
+// suffix of a longer column never needs anything split. Tall columns are
+// never split, so they add nothing to the costs. Returns false if it is
+// not worth splitting anything.
+static bool FindSplitCosts(squash_context_t *ctx)
+{
+    unsigned int x, y, i, j;
+    bool tall;
+    int match;
+
+    ctx->split_costs =
+        REALLOC_ARRAY(unsigned int, ctx->split_costs, ctx->width);
+    memset(ctx->split_costs, 0, sizeof(unsigned int) * ctx->width);
+
+    for (y = 0; y < ctx->width; y++)
+    {
+        const uint8_t *column = ctx->columns[y];
+
+        HashColumnSuffixes(ctx, y);
+        tall = IsTallColumn(column);
+
+        for (i = 0; column[i] != 0xff; i += column[i + 1] + 4)
+        {
+            for (j = 0; j < column[i + 1]; j++)
+            {
+                match = FindPostMatch(ctx, y, i + 3 + j, column[i] + j,
+                                      column[i + 1] - j);
+                if (match < 0)
                 {
-                    post[1] += next_len;
-                    memmove(post + 3 + len, next_post + 3,
-                            colsize[x] - next_i - 3);
-                    colsize[x] -= 4;
                     continue;
                 }
+                x = match;
+                if (j > 0 && !tall && ctx->split_costs[x] != UINT_MAX)
+                {
+                    ++ctx->split_costs[x];
+                }
+                else if (j == 0 && i > 0 &&
+                         column[i + 2] == ctx->columns[x][2])
+                {
+                    ctx->split_costs[x] = UINT_MAX;
+                }
             }
-            i = next_i;
         }
     }
+
+    for (x = 0; x < ctx->width; x++)
+    {
+        if (SplitWorthwhile(ctx, x))
+        {
+            return true;
+        }
+    }
+
+    return false;
 }
 
-// Squashes a graphic. Call with the lump number, returns a pointer to the
-// new(compressed) lump. This must be free()d when it is no longer needed, as
-// S_Squash() does not do this itself.
-uint8_t *S_Squash(wad_file_t *wf, unsigned int entrynum)
+// A column can only be a suffix of another if its first post starts at a
+// post boundary in the other column, but two columns can have the same
+// pixels at the bottom without that being true; for example, a sprite
+// column that has one long post, and the column next to it that has the
+// same pixels at the bottom but not at the top. Here we find columns that
+// would become suffixes of others if posts in the others were split, and
+// split them where it saves more than it costs.
+//
+// Every column with the same pixels from a split point down is split in
+// the same way, so that they still end the same after re-splitting, and
+// so the columns that are suffixes of each other stay that way.
+static void ResplitPosts(squash_context_t *ctx)
+{
+    size_t *starts, len = 0;
+    unsigned int y, i, j, piece;
+    uint8_t header[3];
+    bool tall;
+    int match;
+
+    IndexColumnPosts(ctx);
+    if (!FindSplitCosts(ctx))
+    {
+        return;
+    }
+
+    if (ctx->resplit_size == 0)
+    {
+        ctx->resplit_size = 1024;
+        ctx->resplit = ALLOC_ARRAY(uint8_t, ctx->resplit_size);
+    }
+    starts = ALLOC_ARRAY(size_t, ctx->width + 1);
+
+    for (y = 0; y < ctx->width; y++)
+    {
+        const uint8_t *column = ctx->columns[y];
+
+        HashColumnSuffixes(ctx, y);
+        tall = IsTallColumn(column);
+        starts[y] = len;
+
+        for (i = 0; column[i] != 0xff; i += column[i + 1] + 4)
+        {
+            header[2] = column[i + 2];
+            piece = 0;
+
+            for (j = 1; j <= column[i + 1]; j++)
+            {
+                match = -1;
+                if (j < column[i + 1])
+                {
+                    if (tall)
+                    {
+                        continue;
+                    }
+                    match = FindPostMatch(ctx, y, i + 3 + j, column[i] + j,
+                                          column[i + 1] - j);
+                    if (match < 0 || !SplitWorthwhile(ctx, match))
+                    {
+                        continue;
+                    }
+                }
+
+                // Write the piece of the post that ends here. When a post
+                // is split, the piece above ends with a copy of its last
+                // pixel, and the one below takes the unused byte from the
+                // start of the column that it is to match.
+                header[0] = column[i] + piece;
+                header[1] = j - piece;
+                AppendBytes(&ctx->resplit, &len, &ctx->resplit_size, header,
+                            3);
+                AppendBytes(&ctx->resplit, &len, &ctx->resplit_size,
+                            column + i + 3 + piece, j - piece + 1);
+                if (match >= 0)
+                {
+                    ctx->resplit[len - 1] = column[i + 2 + j];
+                    header[2] = ctx->columns[match][2];
+                }
+                piece = j;
+            }
+
+            // A post with no pixels is kept as it is.
+            if (column[i + 1] == 0)
+            {
+                AppendBytes(&ctx->resplit, &len, &ctx->resplit_size,
+                            column + i, 4);
+            }
+        }
+
+        // The 0xff that ends the column.
+        AppendBytes(&ctx->resplit, &len, &ctx->resplit_size, column + i, 1);
+    }
+    starts[ctx->width] = len;
+
+    // The old columns are needed until all the new ones have been built.
+    for (y = 0; y < ctx->width; y++)
+    {
+        ctx->columns[y] = ctx->resplit + starts[y];
+        ctx->colsize[y] = starts[y + 1] - starts[y];
+    }
+
+    free(starts);
+}
+
+// Rebuilds a graphic, combining identical columns unless unsquash is true.
+static uint8_t *RebuildGraphic(squash_context_t *ctx, wad_file_t *wf,
+                               unsigned int entrynum,
+                               const graphic_header_t *header, bool unsquash)
 {
     uint8_t *oldlump, *newres;
     size_t newres_len, newres_size;
     unsigned int *sorted_map;
-    unsigned int i, i2;
+    unsigned int i;
 
     oldlump = CacheLump(wf, entrynum);
 
@@ -114,67 +540,75 @@ uint8_t *S_Squash(wad_file_t *wf, unsigned int entrynum)
     // lump; in these cases ParseLump() prints an error message, but we
     // otherwise just ignore the problem lump and keep using the same
     // contents as before.
-    if (!ParseLump(oldlump, wf->entries[entrynum].length))
+    if (!ParseLump(ctx, oldlump, wf->entries[entrynum].length, header))
     {
         Warning("Badly-formed or corrupt graphic lump. "
                 "No attempt will be made to process it.");
         return oldlump;
     }
-    CombinePosts();
+    CombinePosts(ctx);
+    if (!unsquash)
+    {
+        ResplitPosts(ctx);
+    }
 
     // We build the sorted map so that we iterate over columns by order of
     // decreasing size; this maximizes the chance of being able to make a
     // prefix match against previous (larger) columns.
-    sorted_map = MakeSortedMap(width, LargestColumnCompare, NULL);
+    sorted_map = MakeSortedMap(ctx->width, LargestColumnCompare, ctx);
 
-    newres_len = 8 + (width * 4);
-    newres_size = 8 + (width * 4);
+    newres_len = 8 + (ctx->width * 4);
+    newres_size = 8 + (ctx->width * 4);
     newres = ALLOC_ARRAY(uint8_t, newres_size);
 
     // Copy header
     memcpy(newres, oldlump, 8);
 
-    for (i = 0; i < width; i++)
+    ResetSuffixIndex(ctx);
+
+    for (i = 0; i < ctx->width; i++)
     {
         unsigned int x = sorted_map[i];
+        int x2 = -1;
 #ifdef DEBUG
-        printf("column: %4d len: %4d\n", sorted_map[i], colsize[sorted_map[i]]);
+        printf("column: %4d len: %4d\n", x, ctx->colsize[x]);
 #endif
-        for (i2 = 0; !unsquash_mode && i2 < i; i2++)
+        // We allow suffix matches. Any earlier column that this one matches
+        // is either in the index or is itself a suffix of a column that is,
+        // so the first match is always the same as it would be if we
+        // compared against every earlier column in turn.
+        if (!unsquash)
         {
-            uint8_t *suffix_ptr;
-            unsigned int x2 = sorted_map[i2];
-
-            if (colsize[x2] < colsize[x])
-            {
-                continue;
-            }
+            HashColumnSuffixes(ctx, x);
+            x2 = LookupSuffix(ctx, ctx->columns[x], ctx->colsize[x],
+                              ctx->suffix_hashes[0]);
+        }
 
-            // We allow prefix matches.
-            suffix_ptr = columns[x2] + colsize[x2] - colsize[x];
-            if (!memcmp(suffix_ptr, columns[x], colsize[x]))
-            {
+        if (x2 >= 0)
+        {
 #ifdef DEBUG
-                printf("\tmatches %4d\n", x2);
+            printf("\tmatches %4d\n", x2);
 #endif
-                WRITE_LONG(newres + 8 + 4 * x, READ_LONG(newres + 8 + 4 * x2) +
-                                                   colsize[x2] - colsize[x]);
-                break;
-            }
+            WRITE_LONG(newres + 8 + 4 * x, READ_LONG(newres + 8 + 4 * x2) +
+                                               ctx->colsize[x2] -
+                                               ctx->colsize[x]);
         }
-
-        // Not found, append new column.
-        if (unsquash_mode || i2 >= i)
+        else
         {
+            // Not found, append new column.
             WRITE_LONG(newres + 8 + 4 * x, newres_len);
-            AppendBytes(&newres, &newres_len, &newres_size, columns[x],
-                        colsize[x]);
+            AppendBytes(&newres, &newres_len, &newres_size, ctx->columns[x],
+                        ctx->colsize[x]);
+            if (!unsquash)
+            {
+                AddColumnSuffixes(ctx, x);
+            }
         }
     }
 
     free(sorted_map);
 
-    if (!unsquash_mode && newres_len > wf->entries[entrynum].length)
+    if (!unsquash && newres_len > wf->entries[entrynum].length)
     {
         // The new resource was bigger than the old one!
         free(newres);
@@ -188,42 +622,42 @@ uint8_t *S_Squash(wad_file_t *wf, unsigned int entrynum)
     }
 }
 
-// Unsquash a picture. Unsquashing rebuilds the image, just like when we
-// do the squashing, except that we set a special flag that skips
-// searching for identical columns.
-uint8_t *S_Unsquash(wad_file_t *wf, unsigned int entrynum)
+// Squashes a graphic. Call with the lump number and the header read by
+// S_IsGraphic(), returns a pointer to the new(compressed) lump. This must be
+// free()d when it is no longer needed, as S_Squash() does not do this
+// itself.
+uint8_t *S_Squash(squash_context_t *ctx, wad_file_t *wf, unsigned int entrynum,
+                  const graphic_header_t *header)
 {
-    uint8_t *result;
-
-    unsquash_mode = true;
-    result = S_Squash(wf, entrynum);
-    unsquash_mode = false;
+    return RebuildGraphic(ctx, wf, entrynum, header, false);
+}
 
-    return result;
+// Unsquash a picture. Unsquashing rebuilds the image, just like when we
+// do the squashing, except that we skip searching for identical columns.
+uint8_t *S_Unsquash(squash_context_t *ctx, wad_file_t *wf,
+                    unsigned int entrynum, const graphic_header_t *header)
+{
+    return RebuildGraphic(ctx, wf, entrynum, header, true);
 }
 
-static bool ParseLump(uint8_t *lump, size_t lump_len)
+// Finds the columns of the given graphic lump and their lengths. The
+// column offsets have already been checked by S_IsGraphic().
+static bool ParseLump(squash_context_t *ctx, uint8_t *lump, size_t lump_len,
+                      const graphic_header_t *header)
 {
     int x;
 
-    width = READ_SHORT(lump);
-    height = READ_SHORT(lump + 2);
-    loffset = READ_SHORT(lump + 4);
-    toffset = READ_SHORT(lump + 6);
+    ctx->width = header->width;
 
-    columns = REALLOC_ARRAY(uint8_t *, columns, width);
-    colsize = REALLOC_ARRAY(unsigned int, colsize, width);
+    ctx->columns = REALLOC_ARRAY(uint8_t *, ctx->columns, ctx->width);
+    ctx->colsize = REALLOC_ARRAY(unsigned int, ctx->colsize, ctx->width);
 
-    for (x = 0; x < width; x++)
+    for (x = 0; x < ctx->width; x++)
     {
-        uint32_t offset = READ_LONG(lump + 8 + 4 * x);
-        if (offset > lump_len)
-        {
-            ErrorExit("Column %d offset invalid: %08x > length %ld", x, offset,
-                      lump_len);
-        }
-        columns[x] = lump + offset;
-        if (!FindColumnLength(x, columns[x], lump_len - offset, &colsize[x]))
+        uint32_t offset = header->offsets[x];
+        ctx->columns[x] = lump + offset;
+        if (!FindColumnLength(x, ctx->columns[x], lump_len - offset,
+                              &ctx->colsize[x]))
         {
             return false;
         }
@@ -261,11 +695,12 @@ static bool FindColumnLength(unsigned int x, const uint8_t *column, size_t len,
 static int ColumnOffsetCompare(unsigned int a, unsigned int b,
                                const void *callback_data)
 {
-    (void) callback_data;
-    return columns[a] - columns[b];
+    const squash_context_t *ctx = callback_data;
+    return ctx->columns[a] - ctx->columns[b];
 }
 
-bool S_IsSquashed(wad_file_t *wf, unsigned int entrynum)
+bool S_IsSquashed(squash_context_t *ctx, wad_file_t *wf,
+                  unsigned int entrynum, const graphic_header_t *header)
 {
     bool result = false;
     uint8_t *pic, *col_min;
@@ -273,29 +708,29 @@ bool S_IsSquashed(wad_file_t *wf, unsigned int entrynum)
     unsigned int *sorted_map;
 
     pic = CacheLump(wf, entrynum);
-    if (!ParseLump(pic, wf->entries[entrynum].length))
+    if (!ParseLump(ctx, pic, wf->entries[entrynum].length, header))
     {
         free(pic);
         return false;
     }
 
-    sorted_map = MakeSortedMap(width, ColumnOffsetCompare, NULL);
+    sorted_map = MakeSortedMap(ctx->width, ColumnOffsetCompare, ctx);
     col_min = pic;
 
-    for (i = 0; i < width; i++)
+    for (i = 0; i < ctx->width; i++)
     {
         unsigned int x = sorted_map[i];
 #ifdef DEBUG
-        printf("#%04d: Column %4d: %04x - %04x\n", i, x, columns[x] - pic,
-               columns[x] - pic + colsize[x]);
+        printf("#%04d: Column %4d: %04x - %04x\n", i, x, ctx->columns[x] - pic,
+               ctx->columns[x] - pic + ctx->colsize[x]);
 #endif
-        if (columns[x] < col_min)
+        if (ctx->columns[x] < col_min)
         {
             // This column overlaps with the previous column.
             result = true;
             break;
         }
-        col_min = columns[x] + colsize[x];
+        col_min = ctx->columns[x] + ctx->colsize[x];
     }
 
     free(sorted_map);
@@ -304,59 +739,99 @@ bool S_IsSquashed(wad_file_t *wf, unsigned int entrynum)
     return result;
 }
 
-bool S_IsGraphic(wad_file_t *wf, unsigned int entrynum)
+// Calculates a hash of the given graphic lump that covers the header and
+// the pixels in each column, but not the layout of the columns and posts
+// within the lump; a squashed graphic has the same hash as the original.
+// Returns false if the lump could not be parsed.
+bool S_HashGraphic(squash_context_t *ctx, wad_file_t *wf,
+                   unsigned int entrynum, const graphic_header_t *header,
+                   sha1_digest_t hash)
 {
-    uint8_t *graphic, *columns;
-    char *s = wf->entries[entrynum].name;
-    unsigned int count;
-    unsigned short width, height;
+    sha1_context_t sha1_ctx;
+    uint8_t *pic, *buf = NULL;
+    size_t buf_len;
+    unsigned int x, i, j;
+    int top;
 
-    if (!strncmp(s, "ENDOOM", 8))
-        return false;
-    if (IsLevelEntry(s))
-        return false;
-    if (!strncmp(s, "DS", 2) || !strncmp(s, "DP", 2) || !strncmp(s, "D_", 2))
+    pic = CacheLump(wf, entrynum);
+    if (!ParseLump(ctx, pic, wf->entries[entrynum].length, header))
     {
-        // sfx or music
+        free(pic);
         return false;
     }
 
-    if (wf->entries[entrynum].length < 8)
+    SHA1_Init(&sha1_ctx);
+    SHA1_Update(&sha1_ctx, pic, 8);
+
+    for (x = 0; x < ctx->width; x++)
     {
-        // too short
-        return false;
+        const uint8_t *post = ctx->columns[x];
+
+        // Each pixel is hashed along with its row number, so that it
+        // does not matter how the column was split into posts. Posts in
+        // tall patches are placed as source ports do (see IsTallColumn).
+        buf = REALLOC_ARRAY(uint8_t, buf, ctx->colsize[x] * 3 + 2);
+        buf_len = 0;
+        top = -1;
+        for (i = 0; post[i] != 0xff; i += post[i + 1] + 4)
+        {
+            top = post[i] <= top ? top + post[i] : post[i];
+            for (j = 0; j < post[i + 1]; j++)
+            {
+                WRITE_SHORT(buf + buf_len, top + j);
+                buf[buf_len + 2] = post[i + 3 + j];
+                buf_len += 3;
+            }
+        }
+        WRITE_SHORT(buf + buf_len, 0xffff);
+        SHA1_Update(&sha1_ctx, buf, buf_len + 2);
     }
-    graphic = CacheLump(wf, entrynum);
+    SHA1_Final(hash, &sha1_ctx);
 
-    width = READ_SHORT(graphic);
-    height = READ_SHORT(graphic + 2);
-    columns = graphic + 8;
+    free(buf);
+    free(pic);
+    return true;
+}
 
-    if (width > 1024 || height > 240 || width <= 0 || height <= 0 ||
-        width * 4 + 8U > wf->entries[entrynum].length)
+// Checks whether the given lump, which ClassifyLumps() found could be a
+// graphic, looks like one. Only its header and table of column offsets are
+// read, and these are returned in header so that they do not need to be
+// read again.
+bool S_IsGraphic(wad_file_t *wf, unsigned int entrynum,
+                 graphic_header_t *header)
+{
+    uint8_t buf[8 + 4 * MAX_GRAPHIC_WIDTH];
+    uint32_t length = wf->entries[entrynum].length;
+    unsigned int count;
+
+    if (length < 8)
     {
-        free(graphic);
+        // too short
         return false;
     }
 
-    if (wf->entries[entrynum].length == 4096 || // flat
-        wf->entries[entrynum].length == 4000)   // endoom
+    ReadLump(wf, entrynum, 0, buf, 8);
+    header->width = READ_SHORT(buf);
+    header->height = READ_SHORT(buf + 2);
+
+    if (header->width > MAX_GRAPHIC_WIDTH ||
+        header->height > MAX_GRAPHIC_HEIGHT || header->width <= 0 ||
+        header->height <= 0 || header->width * 4 + 8U > length)
     {
-        // It could be a graphic, but better safe than sorry
-        free(graphic);
         return false;
     }
 
-    for (count = 0; count < width; count++)
+    ReadLump(wf, entrynum, 8, buf + 8, header->width * 4);
+
+    for (count = 0; count < header->width; count++)
     {
-        if (READ_LONG(columns + 4 * count) > wf->entries[entrynum].length)
+        header->offsets[count] = READ_LONG(buf + 8 + 4 * count);
+        if (header->offsets[count] > length)
         {
             // Can't be a graphic resource; offset outside lump
-            free(graphic);
             return false;
         }
     }
-    free(graphic);
 
     // If it has passed all these checks, it must be a graphic (well, probably)
     return true;
@@ -18,11 +18,69 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "sha1.h"
 #include "waddir.h"
 
-uint8_t *S_Squash(wad_file_t *wf, unsigned int entrynum);
-uint8_t *S_Unsquash(wad_file_t *wf, unsigned int entrynum);
-bool S_IsSquashed(wad_file_t *wf, unsigned int entrynum);
-bool S_IsGraphic(wad_file_t *wf, unsigned int entrynum);
+#define MAX_GRAPHIC_WIDTH  1024
+#define MAX_GRAPHIC_HEIGHT 240
+
+// Header of a graphic lump along with its column offsets, as read and
+// checked by S_IsGraphic(); the offsets are all within the lump.
+typedef struct {
+    unsigned short width, height;
+    uint32_t offsets[MAX_GRAPHIC_WIDTH];
+} graphic_header_t;
+
+// An entry in the index of column suffixes used when squashing.
+typedef struct {
+    uint32_t hash;
+    unsigned int column, len;
+} column_suffix_t;
+
+// Everything needed while working on a graphic, so that more than one can
+// be worked on at a time. The arrays are kept between graphics so that
+// they only need to be reallocated when a bigger one comes along.
+typedef struct {
+    // Picture width from header.
+    unsigned short width;
+
+    uint8_t **columns;
+    unsigned int *colsize;
+
+    // Index of every suffix of the columns added to the new lump so far,
+    // so that a column that is identical to, or a suffix of, an earlier
+    // column can be found with a single lookup. Each distinct suffix is
+    // only indexed once, for the first column it was found in; empty
+    // slots have a len of zero.
+    column_suffix_t *suffixes;
+    size_t suffixes_mask, suffixes_count;
+
+    // Hashes of the suffixes of the column being looked up or added, by
+    // the index of the first byte of each suffix.
+    uint32_t *suffix_hashes;
+
+    // For each column, the number of other columns that would have to
+    // have a post split for it to become a suffix of them.
+    unsigned int *split_costs;
+
+    // Copies of the columns with their posts combined, and then re-split,
+    // which the columns array points into once they have been built.
+    uint8_t *combined, *resplit;
+    size_t combined_size, resplit_size;
+} squash_context_t;
+
+void S_InitContext(squash_context_t *ctx);
+void S_FreeContext(squash_context_t *ctx);
+uint8_t *S_Squash(squash_context_t *ctx, wad_file_t *wf, unsigned int entrynum,
+                  const graphic_header_t *header);
+uint8_t *S_Unsquash(squash_context_t *ctx, wad_file_t *wf,
+                    unsigned int entrynum, const graphic_header_t *header);
+bool S_IsSquashed(squash_context_t *ctx, wad_file_t *wf,
+                  unsigned int entrynum, const graphic_header_t *header);
+bool S_IsGraphic(wad_file_t *wf, unsigned int entrynum,
+                 graphic_header_t *header);
+bool S_HashGraphic(squash_context_t *ctx, wad_file_t *wf,
+                   unsigned int entrynum, const graphic_header_t *header,
+                   sha1_digest_t hash);
 
 #endif
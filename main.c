@@ -20,7 +20,10 @@
 #include "blockmap.h"
 #include "errors.h"
 #include "graphics.h"
+#include "reject.h"
 #include "sidedefs.h"
+#include "udmf.h"
+#include "waddiff.h"
 #include "waddir.h"
 #include "wadmerge.h"
 #include "wadptr.h"
@@ -37,10 +40,12 @@ typedef struct {
     long squashed;
     long packed;
     long stacked;
+    long rejects;
     long merged;
 } compress_stats_t;
 
 static bool Compress(const char *filename);
+static bool Combine(const char *wadname, char **filenames, int num_files);
 static bool Decompress(const char *filename);
 static bool ListEntries(const char *filename);
 static bool DoAction(const char *filename);
@@ -55,7 +60,7 @@ static char **g_argv;
 
 static int filelist_index;
 static const char *outputwad = NULL;
-static enum { HELP, COMPRESS, DECOMPRESS, LIST } action;
+static enum { HELP, COMPRESS, DECOMPRESS, LIST, DIFF, COMBINE } action;
 
 bool allowpack = true;   // level packing on
 bool allowsquash = true; // picture squashing on
@@ -64,7 +69,11 @@ bool allowstack = true;  // blockmap stacking
 bool extsides = false;   // extended sidedefs limit
 bool extblocks = false;  // extended blockmap limit
 bool wipesides = false;  // clear unneeded texture references
-static bool psx_format = false;
+bool mergesectors = false; // merge identical sectors
+bool prune = false;        // remove unused level data
+bool buildblocks = false;  // rebuild blockmaps from linedefs
+bool nozeroblocks = false; // strip leading zeros from block lists
+bool emptyreject = false;  // leave out REJECT tables with no bits set
 static bool quiet_mode = false;
 
 static bool FileExists(const char *filename)
@@ -185,6 +194,16 @@ int main(int argc, char *argv[])
 
     ParseCommandLine();
 
+    if (action == DIFF)
+    {
+        return !DiffWads(g_argv[filelist_index], g_argv[filelist_index + 1]);
+    }
+    else if (action == COMBINE)
+    {
+        return !Combine(outputwad, &g_argv[filelist_index],
+                        g_argc - filelist_index);
+    }
+
     for (index = filelist_index; index < g_argc; ++index)
     {
         if (!DoAction(g_argv[index]))
@@ -232,6 +251,26 @@ static void ParseCommandLine(void)
         {
             action = DECOMPRESS;
         }
+        else if (!strcmp(arg, "-diff"))
+        {
+            action = DIFF;
+        }
+        else if (!strcmp(arg, "-combine"))
+        {
+            if (i + 1 >= g_argc)
+            {
+                ErrorExit("The -combine argument requires an output filename "
+                          "to be specified.");
+            }
+            if (outputwad != NULL)
+            {
+                ErrorExit("The -combine and -o arguments cannot be used "
+                          "together.");
+            }
+            action = COMBINE;
+            outputwad = g_argv[i + 1];
+            ++i;
+        }
         else if (!strcmp(arg, "-quiet") || !strcmp(arg, "-q"))
         {
             quiet_mode = true;
@@ -264,6 +303,26 @@ static void ParseCommandLine(void)
         {
             wipesides = true;
         }
+        else if (!strcmp(arg, "-mergesectors"))
+        {
+            mergesectors = true;
+        }
+        else if (!strcmp(arg, "-prune"))
+        {
+            prune = true;
+        }
+        else if (!strcmp(arg, "-buildblocks"))
+        {
+            buildblocks = true;
+        }
+        else if (!strcmp(arg, "-blockmap-nozero"))
+        {
+            nozeroblocks = true;
+        }
+        else if (!strcmp(arg, "-emptyreject"))
+        {
+            emptyreject = true;
+        }
         else if (!strcmp(arg, "-version") || !strcmp(arg, "-v"))
         {
             printf("%s\n", VERSION);
@@ -276,6 +335,11 @@ static void ParseCommandLine(void)
                 ErrorExit("The -o argument requires a filename "
                           "to be specified.");
             }
+            if (action == COMBINE)
+            {
+                ErrorExit("The -combine and -o arguments cannot be used "
+                          "together.");
+            }
             if (outputwad != NULL)
             {
                 ErrorExit("The -o argument can only be specified once.");
@@ -304,11 +368,17 @@ static void ParseCommandLine(void)
     {
         ErrorExit("No input WAD files specified.");
     }
-    else if (outputwad != NULL && g_argc - filelist_index != 1)
+    else if (action != COMBINE && outputwad != NULL &&
+             g_argc - filelist_index != 1)
     {
         ErrorExit("Only one input file can be specified when using -output.");
     }
 
+    if (action == DIFF && g_argc - filelist_index != 2)
+    {
+        ErrorExit("Exactly two input files must be specified with -diff.");
+    }
+
     if (action == DECOMPRESS && !allowmerge)
     {
         ErrorExit("Sorry, decompressing will undo any lump merging on WADs. \n"
@@ -342,36 +412,54 @@ static void Help(void)
         "<https://soulsphere.org/projects/wadptr/>\n"
         "\n"
         "Usage: wadptr [options] <-c|-d|-l> inputwad [inputwad inputwad...]\n"
+        "       wadptr -diff wad1 wad2\n"
+        "       wadptr [options] -combine outputwad inputwad [inputwad...]\n"
         "\n"
         " Commands:            Options:\n"
         " -c  Compress WAD     -o <file>  Write output WAD to <file>\n"
         " -d  Decompress WAD   -q         Quiet mode; suppress normal output\n"
         " -l  List WAD         -nomerge   Disable lump merging\n"
         " -v  Display version  -nosquash  Disable graphic squashing\n"
-        "                      -nopack    Disable sidedef packing\n"
+        " -diff  Compare WADs  -nopack    Disable sidedef packing\n"
         "                      -nostack   Disable blockmap stacking\n"
         "                      -extsides  Extended sidedefs limit\n"
         "                      -extblocks Extended blockmap limit\n"
         "                      -wipesides Clear unneeded texture references\n"
+        "                      -mergesectors Merge identical sectors\n"
+        "                      -prune     Remove unneeded level data\n"
+        "                      -buildblocks Rebuild blockmaps\n"
+        "                      -blockmap-nozero Strip zeros from blockmaps\n"
+        "                      -emptyreject Leave out empty REJECT tables\n"
         "\n");
 }
 
-// Checks for the lump names unique to PSX levels (and Doom 64).
-static bool IsPlaystationWad(wad_file_t *wf)
+// Writes a lump that was generated in memory to the output file, updating
+// its directory entry to point to it.
+static void WriteLumpData(FILE *out_file, entry_t *entry, lump_t *lump)
 {
-    return EntryExists(wf, "LEAFS") >= 0 || EntryExists(wf, "LIGHTS") >= 0;
+    entry->offset = WriteWadLump(out_file, lump->data, lump->len);
+    entry->length = lump->len;
+    free(lump->data);
 }
 
-// LINEDEFS and SIDEDEFS lumps follow each other in Doom WADs. This is
-// baked into the engine - Doom doesn't actually even look at the names.
-static bool IsSidedefs(wad_file_t *wf, int count)
+// Keeps a lump that was rebuilt while packing an earlier lump, to be
+// written when its own place in the directory is reached.
+static void SetPendingLump(wad_file_t *wf, lump_t *pending,
+                           unsigned int lump_index, lump_t *lump)
 {
-    return !strncmp(wf->entries[count].name, "SIDEDEFS", 8) && count > 0 &&
-           !strncmp(wf->entries[count - 1].name, "LINEDEFS", 8);
+    if (lump->data != NULL && lump_index < wf->num_entries)
+    {
+        pending[lump_index] = *lump;
+    }
+    else
+    {
+        free(lump->data);
+    }
 }
 
 static bool TryPack(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
-                    bool *sidedefs_larger, compress_stats_t *stats)
+                    lump_t *pending, bool *sidedefs_larger,
+                    compress_stats_t *stats)
 {
     uint32_t orig_lump_len = wf->entries[lump_index].length;
 
@@ -384,15 +472,24 @@ static bool TryPack(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
     }
     else if (IsSidedefs(wf, lump_index))
     {
+        packed_level_t level;
         bool success;
 
         SPAMMY_PRINTF("Packing");
         fflush(stdout);
 
-        success = P_Pack(wf, lump_index);
+        success = P_Pack(wf, lump_index, &level);
+
+        WriteLumpData(out_file, &wf->entries[lump_index - 1],
+                      &level.linedefs);
+        WriteLumpData(out_file, &wf->entries[lump_index], &level.sidedefs);
 
-        P_WriteLinedefs(out_file, &wf->entries[lump_index - 1]);
-        P_WriteSidedefs(out_file, &wf->entries[lump_index]);
+        // The lumps that follow are changed if vertices or sectors were
+        // renumbered; they are written later, in their usual place.
+        SetPendingLump(wf, pending, lump_index + 1, &level.vertexes);
+        SetPendingLump(wf, pending, lump_index + 2, &level.segs);
+        SetPendingLump(wf, pending, lump_index + 5, &level.sectors);
+        SetPendingLump(wf, pending, lump_index + 6, &level.reject);
 
         if (success)
         {
@@ -401,7 +498,8 @@ static bool TryPack(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
                 PercentSmaller(orig_lump_len, wf->entries[lump_index].length));
             *sidedefs_larger = *sidedefs_larger ||
                                wf->entries[lump_index].length > orig_lump_len;
-            stats->packed += orig_lump_len - wf->entries[lump_index].length;
+            stats->packed +=
+                (long) orig_lump_len - (long) wf->entries[lump_index].length;
         }
         else
         {
@@ -411,14 +509,61 @@ static bool TryPack(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
 
         return true;
     }
+    else if (U_IsTextmap(wf, lump_index))
+    {
+        lump_t textmap;
+
+        SPAMMY_PRINTF("Packing");
+        fflush(stdout);
+
+        if (U_Pack(wf, lump_index, &textmap))
+        {
+            SPAMMY_PRINTF(" (%s), done.\n",
+                          PercentSmaller(orig_lump_len, textmap.len));
+            stats->packed += (long) orig_lump_len - (long) textmap.len;
+        }
+        else
+        {
+            SPAMMY_PRINTF(" (0%%), failed.\n");
+        }
+
+        WriteLumpData(out_file, &wf->entries[lump_index], &textmap);
+        return true;
+    }
 
     return false;
 }
 
+// With -buildblocks, new blockmaps are built before anything is written,
+// since the LINEDEFS and VERTEXES lumps they are built from may have been
+// replaced by the time each BLOCKMAP lump is reached. Returns an array
+// with an entry for each lump, which is empty where no blockmap was built.
+static lump_t *BuildBlockmaps(wad_file_t *wf)
+{
+    lump_t *built;
+    unsigned int i;
+
+    built = ALLOC_ARRAY(lump_t, wf->num_entries);
+    memset(built, 0, sizeof(lump_t) * wf->num_entries);
+
+    for (i = 0; buildblocks && i < wf->num_entries; i++)
+    {
+        if (strncmp(wf->entries[i].name, "BLOCKMAP", 8) == 0)
+        {
+            SetContextLump(wf->entries[i].name);
+            B_Build(wf, i, &built[i]);
+        }
+    }
+
+    SetContextLump(NULL);
+    return built;
+}
+
 static bool TryStack(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
-                     compress_stats_t *stats)
+                     lump_t *built, compress_stats_t *stats)
 {
     uint32_t orig_lump_len = wf->entries[lump_index].length;
+    lump_t blockmap;
     bool success;
 
     if (strncmp(wf->entries[lump_index].name, "BLOCKMAP", 8) != 0)
@@ -429,15 +574,24 @@ static bool TryStack(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
     SPAMMY_PRINTF("Stacking ");
     fflush(stdout);
 
-    success = B_Stack(wf, lump_index);
-    B_WriteBlockmap(out_file, &wf->entries[lump_index]);
+    if (built[lump_index].data != NULL)
+    {
+        blockmap = built[lump_index];
+        success = true;
+    }
+    else
+    {
+        success = B_Stack(wf, lump_index, &blockmap);
+    }
+    WriteLumpData(out_file, &wf->entries[lump_index], &blockmap);
 
     if (success)
     {
         SPAMMY_PRINTF(
             "(%s), done.\n",
             PercentSmaller(orig_lump_len, wf->entries[lump_index].length));
-        stats->stacked += orig_lump_len - wf->entries[lump_index].length;
+        stats->stacked +=
+            (long) orig_lump_len - (long) wf->entries[lump_index].length;
     }
     else
     {
@@ -450,13 +604,64 @@ static bool TryStack(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
     return true;
 }
 
+// Writes a REJECT lump that was compacted by R_CompactReject(). A table
+// with no bits set may have been replaced by an empty lump.
+static void WriteRejectData(FILE *out_file, entry_t *entry, lump_t *reject)
+{
+    if (reject->len == 0)
+    {
+        free(reject->data);
+        entry->offset = 0;
+        entry->length = 0;
+    }
+    else
+    {
+        WriteLumpData(out_file, entry, reject);
+    }
+}
+
+static bool TryCompactReject(wad_file_t *wf, unsigned int lump_index,
+                             FILE *out_file, compress_stats_t *stats)
+{
+    uint32_t orig_lump_len = wf->entries[lump_index].length;
+    lump_t reject;
+
+    if (strncmp(wf->entries[lump_index].name, "REJECT", 8) != 0 ||
+        orig_lump_len == 0)
+    {
+        return false;
+    }
+
+    reject.data = CacheLump(wf, lump_index);
+    reject.len = orig_lump_len;
+    if (!R_CompactReject(wf, lump_index, &reject))
+    {
+        free(reject.data);
+        return false;
+    }
+
+    SPAMMY_PRINTF("Compacting ");
+    fflush(stdout);
+
+    WriteRejectData(out_file, &wf->entries[lump_index], &reject);
+
+    SPAMMY_PRINTF(
+        "(%s), done.\n",
+        PercentSmaller(orig_lump_len, wf->entries[lump_index].length));
+    stats->rejects +=
+        (long) orig_lump_len - (long) wf->entries[lump_index].length;
+
+    return true;
+}
+
 static bool TrySquash(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
-                      compress_stats_t *stats)
+                      squash_context_t *squash_ctx, compress_stats_t *stats)
 {
     uint32_t orig_lump_len = wf->entries[lump_index].length;
+    graphic_header_t header;
     uint8_t *temp;
 
-    if (!S_IsGraphic(wf, lump_index))
+    if (!S_IsGraphic(wf, lump_index, &header))
     {
         return false;
     }
@@ -464,7 +669,7 @@ static bool TrySquash(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
     SPAMMY_PRINTF("Squashing ");
     fflush(stdout);
 
-    temp = S_Squash(wf, lump_index);
+    temp = S_Squash(squash_ctx, wf, lump_index, &header);
     wf->entries[lump_index].offset =
         WriteWadLump(out_file, temp, wf->entries[lump_index].length);
     free(temp);
@@ -489,6 +694,7 @@ static void PrintStats(const compress_stats_t *stats)
         {"Graphic squashing", stats->squashed},
         {"Blockmap stacking", stats->stacked},
         {"Sidedef packing", stats->packed},
+        {"REJECT compaction", stats->rejects},
         {"Lump merging", stats->merged},
         {"-", 0},
         {"Total", stats->orig_size - stats->new_size},
@@ -529,59 +735,89 @@ static long ExpectedSize(wad_file_t *wf)
     return result;
 }
 
-static bool Compress(const char *wadname)
+// Writes a lump that was rebuilt while packing an earlier lump. A REJECT
+// lump rebuilt because sectors were merged or pruned is compacted too.
+static void WritePendingLump(wad_file_t *wf, unsigned int lump_index,
+                             FILE *out_file, lump_t *lump,
+                             compress_stats_t *stats)
 {
-    wad_file_t wf;
-    unsigned int count;
-    compress_stats_t stats;
-    FILE *fstream;
-    bool written, sidedefs_larger = false;
-    char *tempwad_name;
+    uint32_t orig_lump_len = wf->entries[lump_index].length;
+    size_t packed_len = lump->len;
 
-    if (!OpenWadFile(&wf, wadname))
+    if (strncmp(wf->entries[lump_index].name, "REJECT", 8) == 0 &&
+        R_CompactReject(wf, lump_index, lump))
     {
-        return false;
+        WriteRejectData(out_file, &wf->entries[lump_index], lump);
     }
-    if (wf.type == WAD_FILE_IWAD && !IwadWarning(wadname))
+    else
     {
-        return false;
+        WriteLumpData(out_file, &wf->entries[lump_index], lump);
     }
-    psx_format = IsPlaystationWad(&wf);
-
-    memset(&stats, 0, sizeof(compress_stats_t));
-    stats.orig_size = FileSize(wf.fp);
-    stats.junk_bytes = stats.orig_size - ExpectedSize(&wf);
-    stats.junk_bytes = MAX(stats.junk_bytes, 0);
 
-    fstream =
-        OpenTempFile(outputwad != NULL ? outputwad : wadname, &tempwad_name);
+    SPAMMY_PRINTF(
+        "Packing (%s), done.\n",
+        PercentSmaller(orig_lump_len, wf->entries[lump_index].length));
+    stats->packed += (long) orig_lump_len - (long) packed_len;
+    stats->rejects +=
+        (long) packed_len - (long) wf->entries[lump_index].length;
+}
 
-    for (count = 0; count < wf.num_entries; count++)
+// Compresses every lump in the given WAD, writing the compressed lumps to
+// the given output file. The WAD's directory entries are updated to point
+// to the new lump locations.
+static void CompressEntries(wad_file_t *wf, FILE *fstream,
+                            compress_stats_t *stats, bool *sidedefs_larger)
+{
+    unsigned int count;
+    squash_context_t squash_ctx;
+    lump_type_t *types;
+    lump_t *pending, *built;
+    bool written;
+
+    pending = ALLOC_ARRAY(lump_t, wf->num_entries);
+    memset(pending, 0, sizeof(lump_t) * wf->num_entries);
+    built = BuildBlockmaps(wf);
+    types = ClassifyLumps(wf);
+    S_InitContext(&squash_ctx);
+
+    for (count = 0; count < wf->num_entries; count++)
     {
-        SetContextLump(wf.entries[count].name);
-        SPAMMY_PRINTF("Adding: %-8.8s       ", wf.entries[count].name);
+        SetContextLump(wf->entries[count].name);
+        SPAMMY_PRINTF("Adding: %-8.8s       ", wf->entries[count].name);
         fflush(stdout);
         written = false;
 
-        if (!written && allowpack && !psx_format)
+        if (pending[count].data != NULL)
+        {
+            WritePendingLump(wf, count, fstream, &pending[count], stats);
+            written = true;
+        }
+
+        if (!written && types[count] == LUMP_LEVEL && allowpack)
         {
-            written = TryPack(&wf, count, fstream, &sidedefs_larger, &stats);
+            written =
+                TryPack(wf, count, fstream, pending, sidedefs_larger, stats);
         }
 
-        if (!written && allowstack)
+        if (!written && types[count] == LUMP_LEVEL && allowstack)
         {
-            written = TryStack(&wf, count, fstream, &stats);
+            written = TryStack(wf, count, fstream, built, stats);
         }
 
-        if (!written && allowsquash)
+        if (!written && types[count] == LUMP_LEVEL && allowpack)
         {
-            written = TrySquash(&wf, count, fstream, &stats);
+            written = TryCompactReject(wf, count, fstream, stats);
         }
 
-        if (!written && wf.entries[count].length == 0)
+        if (!written && types[count] == LUMP_GRAPHIC && allowsquash)
+        {
+            written = TrySquash(wf, count, fstream, &squash_ctx, stats);
+        }
+
+        if (!written && wf->entries[count].length == 0)
         {
             SPAMMY_PRINTF("Empty (0%%).\n");
-            wf.entries[count].offset = 0;
+            wf->entries[count].offset = 0;
             written = true;
         }
 
@@ -590,38 +826,44 @@ static bool Compress(const char *wadname)
             uint8_t *temp;
             SPAMMY_PRINTF("Storing ");
             fflush(stdout);
-            temp = CacheLump(&wf, count);
-            wf.entries[count].offset =
-                WriteWadLump(fstream, temp, wf.entries[count].length);
+            temp = CacheLump(wf, count);
+            wf->entries[count].offset =
+                WriteWadLump(fstream, temp, wf->entries[count].length);
             free(temp);
             SPAMMY_PRINTF("(0%%), done.\n");
         }
     }
 
+    S_FreeContext(&squash_ctx);
+    free(pending);
+    free(built);
+    free(types);
     SetContextLump(NULL);
+}
 
-    WriteWadDirectory(fstream, wf.type, wf.entries, wf.num_entries);
-    stats.new_size = FileSize(fstream);
-
-    fclose(fstream);
-    CloseWadFile(&wf);
+// Takes the temporary WAD generated by CompressEntries(), merges identical
+// lumps if enabled, and renames the result to the given output filename.
+static void FinishCompress(char *tempwad_name, const char *wadname,
+                           compress_stats_t *stats, bool sidedefs_larger)
+{
+    wad_file_t wf;
+    FILE *fstream;
 
     if (allowmerge)
     {
         char *tempwad2_name;
 
         OpenWadFile(&wf, tempwad_name);
-        fstream = OpenTempFile(outputwad != NULL ? outputwad : wadname,
-                               &tempwad2_name);
+        fstream = OpenTempFile(wadname, &tempwad2_name);
 
         SPAMMY_PRINTF("\nMerging identical lumps...");
         fflush(stdout);
         RebuildMergedWad(&wf, fstream);
         SPAMMY_PRINTF(" done.\n");
 
-        stats.new_size = FileSize(fstream);
-        stats.merged = stats.orig_size - stats.new_size - stats.squashed -
-                       stats.stacked - stats.packed;
+        stats->new_size = FileSize(fstream);
+        stats->merged = stats->orig_size - stats->new_size - stats->squashed -
+                        stats->stacked - stats->packed - stats->rejects;
 
         fclose(fstream);
         CloseWadFile(&wf);
@@ -642,23 +884,22 @@ static bool Compress(const char *wadname)
     // simple rename() call. However! The Windows version of rename()
     // does not overwrite existing files, so we have to delete first.
 #ifdef _WIN32
-    if (remove(outputwad != NULL ? outputwad : wadname) < 0 && errno != ENOENT)
+    if (remove(wadname) < 0 && errno != ENOENT)
     {
         perror("remove");
-        ErrorExit("Failed to remove old input file '%s' for rename.",
-                  outputwad != NULL ? outputwad : wadname);
+        ErrorExit("Failed to remove old input file '%s' for rename.", wadname);
     }
 #endif
-    if (rename(tempwad_name, outputwad != NULL ? outputwad : wadname) < 0)
+    if (rename(tempwad_name, wadname) < 0)
     {
         perror("rename");
         ErrorExit("Failed to rename temporary file '%s' to '%s'", tempwad_name,
-                  outputwad != NULL ? outputwad : wadname);
+                  wadname);
     }
 
     free(tempwad_name);
 
-    PrintStats(&stats);
+    PrintStats(stats);
 
     if (sidedefs_larger)
     {
@@ -667,6 +908,119 @@ static bool Compress(const char *wadname)
                       "section \"Sidedefs on Special Lines\" in the\nmanual "
                       "for more information.\n");
     }
+}
+
+static bool Compress(const char *wadname)
+{
+    wad_file_t wf;
+    compress_stats_t stats;
+    FILE *fstream;
+    bool sidedefs_larger = false;
+    char *tempwad_name;
+
+    if (!OpenWadFile(&wf, wadname))
+    {
+        return false;
+    }
+    if (wf.type == WAD_FILE_IWAD && !IwadWarning(wadname))
+    {
+        return false;
+    }
+
+    memset(&stats, 0, sizeof(compress_stats_t));
+    stats.orig_size = FileSize(wf.fp);
+    stats.junk_bytes = stats.orig_size - ExpectedSize(&wf);
+    stats.junk_bytes = MAX(stats.junk_bytes, 0);
+
+    fstream =
+        OpenTempFile(outputwad != NULL ? outputwad : wadname, &tempwad_name);
+
+    CompressEntries(&wf, fstream, &stats, &sidedefs_larger);
+
+    WriteWadDirectory(fstream, wf.type, wf.entries, wf.num_entries);
+    stats.new_size = FileSize(fstream);
+
+    fclose(fstream);
+    CloseWadFile(&wf);
+
+    FinishCompress(tempwad_name, outputwad != NULL ? outputwad : wadname,
+                   &stats, sidedefs_larger);
+
+    return true;
+}
+
+// Compresses several WADs into a single output WAD. The directories of
+// the input WADs are concatenated in order so that load order semantics
+// are preserved, and lump merging then deduplicates identical lumps
+// across all of the inputs.
+static bool Combine(const char *wadname, char **filenames, int num_files)
+{
+    wad_file_t wf;
+    wad_file_type_t type = WAD_FILE_PWAD;
+    entry_t *entries = NULL;
+    size_t num_entries = 0;
+    compress_stats_t stats;
+    FILE *fstream;
+    bool sidedefs_larger = false;
+    char *tempwad_name;
+    long file_size;
+    int i;
+
+    memset(&stats, 0, sizeof(compress_stats_t));
+    fstream = OpenTempFile(wadname, &tempwad_name);
+
+    for (i = 0; i < num_files; i++)
+    {
+        SetContextFilename(filenames[i]);
+        if (!OpenWadFile(&wf, filenames[i]))
+        {
+            fclose(fstream);
+            remove(tempwad_name);
+            free(tempwad_name);
+            free(entries);
+            return false;
+        }
+        if (wf.type == WAD_FILE_IWAD && !IwadWarning(filenames[i]))
+        {
+            CloseWadFile(&wf);
+            fclose(fstream);
+            remove(tempwad_name);
+            free(tempwad_name);
+            free(entries);
+            return false;
+        }
+
+        // The combined WAD is an IWAD only if it is built on top of one.
+        if (i == 0)
+        {
+            type = wf.type;
+        }
+
+        file_size = FileSize(wf.fp);
+        stats.orig_size += file_size;
+        stats.junk_bytes += MAX(file_size - ExpectedSize(&wf), 0);
+
+        SPAMMY_PRINTF("Combining %s:\n", filenames[i]);
+        CompressEntries(&wf, fstream, &stats, &sidedefs_larger);
+
+        entries =
+            REALLOC_ARRAY(entry_t, entries, num_entries + wf.num_entries);
+        memcpy(&entries[num_entries], wf.entries,
+               wf.num_entries * sizeof(entry_t));
+        num_entries += wf.num_entries;
+
+        CloseWadFile(&wf);
+    }
+
+    SetContextFilename(wadname);
+
+    WriteWadDirectory(fstream, type, entries, num_entries);
+    stats.new_size = FileSize(fstream);
+
+    fclose(fstream);
+    free(entries);
+
+    FinishCompress(tempwad_name, wadname, &stats, sidedefs_larger);
 
     return true;
 }
@@ -682,15 +1036,16 @@ static bool TryUnpack(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
     }
     else if (IsSidedefs(wf, lump_index))
     {
+        lump_t linedefs, sidedefs;
         bool success;
 
         SPAMMY_PRINTF("Unpacking");
         fflush(stdout);
 
-        success = P_Unpack(wf, lump_index);
+        success = P_Unpack(wf, lump_index, &linedefs, &sidedefs);
 
-        P_WriteLinedefs(out_file, &wf->entries[lump_index - 1]);
-        P_WriteSidedefs(out_file, &wf->entries[lump_index]);
+        WriteLumpData(out_file, &wf->entries[lump_index - 1], &linedefs);
+        WriteLumpData(out_file, &wf->entries[lump_index], &sidedefs);
 
         if (success)
         {
@@ -703,6 +1058,27 @@ static bool TryUnpack(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
         }
         return true;
     }
+    else if (U_IsTextmap(wf, lump_index))
+    {
+        lump_t textmap;
+
+        SPAMMY_PRINTF("Unpacking");
+        fflush(stdout);
+
+        // A warning is printed if the lump cannot be parsed, so there is
+        // no need to set *had_failure.
+        if (U_Unpack(wf, lump_index, &textmap))
+        {
+            SPAMMY_PRINTF(", done.\n");
+        }
+        else
+        {
+            SPAMMY_PRINTF(", failed.\n");
+        }
+
+        WriteLumpData(out_file, &wf->entries[lump_index], &textmap);
+        return true;
+    }
 
     return false;
 }
@@ -710,6 +1086,7 @@ static bool TryUnpack(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
 static bool TryUnstack(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
                        bool *had_failure)
 {
+    lump_t blockmap;
     bool success;
 
     if (strncmp(wf->entries[lump_index].name, "BLOCKMAP", 8) != 0)
@@ -720,8 +1097,8 @@ static bool TryUnstack(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
     SPAMMY_PRINTF("Unstacking");
     fflush(stdout);
 
-    success = B_Unstack(wf, lump_index);
-    B_WriteBlockmap(out_file, &wf->entries[lump_index]);
+    success = B_Unstack(wf, lump_index, &blockmap);
+    WriteLumpData(out_file, &wf->entries[lump_index], &blockmap);
 
     if (success)
     {
@@ -736,18 +1113,20 @@ static bool TryUnstack(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
     return true;
 }
 
-static bool TryUnsquash(wad_file_t *wf, unsigned int lump_index, FILE *out_file)
+static bool TryUnsquash(wad_file_t *wf, unsigned int lump_index, FILE *out_file,
+                        squash_context_t *squash_ctx)
 {
+    graphic_header_t header;
     uint8_t *temp;
 
-    if (!S_IsGraphic(wf, lump_index))
+    if (!S_IsGraphic(wf, lump_index, &header))
     {
         return false;
     }
 
     SPAMMY_PRINTF("Unsquashing");
     fflush(stdout);
-    temp = S_Unsquash(wf, lump_index);
+    temp = S_Unsquash(squash_ctx, wf, lump_index, &header);
     wf->entries[lump_index].offset =
         WriteWadLump(out_file, temp, wf->entries[lump_index].length);
     free(temp);
@@ -762,6 +1141,8 @@ static bool Decompress(const char *wadname)
     char *tempwad_name;
     FILE *fstream;
     uint8_t *tempres;
+    squash_context_t squash_ctx;
+    lump_type_t *types;
     bool written, blockmap_failures = false, sidedefs_failures = false;
     unsigned int count;
 
@@ -773,9 +1154,10 @@ static bool Decompress(const char *wadname)
     {
         return false;
     }
-    psx_format = IsPlaystationWad(&wf);
 
     fstream = OpenTempFile(wadname, &tempwad_name);
+    types = ClassifyLumps(&wf);
+    S_InitContext(&squash_ctx);
 
     for (count = 0; count < wf.num_entries; count++)
     {
@@ -785,17 +1167,17 @@ static bool Decompress(const char *wadname)
         SPAMMY_PRINTF("Adding: %-8.8s       ", wf.entries[count].name);
         fflush(stdout);
 
-        if (allowpack && !psx_format)
+        if (types[count] == LUMP_LEVEL && allowpack)
         {
             written = TryUnpack(&wf, count, fstream, &sidedefs_failures);
         }
-        if (!written && allowstack)
+        if (!written && types[count] == LUMP_LEVEL && allowstack)
         {
             written = TryUnstack(&wf, count, fstream, &blockmap_failures);
         }
-        if (!written && allowsquash)
+        if (!written && types[count] == LUMP_GRAPHIC && allowsquash)
         {
-            written = TryUnsquash(&wf, count, fstream);
+            written = TryUnsquash(&wf, count, fstream, &squash_ctx);
         }
 
         if (!written && wf.entries[count].length == 0)
@@ -817,6 +1199,8 @@ static bool Decompress(const char *wadname)
         }
     }
 
+    S_FreeContext(&squash_ctx);
+    free(types);
     SetContextLump(NULL);
 
     WriteWadDirectory(fstream, wf.type, wf.entries, wf.num_entries);
@@ -870,13 +1254,17 @@ static bool Decompress(const char *wadname)
     return true;
 }
 
-static const char *CompressionMethod(wad_file_t *wf, int lumpnum)
+static const char *CompressionMethod(wad_file_t *wf, int lumpnum,
+                                     lump_type_t type,
+                                     squash_context_t *squash_ctx)
 {
+    graphic_header_t header;
+
     if (wf->entries[lumpnum].length == 0)
     {
         return "Empty";
     }
-    else if (!psx_format && IsSidedefs(wf, lumpnum))
+    else if (type == LUMP_LEVEL && IsSidedefs(wf, lumpnum))
     {
         // This is a level:
         if (P_IsPacked(wf, lumpnum))
@@ -888,10 +1276,22 @@ static const char *CompressionMethod(wad_file_t *wf, int lumpnum)
             return "Unpacked";
         }
     }
-    else if (S_IsGraphic(wf, lumpnum))
+    else if (type == LUMP_LEVEL && U_IsTextmap(wf, lumpnum))
+    {
+        // This is a UDMF level:
+        if (U_IsPacked(wf, lumpnum))
+        {
+            return "Packed";
+        }
+        else
+        {
+            return "Unpacked";
+        }
+    }
+    else if (type == LUMP_GRAPHIC && S_IsGraphic(wf, lumpnum, &header))
     {
         // This is a graphic:
-        if (S_IsSquashed(wf, lumpnum))
+        if (S_IsSquashed(squash_ctx, wf, lumpnum, &header))
         {
             return "Squashed";
         }
@@ -900,7 +1300,8 @@ static const char *CompressionMethod(wad_file_t *wf, int lumpnum)
             return "Unsquashed";
         }
     }
-    else if (!strncmp(wf->entries[lumpnum].name, "BLOCKMAP", 8))
+    else if (type == LUMP_LEVEL &&
+             !strncmp(wf->entries[lumpnum].name, "BLOCKMAP", 8))
     {
         if (B_IsStacked(wf, lumpnum))
         {
@@ -921,13 +1322,17 @@ static const char *CompressionMethod(wad_file_t *wf, int lumpnum)
 static bool ListEntries(const char *wadname)
 {
     wad_file_t wf;
+    squash_context_t squash_ctx;
+    lump_type_t *types;
     unsigned int i, j;
 
     if (!OpenWadFile(&wf, wadname))
     {
         return false;
     }
-    psx_format = IsPlaystationWad(&wf);
+
+    types = ClassifyLumps(&wf);
+    S_InitContext(&squash_ctx);
 
     SPAMMY_PRINTF(
         " Number  Length  Offset      Method      Name        Shared\n"
@@ -937,7 +1342,8 @@ static bool ListEntries(const char *wadname)
     {
         SetContextLump(wf.entries[i].name);
         printf("%7d %7d  0x%08x  %-11s %-8.8s    ", i + 1, wf.entries[i].length,
-               wf.entries[i].offset, CompressionMethod(&wf, i),
+               wf.entries[i].offset,
+               CompressionMethod(&wf, i, types[i], &squash_ctx),
                wf.entries[i].name);
 
         // shared resource?
@@ -956,6 +1362,8 @@ static bool ListEntries(const char *wadname)
         }
     }
 
+    S_FreeContext(&squash_ctx);
+    free(types);
     SetContextLump(NULL);
     CloseWadFile(&wf);
 
@@ -0,0 +1,153 @@
+/*
+ * Copyright(C) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *
+ * Compaction of the REJECT lump. The table only needs one bit for each
+ * pair of sectors; anything after that is padding and can be removed,
+ * and a table with no bits set can be left out entirely.
+ */
+
+#include "reject.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "errors.h"
+#include "sectors.h"
+#include "sha1.h"
+#include "waddir.h"
+#include "wadptr.h"
+
+// Finds the number of bytes that the REJECT lump at the given index needs
+// to hold a bit for every pair of sectors in its level. Returns false if
+// the lump does not follow a SECTORS lump, or the level is in one of the
+// console formats, which have sectors of a different size.
+static bool RejectSize(wad_file_t *wf, unsigned int lumpnum, size_t *size)
+{
+    size_t num_sectors;
+
+    if (lumpnum < 1 ||
+        strncmp(wf->entries[lumpnum].name, "REJECT", 8) != 0 ||
+        strncmp(wf->entries[lumpnum - 1].name, "SECTORS", 8) != 0 ||
+        (wf->entries[lumpnum - 1].length % SECTOR_SIZE) != 0)
+    {
+        return false;
+    }
+
+    if (lumpnum + 2 < wf->num_entries &&
+        !strncmp(wf->entries[lumpnum + 2].name, "LEAFS", 8))
+    {
+        return false;
+    }
+
+    num_sectors = wf->entries[lumpnum - 1].length / SECTOR_SIZE;
+    *size = (num_sectors * num_sectors + 7) / 8;
+    return true;
+}
+
+// Checks whether the table is all zeros, a machine word at a time. REJECT
+// tables can be hundreds of kilobytes for large levels.
+static bool IsAllZero(const uint8_t *data, size_t len)
+{
+    uint64_t word;
+    size_t i;
+
+    for (i = 0; i + sizeof(word) <= len; i += sizeof(word))
+    {
+        memcpy(&word, data + i, sizeof(word));
+        if (word != 0)
+        {
+            return false;
+        }
+    }
+    for (; i < len; i++)
+    {
+        if (data[i] != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Compacts the given contents of the REJECT lump at the given index,
+// removing any padding after the end of the table. With -emptyreject, a
+// table with no bits set is replaced by an empty lump. Returns true if
+// anything changed, in which case the lump is updated in place; if it
+// became empty, its data is freed and set to NULL.
+bool R_CompactReject(wad_file_t *wf, unsigned int lumpnum, lump_t *reject)
+{
+    size_t size;
+
+    if (reject->len == 0 || !RejectSize(wf, lumpnum, &size))
+    {
+        return false;
+    }
+
+    // The engine would read past the end of a table that is too short;
+    // we cannot tell what it would find there, so leave it alone.
+    if (reject->len < size)
+    {
+        Warning("Lump is too short for the number of sectors: %d < %d bytes",
+                (int) reject->len, (int) size);
+        return false;
+    }
+
+    if (emptyreject && IsAllZero(reject->data, size))
+    {
+        free(reject->data);
+        reject->data = NULL;
+        reject->len = 0;
+        return true;
+    }
+
+    if (reject->len == size)
+    {
+        return false;
+    }
+
+    reject->len = size;
+    return true;
+}
+
+// Calculates a hash of the given REJECT lump that covers only the table
+// itself, so that it is the same whether or not the lump was compacted. An
+// empty lump is treated as a table with no bits set, as source ports do.
+// Returns false if the lump cannot be checked against its level.
+bool R_HashReject(wad_file_t *wf, unsigned int lumpnum, sha1_digest_t hash)
+{
+    sha1_context_t ctx;
+    size_t size, len = wf->entries[lumpnum].length;
+    uint8_t *reject;
+
+    if (!RejectSize(wf, lumpnum, &size) || (len != 0 && len < size))
+    {
+        return false;
+    }
+
+    if (len == 0)
+    {
+        reject = ALLOC_ARRAY(uint8_t, size);
+        memset(reject, 0, size);
+    }
+    else
+    {
+        reject = CacheLump(wf, lumpnum);
+    }
+
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, reject, size);
+    SHA1_Final(hash, &ctx);
+
+    free(reject);
+    return true;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright(C) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *
+ * Compaction of the REJECT lump. The table only needs one bit for each
+ * pair of sectors; anything after that is padding and can be removed,
+ * and a table with no bits set can be left out entirely.
+ */
+
+#ifndef __REJECT_H_INCLUDED__
+#define __REJECT_H_INCLUDED__
+
+#include <stdbool.h>
+
+#include "sha1.h"
+#include "waddir.h"
+
+bool R_CompactReject(wad_file_t *wf, unsigned int lumpnum, lump_t *reject);
+bool R_HashReject(wad_file_t *wf, unsigned int lumpnum, sha1_digest_t hash);
+
+#endif
@@ -36,6 +36,7 @@ deutex_extract() {
 test_wad_file() {
     local fn=$1
     local orig_size=$(file_size "$fn")
+    cp "$fn" $wd/orig.wad
     deutex_extract $fn $wd/deutex-orig
     if ! ./wadptr -c $fn; then
         return 1
@@ -45,6 +46,11 @@ test_wad_file() {
         return 1
     fi
 
+    if ! ./wadptr -diff $wd/orig.wad $fn; then
+        echo "Compressed WAD is not equivalent to the original"
+        return 1
+    fi
+
     if ! ./wadptr -o $wd/compr2.wad -c $fn || ! diff $fn $wd/compr2.wad; then
         echo "WAD differs after compression a second time"
         return 1
@@ -70,6 +76,11 @@ test_wad_file() {
         return 1
     fi
 
+    if ! ./wadptr -diff $wd/orig.wad $fn; then
+        echo "Decompressed WAD is not equivalent to the original"
+        return 1
+    fi
+
     if ! ./wadptr -o $wd/decompr2.wad -d $fn ||
        ! diff $fn $wd/decompr2.wad; then
         echo "WAD differs after decompression a second time"
@@ -108,6 +119,251 @@ for wad in $(find test -name '*.wad'); do
     fi
 done
 
+test_combine() {
+    local total_size=0
+    local wad
+    for wad in "$@"; do
+        total_size=$((total_size + $(file_size "$wad")))
+    done
+    if ! ./wadptr -combine $wd/combined.wad "$@"; then
+        return 1
+    fi
+
+    if ! ./wadptr -l $wd/combined.wad; then
+        return 1
+    fi
+
+    local combined_size=$(file_size $wd/combined.wad)
+    if ! [ $combined_size -lt $total_size ]; then
+        echo "combined size: $combined_size" \
+            "not smaller than total size: $total_size"
+        return 1
+    fi
+}
+
+if test_combine $(find test -name '*.wad') >$wd/log 2>&1; then
+    echo "PASS combine"
+else
+    echo "FAIL combine"
+    sed "s/^/| /" < $wd/log
+    all_success=false
+fi
+
+test_prune() {
+    cp test/packable.wad test/prunable.wad $wd
+    if ! ./wadptr -c $wd/packable.wad; then
+        return 1
+    fi
+
+    if ! ./wadptr -prune -c $wd/prunable.wad; then
+        return 1
+    fi
+
+    if ! cmp $wd/packable.wad $wd/prunable.wad; then
+        echo "Pruned WAD does not match compressed packable.wad"
+        return 1
+    fi
+}
+
+if test_prune >$wd/log 2>&1; then
+    echo "PASS prune"
+else
+    echo "FAIL prune"
+    sed "s/^/| /" < $wd/log
+    all_success=false
+fi
+
+test_mergesectors() {
+    cp test/merged.wad test/mergeable.wad $wd
+    if ! ./wadptr -c $wd/merged.wad; then
+        return 1
+    fi
+
+    if ! ./wadptr -mergesectors -c $wd/mergeable.wad; then
+        return 1
+    fi
+
+    if ! cmp $wd/merged.wad $wd/mergeable.wad; then
+        echo "Merged WAD does not match compressed merged.wad"
+        return 1
+    fi
+
+    # A switch with tag 0 can move every sector in zerotag.wad.
+    cp test/zerotag.wad $wd
+    cp test/zerotag.wad $wd/zerotag-merged.wad
+    if ! ./wadptr -c $wd/zerotag.wad ||
+       ! ./wadptr -mergesectors -c $wd/zerotag-merged.wad; then
+        return 1
+    fi
+
+    if ! cmp $wd/zerotag.wad $wd/zerotag-merged.wad; then
+        echo "Sectors that can move were merged"
+        return 1
+    fi
+}
+
+if test_mergesectors >$wd/log 2>&1; then
+    echo "PASS mergesectors"
+else
+    echo "FAIL mergesectors"
+    sed "s/^/| /" < $wd/log
+    all_success=false
+fi
+
+test_wipesides() {
+    cp test/wipeable.wad test/wiped.wad test/zerotag.wad $wd
+    cp test/zerotag.wad $wd/zerotag-wiped.wad
+    if ! ./wadptr -c $wd/wiped.wad ||
+       ! ./wadptr -wipesides -c $wd/wipeable.wad; then
+        return 1
+    fi
+
+    if ! cmp $wd/wiped.wad $wd/wipeable.wad; then
+        echo "Wiped WAD does not match compressed wiped.wad"
+        return 1
+    fi
+
+    if ! ./wadptr -c $wd/zerotag.wad ||
+       ! ./wadptr -wipesides -c $wd/zerotag-wiped.wad; then
+        return 1
+    fi
+
+    if ! cmp $wd/zerotag.wad $wd/zerotag-wiped.wad; then
+        echo "Textures next to sectors that can move were wiped"
+        return 1
+    fi
+}
+
+if test_wipesides >$wd/log 2>&1; then
+    echo "PASS wipesides"
+else
+    echo "FAIL wipesides"
+    sed "s/^/| /" < $wd/log
+    all_success=false
+fi
+
+reject_size() {
+    ./wadptr -l "$1" | while read _ len _ _ name _; do
+        if [ "$name" = REJECT ]; then
+            echo "$len"
+        fi
+    done
+}
+
+# padreject.wad has a REJECT table with no bits set that is padded out to
+# 64 bytes. The padding should be removed, and with -emptyreject, so
+# should the table.
+test_reject() {
+    cp test/padreject.wad $wd/orig.wad
+    cp test/padreject.wad $wd/trimmed.wad
+    cp test/padreject.wad $wd/empty.wad
+    if ! ./wadptr -c $wd/trimmed.wad ||
+       ! ./wadptr -emptyreject -c $wd/empty.wad; then
+        return 1
+    fi
+
+    if [ "$(reject_size $wd/trimmed.wad)" != 1 ]; then
+        echo "REJECT padding was not removed"
+        return 1
+    fi
+
+    if [ "$(reject_size $wd/empty.wad)" != 0 ]; then
+        echo "Empty REJECT table was not removed"
+        return 1
+    fi
+
+    if ! ./wadptr -diff $wd/orig.wad $wd/trimmed.wad ||
+       ! ./wadptr -diff $wd/orig.wad $wd/empty.wad; then
+        echo "Compacted WAD is not equivalent to the original"
+        return 1
+    fi
+
+    # A REJECT table rebuilt after merging sectors is removed too.
+    cp test/mergeable.wad $wd
+    if ! ./wadptr -mergesectors -emptyreject -c $wd/mergeable.wad; then
+        return 1
+    fi
+
+    if [ "$(reject_size $wd/mergeable.wad)" != 0 ]; then
+        echo "Rebuilt REJECT table was not removed"
+        return 1
+    fi
+}
+
+if test_reject >$wd/log 2>&1; then
+    echo "PASS reject"
+else
+    echo "FAIL reject"
+    sed "s/^/| /" < $wd/log
+    all_success=false
+fi
+
+# crymap02.wad has an empty BLOCKMAP; -buildblocks should build a valid
+# one that does not change when the WAD is compressed again.
+test_buildblocks() {
+    cp test/crymap02.wad $wd
+    if ! ./wadptr -buildblocks -c $wd/crymap02.wad; then
+        return 1
+    fi
+
+    if ! ./wadptr -l $wd/crymap02.wad | grep -q "Stacked *BLOCKMAP"; then
+        echo "No BLOCKMAP was built"
+        return 1
+    fi
+
+    if ! ./wadptr -o $wd/rebuilt2.wad -c $wd/crymap02.wad 2>$wd/stderr ||
+       [ -s $wd/stderr ] || ! cmp $wd/crymap02.wad $wd/rebuilt2.wad; then
+        echo "Built BLOCKMAP is not valid"
+        cat $wd/stderr
+        return 1
+    fi
+}
+
+if test_buildblocks >$wd/log 2>&1; then
+    echo "PASS buildblocks"
+else
+    echo "FAIL buildblocks"
+    sed "s/^/| /" < $wd/log
+    all_success=false
+fi
+
+# Compressing with -blockmap-nozero strips the leading zeros from block
+# lists; decompressing with it again should put them back.
+test_nozero() {
+    cp test/stackable.wad $wd/orig.wad
+    cp test/stackable.wad $wd
+    if ! ./wadptr -blockmap-nozero -c $wd/stackable.wad; then
+        return 1
+    fi
+
+    if ./wadptr -diff $wd/orig.wad $wd/stackable.wad; then
+        echo "Leading zeros were not stripped"
+        return 1
+    fi
+
+    if ! ./wadptr -blockmap-nozero -diff $wd/orig.wad $wd/stackable.wad; then
+        echo "Compressed WAD is not equivalent to the original"
+        return 1
+    fi
+
+    if ! ./wadptr -blockmap-nozero -d $wd/stackable.wad; then
+        return 1
+    fi
+
+    if ! ./wadptr -diff $wd/orig.wad $wd/stackable.wad; then
+        echo "Decompressed WAD is not equivalent to the original"
+        return 1
+    fi
+}
+
+if test_nozero >$wd/log 2>&1; then
+    echo "PASS blockmap-nozero"
+else
+    echo "FAIL blockmap-nozero"
+    sed "s/^/| /" < $wd/log
+    all_success=false
+fi
+
 if ! $all_success; then
     exit 1
 fi
@@ -0,0 +1,354 @@
+/*
+ * Copyright(C) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *
+ * Rebuilding of the SECTORS lump. Neighboring sectors that are identical
+ * and can never change during play can be combined into a single sector,
+ * and sectors that no sidedef refers to can be removed.
+ */
+
+#include "sectors.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "specials.h"
+#include "waddir.h"
+#include "wadptr.h"
+
+// Linedef flag that stops sound from passing through the line.
+#define ML_SOUNDBLOCK 0x40
+
+static bool RejectBit(const uint8_t *reject, size_t num_sectors, size_t s1,
+                      size_t s2)
+{
+    size_t bit = s1 * num_sectors + s2;
+    return (reject[bit / 8] & (1 << (bit % 8))) != 0;
+}
+
+static void SetRejectBit(uint8_t *reject, size_t num_sectors, size_t s1,
+                         size_t s2)
+{
+    size_t bit = s1 * num_sectors + s2;
+    reject[bit / 8] |= 1 << (bit % 8);
+}
+
+// The REJECT table must give the same answer for both sectors; otherwise
+// monsters would see (or not see) things they could not before.
+static bool RejectMatches(const uint8_t *reject, size_t num_sectors, size_t s1,
+                          size_t s2)
+{
+    size_t i;
+
+    if (reject == NULL)
+    {
+        return true;
+    }
+
+    for (i = 0; i < num_sectors; i++)
+    {
+        if (RejectBit(reject, num_sectors, s1, i) !=
+                RejectBit(reject, num_sectors, s2, i) ||
+            RejectBit(reject, num_sectors, i, s1) !=
+                RejectBit(reject, num_sectors, i, s2))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t FindGroup(uint32_t *groups, uint32_t s)
+{
+    while (groups[s] != s)
+    {
+        groups[s] = groups[groups[s]];
+        s = groups[s];
+    }
+    return s;
+}
+
+static bool CheckLevel(wad_file_t *wf, unsigned int sector_num,
+                       const sector_line_t *lines, size_t num_lines)
+{
+    size_t i, num_sectors, reject_len;
+
+    if (sector_num + 1 >= wf->num_entries ||
+        strncmp(wf->entries[sector_num].name, "SECTORS", 8) != 0 ||
+        strncmp(wf->entries[sector_num + 1].name, "REJECT", 8) != 0 ||
+        wf->entries[sector_num].length == 0 ||
+        (wf->entries[sector_num].length % SECTOR_SIZE) != 0)
+    {
+        return false;
+    }
+
+    // A REJECT lump that is too short would be read past its end by the
+    // game; we cannot tell what it would find there, so leave it alone.
+    // Some source ports allow it to be empty, though.
+    num_sectors = wf->entries[sector_num].length / SECTOR_SIZE;
+    reject_len = (num_sectors * num_sectors + 7) / 8;
+    if (wf->entries[sector_num + 1].length != 0 &&
+        wf->entries[sector_num + 1].length < reject_len)
+    {
+        return false;
+    }
+
+    for (i = 0; i < num_lines; i++)
+    {
+        if ((lines[i].front_sector != NO_SECTOR &&
+             lines[i].front_sector >= num_sectors) ||
+            (lines[i].back_sector != NO_SECTOR &&
+             lines[i].back_sector >= num_sectors))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Finds which sectors can be merged at all. A sector must have no tag and
+// no special, and not be next to any special line (manual doors and lifts
+// act on the sector behind the line), so that it never changes during
+// play. It must also be open, since a closed sector blocks sight and
+// sound even between two identical sectors.
+static bool *FindMergeable(const uint8_t *sectors, size_t num_sectors,
+                           const sector_line_t *lines, size_t num_lines)
+{
+    bool *mergeable = ALLOC_ARRAY(bool, num_sectors);
+    const uint8_t *cptr;
+    size_t i;
+
+    for (i = 0, cptr = sectors; i < num_sectors; i++, cptr += SECTOR_SIZE)
+    {
+        mergeable[i] = READ_SHORT(cptr + SECTOR_SPECIAL) == 0 &&
+                       READ_SHORT(cptr + SECTOR_TAG) == 0 &&
+                       (short) READ_SHORT(cptr + SECTOR_CEILING) >
+                           (short) READ_SHORT(cptr + SECTOR_FLOOR);
+    }
+
+    for (i = 0; i < num_lines; i++)
+    {
+        if (lines[i].type == 0)
+        {
+            continue;
+        }
+        if (lines[i].front_sector != NO_SECTOR)
+        {
+            mergeable[lines[i].front_sector] = false;
+        }
+        if (lines[i].back_sector != NO_SECTOR)
+        {
+            mergeable[lines[i].back_sector] = false;
+        }
+    }
+
+    return mergeable;
+}
+
+// Joins identical neighboring sectors into groups. Only sectors that meet
+// across a two-sided line are merged: sound spreads through a sector, so
+// merging two sectors that are apart would let sound jump between them.
+// For the same reason, lines that block sound are never used to merge
+// sectors. Stair builders and donuts can move sectors that are not tagged,
+// as can specials with tag 0, so nothing is merged in levels that contain
+// them; this is the same rule used when wiping textures.
+static void MergeGroups(const uint8_t *sectors, const uint8_t *reject,
+                        size_t num_sectors, const sector_line_t *lines,
+                        size_t num_lines, uint32_t *groups)
+{
+    bool *mergeable;
+    size_t i;
+
+    for (i = 0; i < num_lines; i++)
+    {
+        if (L_MovesUntaggedSectors(lines[i].type, lines[i].tag))
+        {
+            return;
+        }
+    }
+
+    mergeable = FindMergeable(sectors, num_sectors, lines, num_lines);
+
+    for (i = 0; i < num_lines; i++)
+    {
+        uint32_t s1 = lines[i].front_sector, s2 = lines[i].back_sector;
+        uint32_t g1, g2;
+
+        if (s1 == NO_SECTOR || s2 == NO_SECTOR || s1 == s2 ||
+            (lines[i].flags & ML_SOUNDBLOCK) != 0 || !mergeable[s1] ||
+            !mergeable[s2])
+        {
+            continue;
+        }
+
+        g1 = FindGroup(groups, s1);
+        g2 = FindGroup(groups, s2);
+        if (g1 == g2 ||
+            memcmp(sectors + s1 * SECTOR_SIZE, sectors + s2 * SECTOR_SIZE,
+                   SECTOR_SIZE) != 0 ||
+            !RejectMatches(reject, num_sectors, s1, s2))
+        {
+            continue;
+        }
+
+        // The lowest numbered sector in each group is the one kept.
+        groups[MAX(g1, g2)] = MIN(g1, g2);
+    }
+
+    free(mergeable);
+}
+
+// Finds the sectors that are on either side of at least one linedef; no
+// part of the level can be in any other sector.
+static bool *FindReferenced(size_t num_sectors, const sector_line_t *lines,
+                            size_t num_lines)
+{
+    bool *referenced = ALLOC_ARRAY(bool, num_sectors);
+    size_t i;
+
+    memset(referenced, 0, sizeof(bool) * num_sectors);
+
+    for (i = 0; i < num_lines; i++)
+    {
+        if (lines[i].front_sector != NO_SECTOR)
+        {
+            referenced[lines[i].front_sector] = true;
+        }
+        if (lines[i].back_sector != NO_SECTOR)
+        {
+            referenced[lines[i].back_sector] = true;
+        }
+    }
+
+    return referenced;
+}
+
+static void BuildReject(const uint8_t *reject, size_t num_sectors,
+                        const uint32_t *old_sectors, size_t new_num_sectors,
+                        lump_t *reject_lump)
+{
+    size_t i, j;
+
+    reject_lump->len = (new_num_sectors * new_num_sectors + 7) / 8;
+    reject_lump->data = ALLOC_ARRAY(uint8_t, reject_lump->len);
+    memset(reject_lump->data, 0, reject_lump->len);
+
+    for (i = 0; i < new_num_sectors; i++)
+    {
+        for (j = 0; j < new_num_sectors; j++)
+        {
+            if (RejectBit(reject, num_sectors, old_sectors[i],
+                          old_sectors[j]))
+            {
+                SetRejectBit(reject_lump->data, new_num_sectors, i, j);
+            }
+        }
+    }
+}
+
+// Rebuilds the SECTORS lump at the given index, which must be followed by
+// its REJECT lump. If merge is true, identical neighboring sectors are
+// merged (see MergeGroups); if prune is true, sectors that are not next to
+// any linedef are removed. If anything changed, returns true along with
+// the new SECTORS and REJECT lumps and a map from old to new sector
+// numbers, all of which the caller must free. An empty REJECT lump is left
+// as it is, and its data is returned as NULL.
+bool M_RebuildSectors(wad_file_t *wf, unsigned int sector_num,
+                      const sector_line_t *lines, size_t num_lines,
+                      bool merge, bool prune, uint32_t **sector_map,
+                      lump_t *sectors_lump, lump_t *reject_lump)
+{
+    uint8_t *sectors, *reject = NULL;
+    uint32_t *groups, *map, *old_sectors;
+    bool *referenced = NULL;
+    size_t i, num_sectors, new_num_sectors = 0;
+
+    if (!CheckLevel(wf, sector_num, lines, num_lines))
+    {
+        return false;
+    }
+
+    num_sectors = wf->entries[sector_num].length / SECTOR_SIZE;
+    sectors = CacheLump(wf, sector_num);
+    if (wf->entries[sector_num + 1].length > 0)
+    {
+        reject = CacheLump(wf, sector_num + 1);
+    }
+
+    groups = ALLOC_ARRAY(uint32_t, num_sectors);
+    for (i = 0; i < num_sectors; i++)
+    {
+        groups[i] = i;
+    }
+
+    if (merge)
+    {
+        MergeGroups(sectors, reject, num_sectors, lines, num_lines, groups);
+    }
+    if (prune)
+    {
+        referenced = FindReferenced(num_sectors, lines, num_lines);
+    }
+
+    map = ALLOC_ARRAY(uint32_t, num_sectors);
+    old_sectors = ALLOC_ARRAY(uint32_t, num_sectors);
+    for (i = 0; i < num_sectors; i++)
+    {
+        uint32_t g = FindGroup(groups, i);
+        if (g != i)
+        {
+            map[i] = map[g];
+        }
+        else if (referenced != NULL && !referenced[i])
+        {
+            map[i] = NO_SECTOR;
+        }
+        else
+        {
+            old_sectors[new_num_sectors] = i;
+            map[i] = new_num_sectors;
+            ++new_num_sectors;
+        }
+    }
+    free(referenced);
+    free(groups);
+
+    if (new_num_sectors == num_sectors || new_num_sectors == 0)
+    {
+        free(map);
+        free(old_sectors);
+        free(sectors);
+        free(reject);
+        return false;
+    }
+
+    sectors_lump->len = new_num_sectors * SECTOR_SIZE;
+    sectors_lump->data = ALLOC_ARRAY(uint8_t, sectors_lump->len);
+    for (i = 0; i < new_num_sectors; i++)
+    {
+        memcpy(sectors_lump->data + i * SECTOR_SIZE,
+               sectors + old_sectors[i] * SECTOR_SIZE, SECTOR_SIZE);
+    }
+
+    if (reject != NULL)
+    {
+        BuildReject(reject, num_sectors, old_sectors, new_num_sectors,
+                    reject_lump);
+    }
+
+    free(old_sectors);
+    free(sectors);
+    free(reject);
+
+    *sector_map = map;
+    return true;
+}
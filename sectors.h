@@ -0,0 +1,45 @@
+/*
+ * Copyright(C) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *
+ * Rebuilding of the SECTORS lump. Neighboring sectors that are identical
+ * and can never change during play can be combined into a single sector,
+ * and sectors that no sidedef refers to can be removed.
+ */
+
+#ifndef __SECTORS_H_INCLUDED__
+#define __SECTORS_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "waddir.h"
+
+#define SECTOR_FLOOR   0
+#define SECTOR_CEILING 2
+#define SECTOR_SPECIAL 22
+#define SECTOR_TAG     24
+#define SECTOR_SIZE    26
+
+#define NO_SECTOR UINT32_MAX
+
+// A linedef as seen by the sector merging code: the sector references of
+// its sidedefs, rather than the sidedefs themselves.
+typedef struct {
+    unsigned int type, flags, tag;
+    uint32_t front_sector, back_sector;
+} sector_line_t;
+
+bool M_RebuildSectors(wad_file_t *wf, unsigned int sector_num,
+                      const sector_line_t *lines, size_t num_lines,
+                      bool merge, bool prune, uint32_t **sector_map,
+                      lump_t *sectors_lump, lump_t *reject_lump);
+
+#endif
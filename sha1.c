@@ -34,6 +34,8 @@
 
 #include <string.h>
 
+#include "wadptr.h"
+
 void SHA1_Init(sha1_context_t *hd)
 {
     hd->h0 = 0x67452301;
@@ -14,25 +14,21 @@
 
 #include "sidedefs.h"
 
+#include <ctype.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 
 #include "errors.h"
-#include "sort.h"
+#include "sectors.h"
+#include "sha1.h"
+#include "specials.h"
+#include "vertices.h"
 #include "waddir.h"
 #include "wadptr.h"
 
-// Linedefs with tags in this range will have their sidedefs merged, even if
-// they're special lines.
-#define MERGE_RANGE_START 9700
-#define MERGE_RANGE_END   9799
-
-// Sidedefs in this merge domain are attached to special lines and are never
-// merged.
-#define MERGE_DOMAIN_SPECIAL 0
-
 // Vanilla Doom treats sidedef indexes as signed, but Boom and other ports
 // allow the full unsigned 16-bit range to be used. Note that MAX_EXT_SIDEDEFS
 // is one less than 0xffff since it's used to indicate "no sidedef".
@@ -40,6 +36,7 @@
 #define MAX_EXT_SIDEDEFS     0xfffe
 
 #define NO_SIDEDEF ((sidedef_ref_t) UINT32_MAX)
+#define NO_TEXTURE ((texture_ref_t) UINT32_MAX)
 
 // Portable structure I/O
 // (to handle endianness; also neither struct is a multiple of 4 in size)
@@ -70,18 +67,61 @@
 #define HX_LDEF_SDEF2 14
 #define HX_LDEF_SIZE  16
 
+// Doom 64 linedef format, which has 32-bit flags:
+#define D64_LDEF_VERT1 0
+#define D64_LDEF_VERT2 2
+#define D64_LDEF_FLAGS 4
+#define D64_LDEF_TYPES 8
+#define D64_LDEF_TAG   10
+#define D64_LDEF_SDEF1 12
+#define D64_LDEF_SDEF2 14
+#define D64_LDEF_SIZE  16
+
+// Doom 64 sidedef format, where textures are indexes instead of names:
+#define D64_SDEF_XOFF   0
+#define D64_SDEF_YOFF   2
+#define D64_SDEF_UPPER  4
+#define D64_SDEF_LOWER  6
+#define D64_SDEF_MIDDLE 8
+#define D64_SDEF_SECTOR 10
+#define D64_SDEF_SIZE   12
+
 // On disk, these are 16-bit integers. But while processing, we unpack
 // the sidedefs first, and the unpacked sidedefs might exceed the 16-bit
 // limit. So in memory we use a 32-bit integer even though when we write
 // the linedefs out again they will of course be 16-bit.
 typedef uint32_t sidedef_ref_t;
 
+// Texture names are interned when the SIDEDEFS lump is read, so that
+// sidedefs can be compared with integer operations. Every distinct
+// spelling of a name gets its own texture_ref_t, so that the original
+// spelling is preserved when the sidedefs are written back out.
+typedef uint32_t texture_ref_t;
+
+// Interned names are zero-padded in the same way as strncpy().
+typedef char texture_name_t[8];
+
+typedef struct {
+    texture_name_t *names;
+
+    // Texture names are case-insensitive, so each name also maps to the
+    // first interned spelling of the same name, which sidedefs are compared
+    // by.
+    texture_ref_t *folded;
+    size_t len, size;
+
+    // Open addressing hash tables for looking up names by exact spelling
+    // and case-insensitively; empty slots contain NO_TEXTURE.
+    texture_ref_t *by_name, *by_folded;
+    size_t mask;
+} texture_table_t;
+
 typedef struct {
     short xoffset;
     short yoffset;
-    char upper[8];
-    char middle[8];
-    char lower[8];
+    texture_ref_t upper;
+    texture_ref_t middle;
+    texture_ref_t lower;
     unsigned short sector_ref;
 
     // Sidedefs can only be merged if they are in the same merge domain. A
@@ -92,12 +132,12 @@ typedef struct {
 typedef struct {
     unsigned short vertex1;
     unsigned short vertex2;
-    unsigned short flags;
+    unsigned int flags;
     unsigned short type;
 
     // These fields depend on the level format:
     union {
-        unsigned short tag; // Only in Doom format
+        unsigned short tag; // Not in Hexen format
         uint8_t args[5];    // Only in Hexen format
     } x;
 
@@ -110,175 +150,419 @@ typedef struct {
     size_t len, size;
 } linedef_array_t;
 
+// Describes how the linedefs in a LINEDEFS lump are stored on disk.
 typedef struct {
-    sidedef_t *sides;
+    size_t size;
+    void (*decode)(const uint8_t *lump, linedef_t *lines, size_t len);
+    void (*encode)(const linedef_t *lines, size_t len, uint8_t *lump);
+} linedef_format_t;
+
+typedef enum {
+    FORMAT_DOOM,
+    FORMAT_HEXEN,
+    FORMAT_PSX,    // PSX Doom; Doom linedefs and sidedefs
+    FORMAT_DOOM64, // Doom 64; see the D64_* structures above
+} level_format_t;
+
+// Sidedefs are stored column-wise, with each of the fields of sidedef_t
+// in a separate array.
+typedef struct {
+    short *xoffset;
+    short *yoffset;
+    texture_ref_t *upper;
+    texture_ref_t *middle;
+    texture_ref_t *lower;
+    unsigned short *sector_ref;
+    uint8_t *merge_domain;
     size_t len, size;
+
+    // Table that the texture references point into.
+    texture_table_t *textures;
 } sidedef_array_t;
 
-static void CheckLumpSizes(wad_file_t *wf, unsigned int linedef_num,
-                           unsigned int sidedef_num);
-static sidedef_array_t DoPack(const sidedef_array_t *sidedefs);
-static void RemapLinedefs(linedef_array_t *linedefs);
-static bool RebuildSidedefs(const linedef_array_t *linedefs,
+// Describes how the sidedefs in a SIDEDEFS lump are stored on disk.
+typedef struct {
+    size_t size;
+    void (*decode)(const uint8_t *lump, sidedef_array_t *sidedefs);
+    void (*encode)(const sidedef_array_t *sidedefs, uint8_t *lump);
+} sidedef_format_t;
+
+typedef struct {
+    short floor_height;
+    short ceiling_height;
+
+    // True if the floor and ceiling can never move during play, so the
+    // visibility of upper and lower textures next to the sector is fixed.
+    bool is_static;
+} sector_t;
+
+// State for processing a single level. Nothing is kept in global variables,
+// so each level can be processed independently of any other.
+typedef struct {
+    wad_file_t *wf;
+    unsigned int linedef_num, sidedef_num;
+    level_format_t format;
+    texture_table_t textures;
+    texture_ref_t no_texture;
+
+    // Only read when -wipesides is enabled; otherwise num_sectors is zero.
+    sector_t *sectors;
+    size_t num_sectors;
+
+    // Bitmap of tags whose lines have their front sidedefs changed by
+    // another line's special (eg. Boom wall scrollers); NULL if none.
+    uint8_t *unsafe_tags;
+} level_t;
+
+static void InitLevel(level_t *level, wad_file_t *wf,
+                      unsigned int sidedef_num);
+static void FreeLevel(level_t *level);
+static bool CheckSidedefRefs(const linedef_array_t *linedefs,
+                             size_t num_sidedefs);
+static bool PackSidedefs(const level_t *level, linedef_array_t *linedefs,
+                         const sidedef_array_t *sidedefs,
+                         sidedef_array_t *sdresult);
+static void LinedefMergeDomains(const level_t *level, const linedef_t *ld,
+                                uint8_t *front_domain, uint8_t *back_domain);
+static void FindUnsafeTags(level_t *level, const linedef_array_t *linedefs);
+static void RebuildSectors(const level_t *level,
+                           const linedef_array_t *linedefs,
+                           sidedef_array_t *sidedefs, packed_level_t *result);
+static void RebuildVertices(const level_t *level, linedef_array_t *linedefs,
+                            packed_level_t *result);
+static void ReadSectors(level_t *level, const linedef_array_t *linedefs,
+                        const sidedef_array_t *sidedefs,
+                        const lump_t *merged_sectors);
+static bool RebuildSidedefs(const level_t *level,
+                            const linedef_array_t *linedefs,
                             const sidedef_array_t *sidedefs,
                             linedef_array_t *ldresult,
                             sidedef_array_t *sdresult);
 
-static linedef_array_t ReadDoomLinedefs(wad_file_t *wf, unsigned int lumpnum);
-static linedef_array_t ReadHexenLinedefs(wad_file_t *wf, unsigned int lumpnum);
-static sidedef_array_t ReadSidedefs(wad_file_t *wf, unsigned int lumpnum);
-static void WriteDoomLinedefs(const linedef_array_t *linedefs, FILE *fp);
-static void WriteHexenLinedefs(const linedef_array_t *linedefs, FILE *fp);
-static void WriteSidedefs(const sidedef_array_t *sidedefs, FILE *fp);
-
-static linedef_array_t linedefs_result;
-static sidedef_array_t sidedefs_result;
-static bool hexen_format;
-
-// Maps old sidedef number to new; used by RemapLinedefs() to update the
-// sidedef references in the LINEDEFS lump.
-static sidedef_ref_t *newsidedef_index;
+static const linedef_format_t *LinedefFormat(const level_t *level);
+static const sidedef_format_t *SidedefFormat(const level_t *level);
+static linedef_array_t ReadLinedefs(const level_t *level);
+static sidedef_array_t ReadSidedefs(level_t *level);
+static void EncodeLinedefs(const level_t *level,
+                           const linedef_array_t *linedefs, lump_t *lump);
+static void EncodeSidedefs(const level_t *level,
+                           const sidedef_array_t *sidedefs, lump_t *lump);
 
-static size_t SidedefsLimit(void)
+static uint32_t HashName(const char *name, bool fold)
 {
-    if (extsides)
+    uint32_t h = 2166136261u;
+    unsigned int i;
+
+    for (i = 0; i < 8; i++)
     {
-        return MAX_EXT_SIDEDEFS;
+        uint8_t c = (uint8_t) name[i];
+
+        if (fold)
+        {
+            c = toupper(c);
+        }
+        h = (h ^ c) * 16777619;
     }
-    return MAX_VANILLA_SIDEDEFS;
+
+    return h;
 }
 
-static size_t LinedefSize(void)
+static void InsertTextureSlots(texture_table_t *textures, texture_ref_t tex)
 {
-    if (hexen_format)
+    const char *name = textures->names[tex];
+    size_t i;
+
+    for (i = HashName(name, false) & textures->mask;
+         textures->by_name[i] != NO_TEXTURE; i = (i + 1) & textures->mask)
     {
-        return HX_LDEF_SIZE;
     }
-    return LDEF_SIZE;
+    textures->by_name[i] = tex;
+
+    // Only the first spelling of each name goes in the folded table.
+    if (textures->folded[tex] == tex)
+    {
+        for (i = HashName(name, true) & textures->mask;
+             textures->by_folded[i] != NO_TEXTURE; i = (i + 1) & textures->mask)
+        {
+        }
+        textures->by_folded[i] = tex;
+    }
 }
 
-static linedef_array_t ReadLinedefs(wad_file_t *wf, unsigned int lumpnum)
+static void ResizeTextureTable(texture_table_t *textures, size_t size)
 {
-    if (hexen_format)
+    texture_ref_t tex;
+    size_t i;
+
+    textures->size = size;
+    textures->names = REALLOC_ARRAY(texture_name_t, textures->names, size);
+    textures->folded = REALLOC_ARRAY(texture_ref_t, textures->folded, size);
+
+    // The hash tables are kept at most half full.
+    free(textures->by_name);
+    free(textures->by_folded);
+    textures->mask = size * 2 - 1;
+    textures->by_name = ALLOC_ARRAY(texture_ref_t, size * 2);
+    textures->by_folded = ALLOC_ARRAY(texture_ref_t, size * 2);
+    for (i = 0; i < size * 2; i++)
     {
-        return ReadHexenLinedefs(wf, lumpnum);
+        textures->by_name[i] = NO_TEXTURE;
+        textures->by_folded[i] = NO_TEXTURE;
     }
-    else
+
+    for (tex = 0; tex < textures->len; tex++)
     {
-        return ReadDoomLinedefs(wf, lumpnum);
+        InsertTextureSlots(textures, tex);
     }
 }
 
-// Packs the sidedefs in the given SIDEDEFS lump. It is assumed that the
-// matching LINEDEFS lump immediately precedes it in the WAD directory.
-// The resulting lumps must be written with P_WriteLinedefs() and
-// P_WriteSidedefs().
-// Returns true for success; false if sidedef packing failed (likely
-// because the result would overflow the limits of the format).
-bool P_Pack(wad_file_t *wf, unsigned int sidedef_num)
+static void InitTextures(texture_table_t *textures)
 {
-    sidedef_array_t orig_sidedefs, unpacked_sidedefs;
-    linedef_array_t orig_linedefs;
-    unsigned int linedef_num = sidedef_num - 1;
+    memset(textures, 0, sizeof(texture_table_t));
+    ResizeTextureTable(textures, 64);
+}
 
-    CheckLumpSizes(wf, linedef_num, sidedef_num);
+static void FreeTextures(texture_table_t *textures)
+{
+    free(textures->names);
+    free(textures->folded);
+    free(textures->by_name);
+    free(textures->by_folded);
+    memset(textures, 0, sizeof(texture_table_t));
+}
 
-    orig_sidedefs = ReadSidedefs(wf, sidedef_num);
-    orig_linedefs = ReadLinedefs(wf, linedef_num);
+// Returns the interned reference for the given texture name, which is up
+// to 8 characters long and not necessarily NUL-terminated.
+static texture_ref_t InternTexture(texture_table_t *textures, const char *name)
+{
+    char buf[8];
+    texture_ref_t tex;
+    size_t i;
 
-    if (!RebuildSidedefs(&orig_linedefs, &orig_sidedefs, &linedefs_result,
-                         &unpacked_sidedefs))
+    memset(buf, 0, sizeof(buf));
+    for (i = 0; i < 8 && name[i] != '\0'; i++)
     {
-        linedefs_result = orig_linedefs;
-        sidedefs_result = orig_sidedefs;
-        return true;
+        buf[i] = name[i];
     }
 
-    sidedefs_result = DoPack(&unpacked_sidedefs);
-    free(unpacked_sidedefs.sides);
+    for (i = HashName(buf, false) & textures->mask;
+         textures->by_name[i] != NO_TEXTURE; i = (i + 1) & textures->mask)
+    {
+        if (!memcmp(textures->names[textures->by_name[i]], buf, 8))
+        {
+            return textures->by_name[i];
+        }
+    }
 
-    // TODO: Check that the SIDEDEFS lump is never larger than the
-    // original one?
+    if (textures->len >= textures->size)
+    {
+        ResizeTextureTable(textures, textures->size * 2);
+    }
 
-    // We never generate a corrupt (overflowed) SIDEDEFS list.
-    if (sidedefs_result.len > SidedefsLimit())
+    tex = textures->len;
+    ++textures->len;
+    memcpy(textures->names[tex], buf, 8);
+    textures->folded[tex] = tex;
+
+    for (i = HashName(buf, true) & textures->mask;
+         textures->by_folded[i] != NO_TEXTURE; i = (i + 1) & textures->mask)
     {
-        free(sidedefs_result.sides);
-        sidedefs_result = orig_sidedefs;
-        free(linedefs_result.lines);
-        linedefs_result = orig_linedefs;
-        return false;
+        if (!strncasecmp(textures->names[textures->by_folded[i]], buf, 8))
+        {
+            textures->folded[tex] = textures->by_folded[i];
+            break;
+        }
     }
 
-    free(orig_sidedefs.sides);
-    free(orig_linedefs.lines);
-    RemapLinedefs(&linedefs_result);
-    return true;
+    InsertTextureSlots(textures, tex);
+    return tex;
 }
 
-void P_WriteLinedefs(FILE *fstream, entry_t *entry)
+static void ResizeSidedefs(sidedef_array_t *sidedefs, size_t size)
 {
-    // Writing an empty lump ensures that we are at a valid file
-    // location to do the actual write.
-    entry->offset = WriteWadLump(fstream, NULL, 0);
-    entry->length = linedefs_result.len * LinedefSize();
+    sidedefs->size = size;
+    sidedefs->xoffset = REALLOC_ARRAY(short, sidedefs->xoffset, size);
+    sidedefs->yoffset = REALLOC_ARRAY(short, sidedefs->yoffset, size);
+    sidedefs->upper = REALLOC_ARRAY(texture_ref_t, sidedefs->upper, size);
+    sidedefs->middle = REALLOC_ARRAY(texture_ref_t, sidedefs->middle, size);
+    sidedefs->lower = REALLOC_ARRAY(texture_ref_t, sidedefs->lower, size);
+    sidedefs->sector_ref =
+        REALLOC_ARRAY(unsigned short, sidedefs->sector_ref, size);
+    sidedefs->merge_domain =
+        REALLOC_ARRAY(uint8_t, sidedefs->merge_domain, size);
+}
 
-    if (hexen_format)
+static void AllocSidedefs(sidedef_array_t *sidedefs, size_t size,
+                          texture_table_t *textures)
+{
+    memset(sidedefs, 0, sizeof(sidedef_array_t));
+    ResizeSidedefs(sidedefs, MAX(size, 1));
+    sidedefs->textures = textures;
+}
+
+static void FreeSidedefs(sidedef_array_t *sidedefs)
+{
+    free(sidedefs->xoffset);
+    free(sidedefs->yoffset);
+    free(sidedefs->upper);
+    free(sidedefs->middle);
+    free(sidedefs->lower);
+    free(sidedefs->sector_ref);
+    free(sidedefs->merge_domain);
+}
+
+static void GetSidedef(const sidedef_array_t *sidedefs, sidedef_ref_t sdi,
+                       sidedef_t *s)
+{
+    s->xoffset = sidedefs->xoffset[sdi];
+    s->yoffset = sidedefs->yoffset[sdi];
+    s->upper = sidedefs->upper[sdi];
+    s->middle = sidedefs->middle[sdi];
+    s->lower = sidedefs->lower[sdi];
+    s->sector_ref = sidedefs->sector_ref[sdi];
+    s->merge_domain = sidedefs->merge_domain[sdi];
+}
+
+static size_t SidedefsLimit(void)
+{
+    if (extsides)
     {
-        WriteHexenLinedefs(&linedefs_result, fstream);
+        return MAX_EXT_SIDEDEFS;
+    }
+    return MAX_VANILLA_SIDEDEFS;
+}
+
+// Packs the sidedefs in the given SIDEDEFS lump. It is assumed that the
+// matching LINEDEFS lump immediately precedes it in the WAD directory.
+// The new contents of the level's lumps are returned in the given
+// packed_level_t structure, which the caller must free.
+// Returns true for success; false if sidedef packing failed (likely
+// because the result would overflow the limits of the format).
+bool P_Pack(wad_file_t *wf, unsigned int sidedef_num, packed_level_t *result)
+{
+    level_t level;
+    linedef_array_t linedefs;
+    sidedef_array_t orig_sidedefs, sidedefs;
+    bool success = true;
+
+    InitLevel(&level, wf, sidedef_num);
+
+    orig_sidedefs = ReadSidedefs(&level);
+    linedefs = ReadLinedefs(&level);
+    FindUnsafeTags(&level, &linedefs);
+
+    result->vertexes.data = NULL;
+    result->segs.data = NULL;
+    result->sectors.data = NULL;
+    result->reject.data = NULL;
+
+    if (!CheckSidedefRefs(&linedefs, orig_sidedefs.len))
+    {
+        sidedefs = orig_sidedefs;
     }
     else
     {
-        WriteDoomLinedefs(&linedefs_result, fstream);
+        if (mergesectors || prune)
+        {
+            RebuildSectors(&level, &linedefs, &orig_sidedefs, result);
+        }
+        if (wipesides)
+        {
+            ReadSectors(&level, &linedefs, &orig_sidedefs, &result->sectors);
+        }
+
+        // The linedefs are remapped in place as they are packed, so if we
+        // would generate a corrupt (overflowed) SIDEDEFS list, they must be
+        // read again to get back the original references. The same goes
+        // for the sector references of the sidedefs if sectors were
+        // renumbered.
+        if (!PackSidedefs(&level, &linedefs, &orig_sidedefs, &sidedefs))
+        {
+            free(linedefs.lines);
+            linedefs = ReadLinedefs(&level);
+            if (result->sectors.data != NULL)
+            {
+                FreeSidedefs(&orig_sidedefs);
+                orig_sidedefs = ReadSidedefs(&level);
+                free(result->sectors.data);
+                free(result->reject.data);
+                result->sectors.data = NULL;
+                result->reject.data = NULL;
+            }
+            sidedefs = orig_sidedefs;
+            success = false;
+        }
+        else
+        {
+            // TODO: Check that the SIDEDEFS lump is never larger than the
+            // original one?
+            FreeSidedefs(&orig_sidedefs);
+        }
+    }
+
+    if (prune)
+    {
+        RebuildVertices(&level, &linedefs, result);
     }
-    free(linedefs_result.lines);
-}
 
-void P_WriteSidedefs(FILE *fstream, entry_t *entry)
-{
-    entry->offset = WriteWadLump(fstream, NULL, 0);
-    entry->length = sidedefs_result.len * SDEF_SIZE;
+    EncodeLinedefs(&level, &linedefs, &result->linedefs);
+    EncodeSidedefs(&level, &sidedefs, &result->sidedefs);
 
-    WriteSidedefs(&sidedefs_result, fstream);
-    free(sidedefs_result.sides);
+    free(linedefs.lines);
+    FreeSidedefs(&sidedefs);
+    FreeLevel(&level);
+    return success;
 }
 
-// Performs the reverse of P_Pack(). Again, the result must be written
-// using P_WriteSidedefs() and P_WriteLinedefs().
-bool P_Unpack(wad_file_t *wf, unsigned int sidedef_num)
+// Performs the reverse of P_Pack(). Again, the new lump contents are
+// returned in the given lump_t structures.
+bool P_Unpack(wad_file_t *wf, unsigned int sidedef_num, lump_t *linedefs_lump,
+              lump_t *sidedefs_lump)
 {
-    linedef_array_t orig_linedefs;
-    sidedef_array_t orig_sidedefs;
-    unsigned int linedef_num = sidedef_num - 1;
+    level_t level;
+    linedef_array_t orig_linedefs, linedefs;
+    sidedef_array_t orig_sidedefs, sidedefs;
+    bool success = true;
 
-    CheckLumpSizes(wf, linedef_num, sidedef_num);
+    InitLevel(&level, wf, sidedef_num);
 
-    orig_linedefs = ReadLinedefs(wf, linedef_num);
-    orig_sidedefs = ReadSidedefs(wf, sidedef_num);
-
-    if (!RebuildSidedefs(&orig_linedefs, &orig_sidedefs, &linedefs_result,
-                         &sidedefs_result))
+    orig_linedefs = ReadLinedefs(&level);
+    orig_sidedefs = ReadSidedefs(&level);
+    if (wipesides)
     {
-        linedefs_result = orig_linedefs;
-        sidedefs_result = orig_sidedefs;
-        return true;
+        ReadSectors(&level, &orig_linedefs, &orig_sidedefs, NULL);
     }
 
+    if (!RebuildSidedefs(&level, &orig_linedefs, &orig_sidedefs, &linedefs,
+                         &sidedefs))
+    {
+        linedefs = orig_linedefs;
+        sidedefs = orig_sidedefs;
+    }
     // It is possible that the decompressed sidedefs list overflows the
     // limits of the SIDEDEFS on-disk format. We never want to save a
     // corrupted sidedefs list.
-    if (sidedefs_result.len > SidedefsLimit())
+    else if (sidedefs.len > SidedefsLimit())
     {
-        free(sidedefs_result.sides);
-        sidedefs_result = orig_sidedefs;
-        free(linedefs_result.lines);
-        linedefs_result = orig_linedefs;
-        return false;
+        FreeSidedefs(&sidedefs);
+        sidedefs = orig_sidedefs;
+        free(linedefs.lines);
+        linedefs = orig_linedefs;
+        success = false;
+    }
+    else
+    {
+        FreeSidedefs(&orig_sidedefs);
+        free(orig_linedefs.lines);
     }
 
-    free(orig_sidedefs.sides);
-    free(orig_linedefs.lines);
-    return true;
+    EncodeLinedefs(&level, &linedefs, linedefs_lump);
+    EncodeSidedefs(&level, &sidedefs, sidedefs_lump);
+
+    free(linedefs.lines);
+    FreeSidedefs(&sidedefs);
+    FreeLevel(&level);
+    return success;
 }
 
 // Sanity check a linedef's sidedef reference is valid.
@@ -298,22 +582,40 @@ static bool CheckSidedefIndex(unsigned int ldi, unsigned int sdi,
     return true;
 }
 
+static bool CheckSidedefRefs(const linedef_array_t *linedefs,
+                             size_t num_sidedefs)
+{
+    unsigned int count;
+
+    for (count = 0; count < linedefs->len; count++)
+    {
+        if (!CheckSidedefIndex(count, linedefs->lines[count].sidedef1,
+                               num_sidedefs) ||
+            !CheckSidedefIndex(count, linedefs->lines[count].sidedef2,
+                               num_sidedefs))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool P_IsPacked(wad_file_t *wf, unsigned int sidedef_num)
 {
+    level_t level;
     linedef_array_t linedefs;
     uint8_t *sidedef_used;
-    size_t num_sidedefs;
+    size_t num_sidedefs, sidedef_size;
     bool packed = false;
-    unsigned int count, linedef_num, sdi1, sdi2;
-
-    // SIDEDEFS always follows LINEDEFS.
-    linedef_num = sidedef_num - 1;
+    unsigned int count, sdi1, sdi2;
 
-    CheckLumpSizes(wf, linedef_num, sidedef_num);
+    InitLevel(&level, wf, sidedef_num);
 
-    linedefs = ReadLinedefs(wf, linedef_num);
+    linedefs = ReadLinedefs(&level);
 
-    num_sidedefs = wf->entries[sidedef_num].length / SDEF_SIZE;
+    sidedef_size = SidedefFormat(&level)->size;
+    num_sidedefs = wf->entries[sidedef_num].length / sidedef_size;
     sidedef_used = ALLOC_ARRAY(uint8_t, num_sidedefs);
     for (count = 0; count < num_sidedefs; count++)
     {
@@ -345,57 +647,162 @@ bool P_IsPacked(wad_file_t *wf, unsigned int sidedef_num)
     }
     free(linedefs.lines);
     free(sidedef_used);
+    FreeLevel(&level);
     return packed;
 }
 
+static void HashTextureName(sha1_context_t *ctx, const char *name)
+{
+    uint8_t buf[8];
+    unsigned int i;
+
+    // Texture names are compared case-insensitively when packing, so
+    // packing can change the case of a name without changing the level.
+    for (i = 0; i < 8 && name[i] != '\0'; i++)
+    {
+        buf[i] = toupper((unsigned char) name[i]);
+    }
+    for (; i < 8; i++)
+    {
+        buf[i] = 0;
+    }
+
+    SHA1_Update(ctx, buf, 8);
+}
+
+static void HashSidedef(sha1_context_t *ctx, const sidedef_array_t *sidedefs,
+                        sidedef_ref_t sdi)
+{
+    uint8_t buf[4];
+
+    WRITE_SHORT(buf + 0, sidedefs->xoffset[sdi]);
+    WRITE_SHORT(buf + 2, sidedefs->yoffset[sdi]);
+    SHA1_Update(ctx, buf, 4);
+    HashTextureName(ctx, sidedefs->textures->names[sidedefs->upper[sdi]]);
+    HashTextureName(ctx, sidedefs->textures->names[sidedefs->lower[sdi]]);
+    HashTextureName(ctx, sidedefs->textures->names[sidedefs->middle[sdi]]);
+    WRITE_SHORT(buf, sidedefs->sector_ref[sdi]);
+    SHA1_Update(ctx, buf, 2);
+}
+
+static void HashLinedef(const level_t *level, sha1_context_t *ctx,
+                        const linedef_t *ld)
+{
+    uint8_t buf[17];
+
+    WRITE_SHORT(buf + 0, ld->vertex1);
+    WRITE_SHORT(buf + 2, ld->vertex2);
+    WRITE_LONG(buf + 4, ld->flags);
+    WRITE_SHORT(buf + 8, ld->type);
+    if (level->format == FORMAT_HEXEN)
+    {
+        memcpy(buf + 10, ld->x.args, 5);
+    }
+    else
+    {
+        memset(buf + 10, 0, 5);
+        WRITE_SHORT(buf + 10, ld->x.tag);
+    }
+
+    // We only include whether the sidedefs are present, not their
+    // indexes, since those change when sidedefs are packed.
+    buf[15] = ld->sidedef1 != NO_SIDEDEF;
+    buf[16] = ld->sidedef2 != NO_SIDEDEF;
+    SHA1_Update(ctx, buf, 17);
+}
+
+// Calculates hashes of the given SIDEDEFS lump and the LINEDEFS lump that
+// precedes it, in a form that is the same regardless of whether the
+// sidedefs are packed or not: each linedef is hashed without its sidedef
+// references, and the sidedefs are hashed in linedef order. Returns false
+// if the level contains invalid sidedef references.
+bool P_HashLevel(wad_file_t *wf, unsigned int sidedef_num,
+                 sha1_digest_t linedefs_hash, sha1_digest_t sidedefs_hash)
+{
+    level_t level;
+    linedef_array_t linedefs;
+    sidedef_array_t sidedefs;
+    sha1_context_t ld_ctx, sd_ctx;
+    unsigned int i;
+    bool success = true;
+
+    InitLevel(&level, wf, sidedef_num);
+
+    linedefs = ReadLinedefs(&level);
+    sidedefs = ReadSidedefs(&level);
+
+    SHA1_Init(&ld_ctx);
+    SHA1_Init(&sd_ctx);
+
+    for (i = 0; i < linedefs.len; i++)
+    {
+        const linedef_t *ld = &linedefs.lines[i];
+
+        if (!CheckSidedefIndex(i, ld->sidedef1, sidedefs.len) ||
+            !CheckSidedefIndex(i, ld->sidedef2, sidedefs.len))
+        {
+            success = false;
+            break;
+        }
+
+        HashLinedef(&level, &ld_ctx, ld);
+        if (ld->sidedef1 != NO_SIDEDEF)
+        {
+            HashSidedef(&sd_ctx, &sidedefs, ld->sidedef1);
+        }
+        if (ld->sidedef2 != NO_SIDEDEF)
+        {
+            HashSidedef(&sd_ctx, &sidedefs, ld->sidedef2);
+        }
+    }
+
+    SHA1_Final(linedefs_hash, &ld_ctx);
+    SHA1_Final(sidedefs_hash, &sd_ctx);
+
+    free(linedefs.lines);
+    FreeSidedefs(&sidedefs);
+    FreeLevel(&level);
+    return success;
+}
+
 // Append the given sidedef to the given array.
 static sidedef_ref_t AppendNewSidedef(sidedef_array_t *sidedefs,
                                       const sidedef_t *s)
 {
     sidedef_ref_t result;
 
-    while (sidedefs->len >= sidedefs->size)
+    if (sidedefs->len >= sidedefs->size)
     {
-        sidedefs->size *= 2;
-        sidedefs->sides =
-            REALLOC_ARRAY(sidedef_t, sidedefs->sides, sidedefs->size);
+        ResizeSidedefs(sidedefs, sidedefs->size * 2);
     }
 
-    memcpy(&sidedefs->sides[sidedefs->len], s, sizeof(sidedef_t));
     result = sidedefs->len;
+    sidedefs->xoffset[result] = s->xoffset;
+    sidedefs->yoffset[result] = s->yoffset;
+    sidedefs->upper[result] = s->upper;
+    sidedefs->middle[result] = s->middle;
+    sidedefs->lower[result] = s->lower;
+    sidedefs->sector_ref[result] = s->sector_ref;
+    sidedefs->merge_domain[result] = s->merge_domain;
     ++sidedefs->len;
 
     return result;
 }
 
-static int CompareSidedefs(const sidedef_t *s1, const sidedef_t *s2)
-{
-#define CHECK_DIFF(expr) \
-    {                    \
-        int diff = expr; \
-        if (diff != 0)   \
-        {                \
-            return diff; \
-        }                \
-    }
-
-    CHECK_DIFF(strncasecmp(s1->middle, s2->middle, 8));
-    CHECK_DIFF(strncasecmp(s1->upper, s2->upper, 8));
-    CHECK_DIFF(strncasecmp(s1->lower, s2->lower, 8));
-    CHECK_DIFF(s2->merge_domain - s1->merge_domain);
-    CHECK_DIFF(s2->xoffset - s1->xoffset);
-    CHECK_DIFF(s2->yoffset - s1->yoffset);
-    CHECK_DIFF(s2->sector_ref - s1->sector_ref);
-#undef CHECK_DIFF
-
-    return 0;
-}
-
-static int CompareFunc(unsigned int index1, unsigned int index2,
-                       const void *callback_data)
+// Returns true if the given sidedef in the array can be merged with the
+// given sidedef. Texture names are compared case-insensitively.
+static bool SidedefsEqual(const sidedef_array_t *sidedefs, sidedef_ref_t sdi,
+                          const sidedef_t *s)
 {
-    const sidedef_array_t *sidedefs = callback_data;
-    return CompareSidedefs(&sidedefs->sides[index1], &sidedefs->sides[index2]);
+    const texture_ref_t *folded = sidedefs->textures->folded;
+
+    return sidedefs->xoffset[sdi] == s->xoffset &&
+           sidedefs->yoffset[sdi] == s->yoffset &&
+           sidedefs->sector_ref[sdi] == s->sector_ref &&
+           sidedefs->merge_domain[sdi] == s->merge_domain &&
+           folded[sidedefs->middle[sdi]] == folded[s->middle] &&
+           folded[sidedefs->upper[sdi]] == folded[s->upper] &&
+           folded[sidedefs->lower[sdi]] == folded[s->lower];
 }
 
 #ifdef DEBUG
@@ -405,110 +812,297 @@ static void PrintLinedef(const linedef_t *l)
            l->vertex2, l->flags, l->type, l->sidedef1, l->sidedef2);
 }
 
-static void PrintSidedef(const sidedef_t *s)
+static void PrintSidedef(const texture_table_t *textures, const sidedef_t *s)
 {
     printf("x: %5d y: %5d s: %7d m: %-8.8s l: %-8.8s: u: %-8.8s md: %d\n",
-           s->xoffset, s->yoffset, s->sector_ref, s->middle, s->upper, s->lower,
+           s->xoffset, s->yoffset, s->sector_ref, textures->names[s->middle],
+           textures->names[s->upper], textures->names[s->lower],
            s->merge_domain);
 }
 #endif
 
-static sidedef_array_t DoPack(const sidedef_array_t *sidedefs)
-{
-    sidedef_array_t packed;
-    const sidedef_t *sidedef, *prev_sidedef = NULL;
-    unsigned int *map;
-    unsigned int mi;
-    sidedef_ref_t sdi;
-
-    // To pack the sidedefs we first create a "sorted map": an array of
-    // all the sidedef numbers, ordered by that sidedef's contents. That
-    // is to say that `sidedefs->sides[map[0]]` <= all other sidedefs,
-    // while `sidedefs->sides[map[sidedefs->len - 1]]` >= than all other
-    // sidedefs. Producing the map is an O(n log n) process, which makes
-    // this much more efficient than earlier versions of this code that
-    // were O(n^2).
-    map = MakeSortedMap(sidedefs->len, CompareFunc, sidedefs);
-
-    packed.size = sidedefs->len;
-    packed.sides = ALLOC_ARRAY(sidedef_t, packed.size);
-    packed.len = 0;
-    newsidedef_index = ALLOC_ARRAY(sidedef_ref_t, sidedefs->len);
-
-    // Now we iterate over map[], ie. each sidedef in sorted order.
-    // This means that we will encounter any identical sidedefs
-    // consecutively. It is then a matter of comparing the current
-    // sidedef with the sidedef from the previous iteration
-    // (prev_sidedef) to determine whether we need to add a new sidedef
-    // to the packed array, or whether we can just reuse the previous
-    // one.
-    for (mi = 0; mi < sidedefs->len; mi++)
-    {
-        PrintProgress(mi, sidedefs->len);
-        sdi = map[mi];
-        sidedef = &sidedefs->sides[sdi];
+// FNV-1a hash of the fields compared by SidedefsEqual().
+static uint32_t SidedefHash(const texture_table_t *textures,
+                            const sidedef_t *s)
+{
+    uint32_t h = 2166136261u;
+
+    h = (h ^ (uint16_t) s->xoffset) * 16777619;
+    h = (h ^ (uint16_t) s->yoffset) * 16777619;
+    h = (h ^ s->sector_ref) * 16777619;
+    h = (h ^ s->merge_domain) * 16777619;
+    h = (h ^ textures->folded[s->upper]) * 16777619;
+    h = (h ^ textures->folded[s->middle]) * 16777619;
+    h = (h ^ textures->folded[s->lower]) * 16777619;
+
+    return h;
+}
+
+typedef struct {
+    // Open addressing hash table of indexes into the packed sidedefs
+    // array; empty slots contain NO_SIDEDEF.
+    sidedef_ref_t *slots;
+    size_t mask;
+} sidedef_table_t;
+
+static void InitTable(sidedef_table_t *table, size_t max_entries)
+{
+    size_t size = 16, i;
+
+    // Keep the load factor at most 50%.
+    while (size < max_entries * 2)
+    {
+        size *= 2;
+    }
+
+    table->slots = ALLOC_ARRAY(sidedef_ref_t, size);
+    table->mask = size - 1;
+    for (i = 0; i < size; i++)
+    {
+        table->slots[i] = NO_SIDEDEF;
+    }
+}
+
+// Returns the index of a sidedef in the packed array that the given
+// sidedef can be merged with, adding a new one if there is none.
+static sidedef_ref_t InsertSidedef(sidedef_table_t *table,
+                                   sidedef_array_t *packed, const sidedef_t *s)
+{
+    size_t i;
+
 #ifdef DEBUG
-        PrintSidedef(sidedef);
+    PrintSidedef(packed->textures, s);
 #endif
-        // We only ever merge sidedefs that are in the same merge domain, and
-        // sidedefs in MERGE_DOMAIN_SPECIAL are never merged.
-        if (sidedef->merge_domain != MERGE_DOMAIN_SPECIAL &&
-            prev_sidedef != NULL && CompareSidedefs(sidedef, prev_sidedef) == 0)
-        {
-            newsidedef_index[sdi] = newsidedef_index[map[mi - 1]];
-        }
-        else
+    // We only ever merge sidedefs that are in the same merge domain, and
+    // sidedefs in MERGE_DOMAIN_SPECIAL are never merged.
+    if (s->merge_domain == MERGE_DOMAIN_SPECIAL)
+    {
+        return AppendNewSidedef(packed, s);
+    }
+
+    for (i = SidedefHash(packed->textures, s) & table->mask;
+         table->slots[i] != NO_SIDEDEF; i = (i + 1) & table->mask)
+    {
+        if (SidedefsEqual(packed, table->slots[i], s))
         {
-            newsidedef_index[sdi] = packed.len;
-            AppendNewSidedef(&packed, sidedef);
+            return table->slots[i];
         }
-        prev_sidedef = sidedef;
     }
 
-    free(map);
+    table->slots[i] = AppendNewSidedef(packed, s);
+    return table->slots[i];
+}
 
-    return packed;
+static bool IsNoTexture(const level_t *level, texture_ref_t tex)
+{
+    return level->textures.folded[tex] ==
+           level->textures.folded[level->no_texture];
+}
+
+static const sector_t *SidedefSector(const level_t *level,
+                                     const sidedef_t *s)
+{
+    if (s->sector_ref >= level->num_sectors)
+    {
+        return NULL;
+    }
+    return &level->sectors[s->sector_ref];
+}
+
+// Clears the fields of a sidedef on a two-sided line that can never be
+// seen, given the sectors on either side. An upper texture is only drawn
+// where the sector on the other side has a lower ceiling, and a lower
+// texture only where the other side has a higher floor.
+static void WipeHiddenTextures(const level_t *level, sidedef_t *s,
+                               const sector_t *sector, const sector_t *other)
+{
+    if (sector == NULL || other == NULL || !sector->is_static ||
+        !other->is_static)
+    {
+        return;
+    }
+    if (other->ceiling_height >= sector->ceiling_height)
+    {
+        s->upper = level->no_texture;
+    }
+    if (other->floor_height <= sector->floor_height)
+    {
+        s->lower = level->no_texture;
+    }
+}
+
+// With no textures at all, the offsets of a sidedef have no effect.
+static void WipeOffsets(const level_t *level, sidedef_t *s)
+{
+    if (IsNoTexture(level, s->upper) && IsNoTexture(level, s->middle) &&
+        IsNoTexture(level, s->lower))
+    {
+        s->xoffset = 0;
+        s->yoffset = 0;
+    }
+}
+
+// Clears the texture references and offsets of a linedef's sidedefs that
+// can never be seen. The cases that are handled are:
+//  * Upper and lower textures on one-sided lines.
+//  * Upper and lower textures on two-sided lines that are hidden by the
+//    heights of the sectors on either side, if those sectors can never
+//    move (see ReadSectors).
+//  * The offsets of sidedefs that have no textures at all. Special lines
+//    are left alone, since some (eg. Boom's scrollers) read the offsets
+//    of their own sidedefs.
+static void WipeSidedefs(const level_t *level, const linedef_t *ld,
+                         sidedef_t *front, sidedef_t *back)
+{
+    const sector_t *front_sector, *back_sector;
+
+    // One-sided line?
+    if (ld->sidedef2 == NO_SIDEDEF)
+    {
+        front->upper = level->no_texture;
+        front->lower = level->no_texture;
+    }
+    else if (ld->sidedef1 != NO_SIDEDEF)
+    {
+        front_sector = SidedefSector(level, front);
+        back_sector = SidedefSector(level, back);
+        WipeHiddenTextures(level, front, front_sector, back_sector);
+        WipeHiddenTextures(level, back, back_sector, front_sector);
+    }
+
+    if (ld->type != 0)
+    {
+        return;
+    }
+    if (ld->sidedef1 != NO_SIDEDEF)
+    {
+        WipeOffsets(level, front);
+    }
+    if (ld->sidedef2 != NO_SIDEDEF)
+    {
+        WipeOffsets(level, back);
+    }
+}
+
+// Makes copies of the sidedefs of the given linedef, applying its merge
+// domain and clearing unneeded texture references if enabled.
+static void CopySidedefs(const level_t *level, const sidedef_array_t *sidedefs,
+                         const linedef_t *ld, sidedef_t *front,
+                         sidedef_t *back)
+{
+    uint8_t front_domain, back_domain;
+
+    LinedefMergeDomains(level, ld, &front_domain, &back_domain);
+
+    if (ld->sidedef1 != NO_SIDEDEF)
+    {
+        GetSidedef(sidedefs, ld->sidedef1, front);
+        front->merge_domain = front_domain;
+    }
+    if (ld->sidedef2 != NO_SIDEDEF)
+    {
+        GetSidedef(sidedefs, ld->sidedef2, back);
+        back->merge_domain = back_domain;
+    }
+
+    // Doom 64 has no texture name for "no texture", only indexes.
+    if (wipesides && level->format != FORMAT_DOOM64)
+    {
+        WipeSidedefs(level, ld, front, back);
+    }
 }
 
-// Update the SIDEDEFS references in the given array of linedefs. The
-// newsidedef_index[] array must have been generated by a previous call
-// to DoPack();
-static void RemapLinedefs(linedef_array_t *linedefs)
+// Packs sidedefs in a single pass over the linedefs. Each side is looked up
+// in a hash table of the sidedefs packed so far, so packed sidedefs appear
+// in the order they are first referenced and the linedefs are remapped in
+// place. The sidedef references must already have been checked with
+// CheckSidedefRefs(). Returns false if the result would overflow the
+// limits of the format.
+static bool PackSidedefs(const level_t *level, linedef_array_t *linedefs,
+                         const sidedef_array_t *sidedefs,
+                         sidedef_array_t *sdresult)
 {
+    sidedef_table_t table;
+    sidedef_t front, back;
     unsigned int count;
 
-    // Note that we do not need to perform the CheckSidedefIndex()
-    // checks here because they have already been checked by a previous
-    // call to RebuildSidedefs().
+    // There can never be more packed sidedefs than there are sides, and
+    // normally there are far fewer.
+    InitTable(&table, linedefs->len * 2);
+    AllocSidedefs(sdresult, sidedefs->len, sidedefs->textures);
+
     for (count = 0; count < linedefs->len; count++)
     {
+        linedef_t *ld = &linedefs->lines[count];
+
+        PrintProgress(count, linedefs->len);
 #ifdef DEBUG
-        PrintLinedef(&linedefs->lines[count]);
+        PrintLinedef(ld);
 #endif
-        if (linedefs->lines[count].sidedef1 != NO_SIDEDEF)
-            linedefs->lines[count].sidedef1 =
-                newsidedef_index[linedefs->lines[count].sidedef1];
-        if (linedefs->lines[count].sidedef2 != NO_SIDEDEF)
-            linedefs->lines[count].sidedef2 =
-                newsidedef_index[linedefs->lines[count].sidedef2];
+        CopySidedefs(level, sidedefs, ld, &front, &back);
+        if (ld->sidedef1 != NO_SIDEDEF)
+        {
+            ld->sidedef1 = InsertSidedef(&table, sdresult, &front);
+        }
+        if (ld->sidedef2 != NO_SIDEDEF)
+        {
+            ld->sidedef2 = InsertSidedef(&table, sdresult, &back);
+        }
+
+        if (sdresult->len > SidedefsLimit())
+        {
+            free(table.slots);
+            FreeSidedefs(sdresult);
+            return false;
+        }
     }
 
-    free(newsidedef_index);
+    free(table.slots);
+    return true;
+}
+
+static bool LumpNamed(wad_file_t *wf, unsigned int lumpnum, const char *name)
+{
+    return lumpnum < wf->num_entries &&
+           !strncmp(wf->entries[lumpnum].name, name, 8);
 }
 
-static void CheckLumpSizes(wad_file_t *wf, unsigned int linedef_num,
-                           unsigned int sidedef_num)
+static void InitLevel(level_t *level, wad_file_t *wf,
+                      unsigned int sidedef_num)
 {
-    unsigned int linedef_size;
+    // SIDEDEFS always follows LINEDEFS.
+    unsigned int linedef_num = sidedef_num - 1;
+    unsigned int linedef_size, sidedef_size;
+
+    level->wf = wf;
+    level->linedef_num = linedef_num;
+    level->sidedef_num = sidedef_num;
 
     // Hexen levels have a slightly different format, and we can detect
     // this by looking for the presence of a BEHAVIOR lump, which is
     // unique to this format. Level lumps are always in a fixed order
     // (Doom requires this), so we can expect that the BEHAVIOR lump is
-    // 9 entries after the LINEDEFS lump.
-    hexen_format = linedef_num + 9 < wf->num_entries &&
-                   !strncmp(wf->entries[linedef_num + 9].name, "BEHAVIOR", 8);
-    linedef_size = LinedefSize();
+    // 9 entries after the LINEDEFS lump. The console ports put a LEAFS
+    // lump in the same place, and Doom 64 follows it with LIGHTS.
+    if (LumpNamed(wf, linedef_num + 9, "BEHAVIOR"))
+    {
+        level->format = FORMAT_HEXEN;
+    }
+    else if (LumpNamed(wf, linedef_num + 9, "LEAFS") &&
+             LumpNamed(wf, linedef_num + 10, "LIGHTS"))
+    {
+        level->format = FORMAT_DOOM64;
+    }
+    else if (LumpNamed(wf, linedef_num + 9, "LEAFS"))
+    {
+        level->format = FORMAT_PSX;
+    }
+    else
+    {
+        level->format = FORMAT_DOOM;
+    }
+    linedef_size = LinedefFormat(level)->size;
+    sidedef_size = SidedefFormat(level)->size;
 
     if ((wf->entries[linedef_num].length % linedef_size) != 0)
     {
@@ -516,32 +1110,103 @@ static void CheckLumpSizes(wad_file_t *wf, unsigned int linedef_num,
                   "not a multiple of %d",
                   linedef_num, wf->entries[linedef_num].length, linedef_size);
     }
-    if ((wf->entries[sidedef_num].length % SDEF_SIZE) != 0)
+    if ((wf->entries[sidedef_num].length % sidedef_size) != 0)
     {
         ErrorExit("RebuildSidedefs: SIDEDEFS lump (#%d) is %d bytes, "
                   "not a multiple of %d",
-                  sidedef_num, wf->entries[sidedef_num].length, SDEF_SIZE);
+                  sidedef_num, wf->entries[sidedef_num].length, sidedef_size);
     }
+
+    InitTextures(&level->textures);
+    level->no_texture = InternTexture(&level->textures, "-");
+    level->sectors = NULL;
+    level->num_sectors = 0;
+    level->unsafe_tags = NULL;
+}
+
+static void FreeLevel(level_t *level)
+{
+    FreeTextures(&level->textures);
+    free(level->sectors);
+    free(level->unsafe_tags);
 }
 
-// Calculate the "merge domain" of a linedef. The sidedefs attached to the
-// linedef inherit this merge domain, which controls whether they get merged
-// or not (sidedefs are only merged with others in the same domain). Almost all
-// sidedefs get put into merge domain 1 (normal linedefs) or
-// MERGE_DOMAIN_SPECIAL (special line; do not merge).
-static uint8_t LinedefMergeDomain(const linedef_t *ld)
+// Finds the tags of lines whose sidedefs are changed by the specials of
+// other lines. Hexen format levels have no line tags, and in Doom 64 all
+// tagged lines are treated as unsafe (see L_Doom64SpecialFlags).
+static void FindUnsafeTags(level_t *level, const linedef_array_t *linedefs)
 {
+    size_t i;
+
+    if (level->format == FORMAT_HEXEN || level->format == FORMAT_DOOM64)
+    {
+        return;
+    }
+
+    for (i = 0; i < linedefs->len; i++)
+    {
+        const linedef_t *ld = &linedefs->lines[i];
+        unsigned int tag = ld->x.tag;
+
+        if ((L_DoomSpecialFlags(ld->type) & SPECIAL_TAGGED_UNSAFE) == 0)
+        {
+            continue;
+        }
+        if (level->unsafe_tags == NULL)
+        {
+            level->unsafe_tags = ALLOC_ARRAY(uint8_t, 0x10000 / 8);
+            memset(level->unsafe_tags, 0, 0x10000 / 8);
+        }
+        level->unsafe_tags[tag / 8] |= 1 << (tag % 8);
+    }
+}
+
+static unsigned int SpecialFlags(const level_t *level, const linedef_t *ld)
+{
+    unsigned int tag, flags;
+
+    if (level->format == FORMAT_HEXEN)
+    {
+        return L_HexenSpecialFlags(ld->type, ld->flags);
+    }
+    if (level->format == FORMAT_DOOM64)
+    {
+        return L_Doom64SpecialFlags(ld->type, ld->flags, ld->x.tag);
+    }
+
+    tag = ld->x.tag;
+    flags = L_DoomSpecialFlags(ld->type);
+    if (level->unsafe_tags != NULL &&
+        (level->unsafe_tags[tag / 8] & (1 << (tag % 8))) != 0)
+    {
+        flags |= SPECIAL_FRONT_UNSAFE;
+    }
+    return flags;
+}
+
+// Calculate the "merge domains" of the two sides of a linedef. The sidedefs
+// attached to the linedef inherit these merge domains, which control
+// whether they get merged or not (sidedefs are only merged with others in
+// the same domain). Almost all sidedefs get put into merge domain 1
+// (normal sidedefs) or MERGE_DOMAIN_SPECIAL (do not merge).
+static void LinedefMergeDomains(const level_t *level, const linedef_t *ld,
+                                uint8_t *front_domain, uint8_t *back_domain)
+{
+    unsigned int flags;
+
     // As a special case to facilitate special effects, if the linedef has a
     // tag in the magic range, merging is performed even if it is a special
     // line. However, they are only merged with other lines that share the
     // same tag.
-    if (!hexen_format && ld->x.tag >= MERGE_RANGE_START &&
+    if (level->format != FORMAT_HEXEN && ld->x.tag >= MERGE_RANGE_START &&
         ld->x.tag <= MERGE_RANGE_END)
     {
-        return ld->x.tag + 2 - MERGE_RANGE_START;
+        *front_domain = ld->x.tag + 2 - MERGE_RANGE_START;
+        *back_domain = *front_domain;
+        return;
     }
 
-    // Special lines always get their own dedicated sidedefs, because:
+    // Some special lines must get their own dedicated sidedefs, because:
     //  * If a scrolling linedef shares a sidedef with another linedef,
     //    it will make that other linedef scroll, or if multiple
     //    scrolling linedefs share a sidedef, it will scroll too fast.
@@ -550,33 +1215,223 @@ static uint8_t LinedefMergeDomain(const linedef_t *ld)
     //  * Switch linedefs change the texture of the front sidedef when
     //    the switch is activated. Similarly this could cause multiple
     //    switches to all mistakenly animate.
-    // This could be more selective but different source ports add their
-    // own new linedef types. For simplicity we just exclude sidedef
-    // packing for all special lines.
-    if (ld->type != 0)
+    // The table in specials.c lists which specials are safe; walk-over
+    // lines and doors do not touch their sidedefs at all, and switches
+    // only change their front sidedef. Unknown specials are never merged.
+    flags = SpecialFlags(level, ld);
+    *front_domain =
+        (flags & SPECIAL_FRONT_UNSAFE) != 0 ? MERGE_DOMAIN_SPECIAL : 1;
+    *back_domain =
+        (flags & SPECIAL_BACK_UNSAFE) != 0 ? MERGE_DOMAIN_SPECIAL : 1;
+}
+
+// Only the linedefs and sidedefs of console levels are understood; their
+// other lumps have layouts of their own.
+static bool IsConsoleFormat(const level_t *level)
+{
+    return level->format == FORMAT_PSX || level->format == FORMAT_DOOM64;
+}
+
+static void MarkSectorMovable(level_t *level, const sidedef_array_t *sidedefs,
+                              sidedef_ref_t sdi)
+{
+    if (sdi < sidedefs->len && sidedefs->sector_ref[sdi] < level->num_sectors)
+    {
+        level->sectors[sidedefs->sector_ref[sdi]].is_static = false;
+    }
+}
+
+static uint32_t SidedefSectorRef(const sidedef_array_t *sidedefs,
+                                 sidedef_ref_t sdi)
+{
+    return sdi == NO_SIDEDEF ? NO_SECTOR : sidedefs->sector_ref[sdi];
+}
+
+// Rebuilds the SECTORS lump (see M_RebuildSectors), merging identical
+// sectors if -mergesectors is given and removing unused sectors if -prune
+// is given, and updates the sidedefs to use the new sector numbers; merged
+// sectors make more sidedefs identical so that they can be packed. Sectors
+// are not merged in Hexen format levels, since scripts and sound sequences
+// can refer to sectors in other ways. The console formats have SECTORS
+// lumps of their own layout and are left alone.
+static void RebuildSectors(const level_t *level,
+                           const linedef_array_t *linedefs,
+                           sidedef_array_t *sidedefs, packed_level_t *result)
+{
+    unsigned int sector_num = level->sidedef_num + 5;
+    sector_line_t *lines;
+    uint32_t *sector_map;
+    size_t i, num_sectors;
+
+    if (IsConsoleFormat(level) || sector_num >= level->wf->num_entries)
+    {
+        return;
+    }
+
+    lines = ALLOC_ARRAY(sector_line_t, linedefs->len);
+    for (i = 0; i < linedefs->len; i++)
+    {
+        const linedef_t *ld = &linedefs->lines[i];
+        lines[i].type = ld->type;
+        lines[i].flags = ld->flags;
+        lines[i].tag = level->format == FORMAT_DOOM ? ld->x.tag : 0;
+        lines[i].front_sector = SidedefSectorRef(sidedefs, ld->sidedef1);
+        lines[i].back_sector = SidedefSectorRef(sidedefs, ld->sidedef2);
+    }
+
+    if (M_RebuildSectors(level->wf, sector_num, lines, linedefs->len,
+                         mergesectors && level->format == FORMAT_DOOM, prune,
+                         &sector_map, &result->sectors, &result->reject))
     {
-        return MERGE_DOMAIN_SPECIAL;
+        // Sidedefs that no linedef uses may refer to removed sectors, but
+        // they are dropped when the sidedefs are packed.
+        num_sectors = level->wf->entries[sector_num].length / SECTOR_SIZE;
+        for (i = 0; i < sidedefs->len; i++)
+        {
+            if (sidedefs->sector_ref[i] < num_sectors &&
+                sector_map[sidedefs->sector_ref[i]] != NO_SECTOR)
+            {
+                sidedefs->sector_ref[i] = sector_map[sidedefs->sector_ref[i]];
+            }
+        }
+        free(sector_map);
     }
 
-    // Sidedefs attached to other linedefs are mergeable.
-    return 1;
+    free(lines);
 }
 
-static bool RebuildSidedefs(const linedef_array_t *linedefs,
+// Removes the vertices that are not used by any linedef or seg, or that
+// duplicate other vertices (see V_RebuildVertices), and updates the
+// linedefs to use the new numbers. Duplicates are kept in Hexen format
+// levels, since polyobjects move their vertices and a static line that
+// shared one would move with them. The console formats have VERTEXES and
+// SEGS lumps of their own layout and are left alone.
+static void RebuildVertices(const level_t *level, linedef_array_t *linedefs,
+                            packed_level_t *result)
+{
+    uint16_t *line_vertices;
+    uint32_t *vertex_map;
+    size_t i;
+
+    if (IsConsoleFormat(level))
+    {
+        return;
+    }
+
+    line_vertices = ALLOC_ARRAY(uint16_t, linedefs->len * 2);
+    for (i = 0; i < linedefs->len; i++)
+    {
+        line_vertices[i * 2] = linedefs->lines[i].vertex1;
+        line_vertices[i * 2 + 1] = linedefs->lines[i].vertex2;
+    }
+
+    if (V_RebuildVertices(level->wf, level->sidedef_num + 1, line_vertices,
+                          linedefs->len, level->format == FORMAT_DOOM,
+                          &vertex_map,
+                          &result->vertexes, &result->segs))
+    {
+        for (i = 0; i < linedefs->len; i++)
+        {
+            linedef_t *ld = &linedefs->lines[i];
+            ld->vertex1 = vertex_map[ld->vertex1];
+            ld->vertex2 = vertex_map[ld->vertex2];
+        }
+        free(vertex_map);
+    }
+
+    free(line_vertices);
+}
+
+// Reads the SECTORS lump so that textures hidden by sector heights can be
+// wiped. A sector is only treated as static (never moving) if:
+//  * It has no tag, so no tagged special can move it.
+//  * It has no special (eg. type 10 and 14 sectors have doors that close
+//    or open after a delay).
+//  * It is not on either side of any special line, since manual doors
+//    and lifts act on the sector behind the line, without a tag.
+// If the level contains stair builders or donuts, which can move sectors
+// that are not tagged, or specials with tag 0, which act on every sector
+// with tag 0, no sector is static. Only Doom format levels are handled:
+// in Hexen, scripts can move sectors in ways that cannot be detected, and
+// the console formats have their own SECTORS layout.
+// If sectors have been renumbered, the new SECTORS lump is read instead of
+// the one in the WAD.
+static void ReadSectors(level_t *level, const linedef_array_t *linedefs,
+                        const sidedef_array_t *sidedefs,
+                        const lump_t *merged_sectors)
+{
+    wad_file_t *wf = level->wf;
+    unsigned int sector_num = level->sidedef_num + 5;
+    uint8_t *lump, *cptr;
+    size_t i;
+
+    if (level->format != FORMAT_DOOM || sector_num >= wf->num_entries ||
+        strncmp(wf->entries[sector_num].name, "SECTORS", 8) != 0 ||
+        (wf->entries[sector_num].length % SECTOR_SIZE) != 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < linedefs->len; i++)
+    {
+        if (L_MovesUntaggedSectors(linedefs->lines[i].type,
+                                   linedefs->lines[i].x.tag))
+        {
+            return;
+        }
+    }
+
+    if (merged_sectors != NULL && merged_sectors->data != NULL)
+    {
+        lump = merged_sectors->data;
+        level->num_sectors = merged_sectors->len / SECTOR_SIZE;
+    }
+    else
+    {
+        lump = CacheLump(wf, sector_num);
+        level->num_sectors = wf->entries[sector_num].length / SECTOR_SIZE;
+    }
+    level->sectors = ALLOC_ARRAY(sector_t, level->num_sectors);
+
+    cptr = lump;
+    for (i = 0; i < level->num_sectors; i++, cptr += SECTOR_SIZE)
+    {
+        sector_t *sector = &level->sectors[i];
+        sector->floor_height = READ_SHORT(cptr + SECTOR_FLOOR);
+        sector->ceiling_height = READ_SHORT(cptr + SECTOR_CEILING);
+        sector->is_static = READ_SHORT(cptr + SECTOR_SPECIAL) == 0 &&
+                            READ_SHORT(cptr + SECTOR_TAG) == 0;
+    }
+    if (merged_sectors == NULL || lump != merged_sectors->data)
+    {
+        free(lump);
+    }
+
+    for (i = 0; i < linedefs->len; i++)
+    {
+        const linedef_t *ld = &linedefs->lines[i];
+        if (ld->type != 0)
+        {
+            MarkSectorMovable(level, sidedefs, ld->sidedef1);
+            MarkSectorMovable(level, sidedefs, ld->sidedef2);
+        }
+    }
+}
+
+static bool RebuildSidedefs(const level_t *level,
+                            const linedef_array_t *linedefs,
                             const sidedef_array_t *sidedefs,
                             linedef_array_t *ldresult,
                             sidedef_array_t *sdresult)
 {
+    sidedef_t front, back;
     unsigned int count;
-    uint8_t merge_domain;
 
     ldresult->len = linedefs->len;
     ldresult->lines = ALLOC_ARRAY(linedef_t, ldresult->len);
     memcpy(ldresult->lines, linedefs->lines, sizeof(linedef_t) * linedefs->len);
 
-    sdresult->size = sidedefs->len;
-    sdresult->sides = ALLOC_ARRAY(sidedef_t, sdresult->size);
-    sdresult->len = 0;
+    AllocSidedefs(sdresult, sidedefs->len, sidedefs->textures);
 
     for (count = 0; count < linedefs->len; count++)
     {
@@ -585,28 +1440,17 @@ static bool RebuildSidedefs(const linedef_array_t *linedefs,
             !CheckSidedefIndex(count, ld->sidedef2, sidedefs->len))
         {
             free(ldresult->lines);
-            free(sdresult->sides);
+            FreeSidedefs(sdresult);
             return false;
         }
-        merge_domain = LinedefMergeDomain(ld);
+        CopySidedefs(level, sidedefs, ld, &front, &back);
         if (ld->sidedef1 != NO_SIDEDEF)
         {
-            ld->sidedef1 =
-                AppendNewSidedef(sdresult, &sidedefs->sides[ld->sidedef1]);
-            sdresult->sides[ld->sidedef1].merge_domain = merge_domain;
-
-            // One-sided line?
-            if (wipesides && ld->sidedef2 == NO_SIDEDEF)
-            {
-                strncpy(sdresult->sides[ld->sidedef1].upper, "-", 2);
-                strncpy(sdresult->sides[ld->sidedef1].lower, "-", 2);
-            }
+            ld->sidedef1 = AppendNewSidedef(sdresult, &front);
         }
         if (ld->sidedef2 != NO_SIDEDEF)
         {
-            ld->sidedef2 =
-                AppendNewSidedef(sdresult, &sidedefs->sides[ld->sidedef2]);
-            sdresult->sides[ld->sidedef2].merge_domain = merge_domain;
+            ld->sidedef2 = AppendNewSidedef(sdresult, &back);
         }
     }
 
@@ -628,155 +1472,305 @@ static sidedef_ref_t MapSidedefRef(uint16_t val)
     return val;
 }
 
-static linedef_array_t ReadDoomLinedefs(wad_file_t *wf, unsigned int lumpnum)
+static void DecodeDoomLinedefs(const uint8_t *cptr, linedef_t *lines,
+                               size_t len)
 {
-    linedef_array_t result;
-    uint8_t *cptr, *lump;
-    unsigned int i;
+    size_t i;
 
-    result.len = wf->entries[lumpnum].length / LDEF_SIZE;
-    result.lines = ALLOC_ARRAY(linedef_t, result.len);
-    lump = CacheLump(wf, lumpnum);
-    cptr = lump;
-    for (i = 0; i < result.len; i++)
-    {
-        memset(&result.lines[i], 0, sizeof(linedef_t));
-        result.lines[i].vertex1 = READ_SHORT(cptr + LDEF_VERT1);
-        result.lines[i].vertex2 = READ_SHORT(cptr + LDEF_VERT2);
-        result.lines[i].flags = READ_SHORT(cptr + LDEF_FLAGS);
-        result.lines[i].type = READ_SHORT(cptr + LDEF_TYPES);
-        result.lines[i].x.tag = READ_SHORT(cptr + LDEF_TAG);
-        result.lines[i].sidedef1 = MapSidedefRef(READ_SHORT(cptr + LDEF_SDEF1));
-        result.lines[i].sidedef2 = MapSidedefRef(READ_SHORT(cptr + LDEF_SDEF2));
-        cptr += LDEF_SIZE;
+    for (i = 0; i < len; i++, cptr += LDEF_SIZE)
+    {
+        memset(&lines[i], 0, sizeof(linedef_t));
+        lines[i].vertex1 = READ_SHORT(cptr + LDEF_VERT1);
+        lines[i].vertex2 = READ_SHORT(cptr + LDEF_VERT2);
+        lines[i].flags = READ_SHORT(cptr + LDEF_FLAGS);
+        lines[i].type = READ_SHORT(cptr + LDEF_TYPES);
+        lines[i].x.tag = READ_SHORT(cptr + LDEF_TAG);
+        lines[i].sidedef1 = MapSidedefRef(READ_SHORT(cptr + LDEF_SDEF1));
+        lines[i].sidedef2 = MapSidedefRef(READ_SHORT(cptr + LDEF_SDEF2));
     }
-    free(lump);
-    return result;
 }
 
-static void WriteDoomLinedefs(const linedef_array_t *linedefs, FILE *fp)
+static void EncodeDoomLinedefs(const linedef_t *lines, size_t len,
+                               uint8_t *cptr)
 {
-    uint8_t convbuffer[LDEF_SIZE];
-    unsigned int i;
+    size_t i;
 
-    for (i = 0; i < linedefs->len; i++)
+    for (i = 0; i < len; i++, cptr += LDEF_SIZE)
     {
-        WRITE_SHORT(convbuffer + LDEF_VERT1, linedefs->lines[i].vertex1);
-        WRITE_SHORT(convbuffer + LDEF_VERT2, linedefs->lines[i].vertex2);
-        WRITE_SHORT(convbuffer + LDEF_FLAGS, linedefs->lines[i].flags);
-        WRITE_SHORT(convbuffer + LDEF_TYPES, linedefs->lines[i].type);
-        WRITE_SHORT(convbuffer + LDEF_TAG, linedefs->lines[i].x.tag);
-        WRITE_SHORT(convbuffer + LDEF_SDEF1,
-                    linedefs->lines[i].sidedef1 & 0xffff);
-        WRITE_SHORT(convbuffer + LDEF_SDEF2,
-                    linedefs->lines[i].sidedef2 & 0xffff);
-        if (fwrite(convbuffer, LDEF_SIZE, 1, fp) != 1)
-        {
-            perror("fwrite");
-            ErrorExit("Failed writing linedef #%d to output file", i);
-        }
+        WRITE_SHORT(cptr + LDEF_VERT1, lines[i].vertex1);
+        WRITE_SHORT(cptr + LDEF_VERT2, lines[i].vertex2);
+        WRITE_SHORT(cptr + LDEF_FLAGS, lines[i].flags);
+        WRITE_SHORT(cptr + LDEF_TYPES, lines[i].type);
+        WRITE_SHORT(cptr + LDEF_TAG, lines[i].x.tag);
+        WRITE_SHORT(cptr + LDEF_SDEF1, lines[i].sidedef1 & 0xffff);
+        WRITE_SHORT(cptr + LDEF_SDEF2, lines[i].sidedef2 & 0xffff);
     }
 }
 
-static linedef_array_t ReadHexenLinedefs(wad_file_t *wf, unsigned int lumpnum)
+static void DecodeHexenLinedefs(const uint8_t *cptr, linedef_t *lines,
+                                size_t len)
 {
-    linedef_array_t result;
-    uint8_t *cptr, *lump;
-    unsigned int i;
+    size_t i;
 
-    result.len = wf->entries[lumpnum].length / HX_LDEF_SIZE;
-    result.lines = ALLOC_ARRAY(linedef_t, result.len);
-    lump = CacheLump(wf, lumpnum);
-    cptr = lump;
-    for (i = 0; i < result.len; i++)
-    {
-        memset(&result.lines[i], 0, sizeof(linedef_t));
-        result.lines[i].vertex1 = READ_SHORT(cptr + HX_LDEF_VERT1);
-        result.lines[i].vertex2 = READ_SHORT(cptr + HX_LDEF_VERT2);
-        result.lines[i].flags = READ_SHORT(cptr + HX_LDEF_FLAGS);
-        result.lines[i].type = cptr[HX_LDEF_TYPES];
-        memcpy(&result.lines[i].x.args, cptr + HX_LDEF_ARGS, 5);
-        result.lines[i].sidedef1 =
-            MapSidedefRef(READ_SHORT(cptr + HX_LDEF_SDEF1));
-        result.lines[i].sidedef2 =
-            MapSidedefRef(READ_SHORT(cptr + HX_LDEF_SDEF2));
-        cptr += HX_LDEF_SIZE;
+    for (i = 0; i < len; i++, cptr += HX_LDEF_SIZE)
+    {
+        memset(&lines[i], 0, sizeof(linedef_t));
+        lines[i].vertex1 = READ_SHORT(cptr + HX_LDEF_VERT1);
+        lines[i].vertex2 = READ_SHORT(cptr + HX_LDEF_VERT2);
+        lines[i].flags = READ_SHORT(cptr + HX_LDEF_FLAGS);
+        lines[i].type = cptr[HX_LDEF_TYPES];
+        memcpy(lines[i].x.args, cptr + HX_LDEF_ARGS, 5);
+        lines[i].sidedef1 = MapSidedefRef(READ_SHORT(cptr + HX_LDEF_SDEF1));
+        lines[i].sidedef2 = MapSidedefRef(READ_SHORT(cptr + HX_LDEF_SDEF2));
     }
-    free(lump);
-    return result;
 }
 
-static void WriteHexenLinedefs(const linedef_array_t *linedefs, FILE *fp)
+static void EncodeHexenLinedefs(const linedef_t *lines, size_t len,
+                                uint8_t *cptr)
 {
-    uint8_t convbuffer[HX_LDEF_SIZE];
-    unsigned int i;
+    size_t i;
 
-    for (i = 0; i < linedefs->len; i++)
+    for (i = 0; i < len; i++, cptr += HX_LDEF_SIZE)
     {
-        WRITE_SHORT(convbuffer + HX_LDEF_VERT1, linedefs->lines[i].vertex1);
-        WRITE_SHORT(convbuffer + HX_LDEF_VERT2, linedefs->lines[i].vertex2);
-        WRITE_SHORT(convbuffer + HX_LDEF_FLAGS, linedefs->lines[i].flags);
-        convbuffer[HX_LDEF_TYPES] = linedefs->lines[i].type;
-        memcpy(convbuffer + HX_LDEF_ARGS, linedefs->lines[i].x.args, 5);
-        WRITE_SHORT(convbuffer + HX_LDEF_SDEF1,
-                    linedefs->lines[i].sidedef1 & 0xffff);
-        WRITE_SHORT(convbuffer + HX_LDEF_SDEF2,
-                    linedefs->lines[i].sidedef2 & 0xffff);
-        if (fwrite(convbuffer, HX_LDEF_SIZE, 1, fp) != 1)
-        {
-            perror("fwrite");
-            ErrorExit("Failed writing linedef #%d to output file", i);
-        }
+        WRITE_SHORT(cptr + HX_LDEF_VERT1, lines[i].vertex1);
+        WRITE_SHORT(cptr + HX_LDEF_VERT2, lines[i].vertex2);
+        WRITE_SHORT(cptr + HX_LDEF_FLAGS, lines[i].flags);
+        cptr[HX_LDEF_TYPES] = lines[i].type;
+        memcpy(cptr + HX_LDEF_ARGS, lines[i].x.args, 5);
+        WRITE_SHORT(cptr + HX_LDEF_SDEF1, lines[i].sidedef1 & 0xffff);
+        WRITE_SHORT(cptr + HX_LDEF_SDEF2, lines[i].sidedef2 & 0xffff);
     }
 }
 
-static sidedef_array_t ReadSidedefs(wad_file_t *wf, unsigned int lumpnum)
+static void DecodeDoom64Linedefs(const uint8_t *cptr, linedef_t *lines,
+                                 size_t len)
 {
-    sidedef_array_t result;
-    uint8_t *cptr, *lump;
-    unsigned int i;
+    size_t i;
 
-    result.len = wf->entries[lumpnum].length / SDEF_SIZE;
-    result.sides = ALLOC_ARRAY(sidedef_t, result.len);
-    lump = CacheLump(wf, lumpnum);
-    cptr = lump;
-    for (i = 0; i < result.len; i++)
-    {
-        result.sides[i].xoffset = READ_SHORT(cptr + SDEF_XOFF);
-        result.sides[i].yoffset = READ_SHORT(cptr + SDEF_YOFF);
-        memset(result.sides[i].upper, 0, 8);
-        strncpy(result.sides[i].upper, (char *) cptr + SDEF_UPPER, 8);
-        memset(result.sides[i].middle, 0, 8);
-        strncpy(result.sides[i].middle, (char *) cptr + SDEF_MIDDLE, 8);
-        memset(result.sides[i].lower, 0, 8);
-        strncpy(result.sides[i].lower, (char *) cptr + SDEF_LOWER, 8);
-        result.sides[i].sector_ref = READ_SHORT(cptr + SDEF_SECTOR);
-        result.sides[i].merge_domain = 0;
-        cptr += SDEF_SIZE;
+    for (i = 0; i < len; i++, cptr += D64_LDEF_SIZE)
+    {
+        memset(&lines[i], 0, sizeof(linedef_t));
+        lines[i].vertex1 = READ_SHORT(cptr + D64_LDEF_VERT1);
+        lines[i].vertex2 = READ_SHORT(cptr + D64_LDEF_VERT2);
+        lines[i].flags = READ_SHORT(cptr + D64_LDEF_FLAGS) |
+                         ((unsigned int) READ_SHORT(cptr + D64_LDEF_FLAGS + 2)
+                          << 16);
+        lines[i].type = READ_SHORT(cptr + D64_LDEF_TYPES);
+        lines[i].x.tag = READ_SHORT(cptr + D64_LDEF_TAG);
+        lines[i].sidedef1 = MapSidedefRef(READ_SHORT(cptr + D64_LDEF_SDEF1));
+        lines[i].sidedef2 = MapSidedefRef(READ_SHORT(cptr + D64_LDEF_SDEF2));
+    }
+}
+
+static void EncodeDoom64Linedefs(const linedef_t *lines, size_t len,
+                                 uint8_t *cptr)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++, cptr += D64_LDEF_SIZE)
+    {
+        WRITE_SHORT(cptr + D64_LDEF_VERT1, lines[i].vertex1);
+        WRITE_SHORT(cptr + D64_LDEF_VERT2, lines[i].vertex2);
+        WRITE_LONG(cptr + D64_LDEF_FLAGS, lines[i].flags);
+        WRITE_SHORT(cptr + D64_LDEF_TYPES, lines[i].type);
+        WRITE_SHORT(cptr + D64_LDEF_TAG, lines[i].x.tag);
+        WRITE_SHORT(cptr + D64_LDEF_SDEF1, lines[i].sidedef1 & 0xffff);
+        WRITE_SHORT(cptr + D64_LDEF_SDEF2, lines[i].sidedef2 & 0xffff);
+    }
+}
+
+static const linedef_format_t doom_linedefs = {
+    LDEF_SIZE, DecodeDoomLinedefs, EncodeDoomLinedefs,
+};
+
+static const linedef_format_t hexen_linedefs = {
+    HX_LDEF_SIZE, DecodeHexenLinedefs, EncodeHexenLinedefs,
+};
+
+static const linedef_format_t doom64_linedefs = {
+    D64_LDEF_SIZE, DecodeDoom64Linedefs, EncodeDoom64Linedefs,
+};
+
+static const linedef_format_t *LinedefFormat(const level_t *level)
+{
+    switch (level->format)
+    {
+    case FORMAT_HEXEN:
+        return &hexen_linedefs;
+    case FORMAT_DOOM64:
+        return &doom64_linedefs;
+    default:
+        return &doom_linedefs;
+    }
+}
+
+static void DecodeDoomSidedefs(const uint8_t *cptr, sidedef_array_t *sidedefs)
+{
+    texture_table_t *textures = sidedefs->textures;
+    size_t i;
+
+    for (i = 0; i < sidedefs->len; i++, cptr += SDEF_SIZE)
+    {
+        sidedefs->xoffset[i] = READ_SHORT(cptr + SDEF_XOFF);
+        sidedefs->yoffset[i] = READ_SHORT(cptr + SDEF_YOFF);
+        sidedefs->upper[i] =
+            InternTexture(textures, (const char *) cptr + SDEF_UPPER);
+        sidedefs->middle[i] =
+            InternTexture(textures, (const char *) cptr + SDEF_MIDDLE);
+        sidedefs->lower[i] =
+            InternTexture(textures, (const char *) cptr + SDEF_LOWER);
+        sidedefs->sector_ref[i] = READ_SHORT(cptr + SDEF_SECTOR);
+        sidedefs->merge_domain[i] = 0;
+    }
+}
+
+static void EncodeDoomSidedefs(const sidedef_array_t *sidedefs, uint8_t *cptr)
+{
+    const texture_table_t *textures = sidedefs->textures;
+    size_t i;
+
+    for (i = 0; i < sidedefs->len; i++, cptr += SDEF_SIZE)
+    {
+        WRITE_SHORT(cptr + SDEF_XOFF, sidedefs->xoffset[i]);
+        WRITE_SHORT(cptr + SDEF_YOFF, sidedefs->yoffset[i]);
+        memcpy(cptr + SDEF_UPPER, textures->names[sidedefs->upper[i]], 8);
+        memcpy(cptr + SDEF_MIDDLE, textures->names[sidedefs->middle[i]], 8);
+        memcpy(cptr + SDEF_LOWER, textures->names[sidedefs->lower[i]], 8);
+        WRITE_SHORT(cptr + SDEF_SECTOR, sidedefs->sector_ref[i]);
+    }
+}
+
+// Doom 64 textures are indexes into the list of textures in the IWAD.
+// They are interned as decimal strings, so that the rest of the code can
+// treat them in the same way as texture names.
+static texture_ref_t InternTextureIndex(texture_table_t *textures,
+                                        unsigned int index)
+{
+    char buf[8];
+
+    snprintf(buf, sizeof(buf), "%u", index);
+    return InternTexture(textures, buf);
+}
+
+static unsigned int TextureIndex(const texture_table_t *textures,
+                                 texture_ref_t tex)
+{
+    char buf[9];
+
+    memcpy(buf, textures->names[tex], 8);
+    buf[8] = '\0';
+    return strtoul(buf, NULL, 10);
+}
+
+static void DecodeDoom64Sidedefs(const uint8_t *cptr,
+                                 sidedef_array_t *sidedefs)
+{
+    texture_table_t *textures = sidedefs->textures;
+    size_t i;
+
+    for (i = 0; i < sidedefs->len; i++, cptr += D64_SDEF_SIZE)
+    {
+        sidedefs->xoffset[i] = READ_SHORT(cptr + D64_SDEF_XOFF);
+        sidedefs->yoffset[i] = READ_SHORT(cptr + D64_SDEF_YOFF);
+        sidedefs->upper[i] =
+            InternTextureIndex(textures, READ_SHORT(cptr + D64_SDEF_UPPER));
+        sidedefs->middle[i] =
+            InternTextureIndex(textures, READ_SHORT(cptr + D64_SDEF_MIDDLE));
+        sidedefs->lower[i] =
+            InternTextureIndex(textures, READ_SHORT(cptr + D64_SDEF_LOWER));
+        sidedefs->sector_ref[i] = READ_SHORT(cptr + D64_SDEF_SECTOR);
+        sidedefs->merge_domain[i] = 0;
+    }
+}
+
+static void EncodeDoom64Sidedefs(const sidedef_array_t *sidedefs,
+                                 uint8_t *cptr)
+{
+    const texture_table_t *textures = sidedefs->textures;
+    size_t i;
+
+    for (i = 0; i < sidedefs->len; i++, cptr += D64_SDEF_SIZE)
+    {
+        WRITE_SHORT(cptr + D64_SDEF_XOFF, sidedefs->xoffset[i]);
+        WRITE_SHORT(cptr + D64_SDEF_YOFF, sidedefs->yoffset[i]);
+        WRITE_SHORT(cptr + D64_SDEF_UPPER,
+                    TextureIndex(textures, sidedefs->upper[i]));
+        WRITE_SHORT(cptr + D64_SDEF_MIDDLE,
+                    TextureIndex(textures, sidedefs->middle[i]));
+        WRITE_SHORT(cptr + D64_SDEF_LOWER,
+                    TextureIndex(textures, sidedefs->lower[i]));
+        WRITE_SHORT(cptr + D64_SDEF_SECTOR, sidedefs->sector_ref[i]);
+    }
+}
+
+static const sidedef_format_t doom_sidedefs = {
+    SDEF_SIZE, DecodeDoomSidedefs, EncodeDoomSidedefs,
+};
+
+static const sidedef_format_t doom64_sidedefs = {
+    D64_SDEF_SIZE, DecodeDoom64Sidedefs, EncodeDoom64Sidedefs,
+};
+
+static const sidedef_format_t *SidedefFormat(const level_t *level)
+{
+    if (level->format == FORMAT_DOOM64)
+    {
+        return &doom64_sidedefs;
     }
+    return &doom_sidedefs;
+}
+
+// Linedefs and sidedefs are converted a whole lump at a time, to and from
+// a buffer that is read or written in a single call.
+
+static linedef_array_t ReadLinedefs(const level_t *level)
+{
+    const linedef_format_t *format = LinedefFormat(level);
+    wad_file_t *wf = level->wf;
+    linedef_array_t result;
+    uint8_t *lump;
+
+    result.len = wf->entries[level->linedef_num].length / format->size;
+    result.lines = ALLOC_ARRAY(linedef_t, result.len);
+    lump = CacheLump(wf, level->linedef_num);
+    format->decode(lump, result.lines, result.len);
     free(lump);
     return result;
 }
 
-static void WriteSidedefs(const sidedef_array_t *sidedefs, FILE *fp)
+static void EncodeLinedefs(const level_t *level,
+                           const linedef_array_t *linedefs, lump_t *lump)
 {
-    uint8_t convbuffer[SDEF_SIZE];
-    unsigned int i;
+    const linedef_format_t *format = LinedefFormat(level);
 
-    for (i = 0; i < sidedefs->len; i++)
-    {
-        memset(convbuffer, 0, sizeof(convbuffer));
-        WRITE_SHORT(convbuffer + SDEF_XOFF, sidedefs->sides[i].xoffset);
-        WRITE_SHORT(convbuffer + SDEF_YOFF, sidedefs->sides[i].yoffset);
-        strncpy((char *) convbuffer + SDEF_UPPER, sidedefs->sides[i].upper, 8);
-        strncpy((char *) convbuffer + SDEF_MIDDLE, sidedefs->sides[i].middle,
-                8);
-        strncpy((char *) convbuffer + SDEF_LOWER, sidedefs->sides[i].lower, 8);
-        WRITE_SHORT(convbuffer + SDEF_SECTOR, sidedefs->sides[i].sector_ref);
-        if (fwrite(convbuffer, SDEF_SIZE, 1, fp) != 1)
-        {
-            perror("fwrite");
-            ErrorExit("Failed writing sidedef #%d to output file", i);
-        }
-    }
+    lump->len = linedefs->len * format->size;
+    lump->data = ALLOC_ARRAY(uint8_t, lump->len);
+    format->encode(linedefs->lines, linedefs->len, lump->data);
+}
+
+static sidedef_array_t ReadSidedefs(level_t *level)
+{
+    const sidedef_format_t *format = SidedefFormat(level);
+    wad_file_t *wf = level->wf;
+    sidedef_array_t result;
+    uint8_t *lump;
+    size_t len;
+
+    len = wf->entries[level->sidedef_num].length / format->size;
+    AllocSidedefs(&result, len, &level->textures);
+    result.len = len;
+    lump = CacheLump(wf, level->sidedef_num);
+    format->decode(lump, &result);
+    free(lump);
+    return result;
+}
+
+static void EncodeSidedefs(const level_t *level,
+                           const sidedef_array_t *sidedefs, lump_t *lump)
+{
+    const sidedef_format_t *format = SidedefFormat(level);
+
+    lump->len = sidedefs->len * format->size;
+    lump->data = ALLOC_ARRAY(uint8_t, lump->len);
+    format->encode(sidedefs, lump->data);
 }
@@ -18,15 +18,32 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#include "sha1.h"
 #include "waddir.h"
 
+// Linedefs with tags in this range will have their sidedefs merged, even if
+// they're special lines.
+#define MERGE_RANGE_START 9700
+#define MERGE_RANGE_END   9799
+
+// Sidedefs in this merge domain are attached to special lines and are never
+// merged.
+#define MERGE_DOMAIN_SPECIAL 0
+
+// The lumps of a level that are rebuilt by P_Pack(). LINEDEFS and SIDEDEFS
+// are always returned; the other lumps have NULL data unless they changed.
+typedef struct {
+    lump_t linedefs, sidedefs;
+    lump_t vertexes, segs, sectors, reject;
+} packed_level_t;
+
 // The sidedef packing functions take the index of a SIDEDEFS lump to pack,
 // and assume that the preceding lump is the LINEDEFS lump.
-bool P_Pack(wad_file_t *wf, unsigned int sidedef_num);
-bool P_Unpack(wad_file_t *wf, unsigned int sidedef_num);
+bool P_Pack(wad_file_t *wf, unsigned int sidedef_num, packed_level_t *result);
+bool P_Unpack(wad_file_t *wf, unsigned int sidedef_num, lump_t *linedefs_lump,
+              lump_t *sidedefs_lump);
 bool P_IsPacked(wad_file_t *wf, unsigned int sidedef_num);
-
-void P_WriteLinedefs(FILE *fstream, entry_t *entry);
-void P_WriteSidedefs(FILE *fstream, entry_t *entry);
+bool P_HashLevel(wad_file_t *wf, unsigned int sidedef_num,
+                 sha1_digest_t linedefs_hash, sha1_digest_t sidedefs_hash);
 
 #endif
@@ -0,0 +1,329 @@
+/*
+ * Copyright(C) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *
+ * Tables of linedef specials, describing which specials read or change
+ * sidedefs during play and so must not share them with other linedefs.
+ */
+
+#include "specials.h"
+
+#define FRONT  SPECIAL_FRONT_UNSAFE
+#define BACK   SPECIAL_BACK_UNSAFE
+#define TAGGED SPECIAL_TAGGED_UNSAFE
+
+// Switch (S1/SR) and gun (G1/GR) lines change the texture of their front
+// sidedef when they are activated.
+#define SWITCH FRONT
+
+// Specials that are not in the tables are assumed to be unsafe on both
+// sides, since source ports keep adding new ones.
+#define UNKNOWN (FRONT | BACK)
+
+typedef struct {
+    unsigned int first, last;
+    unsigned int flags;
+} special_range_t;
+
+// Doom format specials, in order. Walk (W1/WR) and door (D1/DR) triggers
+// do not touch sidedefs, so they are listed as safe.
+static const special_range_t doom_specials[] = {
+    // Vanilla Doom:
+    {1, 6, 0},
+    {7, 7, SWITCH},
+    {8, 8, 0},
+    {9, 9, SWITCH},
+    {10, 10, 0},
+    {11, 11, SWITCH},
+    {12, 13, 0},
+    {14, 15, SWITCH},
+    {16, 17, 0},
+    {18, 18, SWITCH},
+    {19, 19, 0},
+    {20, 21, SWITCH},
+    {22, 22, 0},
+    {23, 24, SWITCH},
+    {25, 28, 0},
+    {29, 29, SWITCH},
+    {30, 40, 0},
+    {41, 43, SWITCH},
+    {44, 44, 0},
+    {45, 47, SWITCH},
+    {48, 48, FRONT}, // Scrolling wall
+    {49, 51, SWITCH},
+    {52, 54, 0},
+    {55, 55, SWITCH},
+    {56, 59, 0},
+    {60, 71, SWITCH},
+    {72, 77, 0},
+    {78, 78, SWITCH}, // Boom: change texture and type
+    {79, 84, 0},
+    {85, 85, FRONT}, // Boom: scrolling wall (right)
+    {86, 98, 0},
+    {99, 99, SWITCH},
+    {100, 100, 0},
+    {101, 103, SWITCH},
+    {104, 110, 0},
+    {111, 116, SWITCH},
+    {117, 121, 0},
+    {122, 123, SWITCH},
+    {124, 126, 0},
+    {127, 127, SWITCH},
+    {128, 130, 0},
+    {131, 140, SWITCH},
+    {141, 141, 0},
+
+    // Boom extended specials:
+    {142, 157, 0},
+    {158, 198, SWITCH},
+    {199, 202, 0},
+    {203, 206, SWITCH},
+    {207, 208, 0},
+    {209, 211, SWITCH},
+    {212, 217, 0},        // Includes floor and ceiling scrollers
+    {218, 218, TAGGED},   // Accelerative wall scroller
+    {219, 220, 0},
+    {221, 222, SWITCH},
+    {223, 228, 0},        // Includes friction and pushers
+    {229, 230, SWITCH},
+    {231, 232, 0},
+    {233, 234, SWITCH},
+    {235, 236, 0},
+    {237, 238, SWITCH},
+    {239, 240, 0},
+    {241, 241, SWITCH},
+    {242, 242, FRONT},    // Deep water; textures name colormaps
+    {243, 248, 0},
+    {249, 249, TAGGED},   // Displacement wall scroller
+    {250, 253, 0},
+    {254, 254, TAGGED},   // Wall scroller
+    {255, 255, FRONT},    // Scroll by sidedef offsets
+    {256, 257, 0},
+    {258, 259, SWITCH},
+    {260, 260, FRONT},    // Translucency; texture names a TRANMAP
+    {261, 269, 0},
+
+    // MBF:
+    {271, 272, FRONT},    // Sky transfer
+
+    // MBF21 wall scrollers, using the offsets of the front sidedef:
+    {1024, 1026, FRONT | TAGGED},
+};
+
+// Specials from Hexen itself. Specials added by source ports (mostly by
+// ZDoom) are not listed here and are treated as unsafe.
+static const special_range_t hexen_specials[] = {
+    {1, 1, FRONT | BACK},  // Polyobj_StartLine
+    {2, 4, 0},
+    {5, 5, FRONT | BACK},  // Polyobj_ExplicitLine
+    {6, 8, 0},
+    {10, 13, 0},           // Doors
+    {20, 32, 0},           // Floors, stairs and pillars
+    {35, 36, 0},
+    {40, 46, 0},           // Ceilings
+    {60, 69, 0},           // Platforms
+    {70, 75, 0},           // Teleports and things
+    {80, 83, 0},           // ACS
+    {90, 96, 0},
+    {100, 103, FRONT},     // Scroll_Texture_*
+    {109, 116, 0},         // Lighting
+    {120, 120, 0},
+    {121, 121, FRONT | BACK}, // Line_SetIdentification; scripts can change
+                              // the textures of lines with an ID
+    {129, 138, 0},
+    {140, 140, 0},
+};
+
+// Hexen line activation types, stored in bits 10-12 of the line flags.
+#define HEXEN_SPAC_SHIFT  10
+#define HEXEN_SPAC_MASK   7
+#define HEXEN_SPAC_USE    1
+#define HEXEN_SPAC_IMPACT 3
+
+static unsigned int LookupSpecial(const special_range_t *table,
+                                  unsigned int table_len, unsigned int type)
+{
+    unsigned int lo = 0, hi = table_len;
+
+    while (lo < hi)
+    {
+        unsigned int mid = (lo + hi) / 2;
+        if (type < table[mid].first)
+        {
+            hi = mid;
+        }
+        else if (type > table[mid].last)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            return table[mid].flags;
+        }
+    }
+
+    return UNKNOWN;
+}
+
+// Returns the SPECIAL_* flags for the given Doom format linedef type.
+unsigned int L_DoomSpecialFlags(unsigned int type)
+{
+    if (type == 0)
+    {
+        return 0;
+    }
+
+    // Boom generalized linedefs. The low three bits are the trigger type:
+    // W1, WR, S1, SR, G1, GR, D1, DR.
+    if (type >= 0x2f80 && type <= 0x7fff)
+    {
+        unsigned int trigger = type & 7;
+        return trigger >= 2 && trigger <= 5 ? SWITCH : 0;
+    }
+
+    return LookupSpecial(doom_specials,
+                         sizeof(doom_specials) / sizeof(*doom_specials), type);
+}
+
+// Returns the SPECIAL_* flags for the given Hexen format linedef special,
+// which also depend on how the line is activated.
+unsigned int L_HexenSpecialFlags(unsigned int type, unsigned int line_flags)
+{
+    unsigned int activation, flags;
+
+    if (type == 0)
+    {
+        return 0;
+    }
+
+    flags = LookupSpecial(hexen_specials,
+                          sizeof(hexen_specials) / sizeof(*hexen_specials),
+                          type);
+
+    // As in Doom, lines that are used or shot act as switches.
+    activation = (line_flags >> HEXEN_SPAC_SHIFT) & HEXEN_SPAC_MASK;
+    if (activation == HEXEN_SPAC_USE || activation == HEXEN_SPAC_IMPACT)
+    {
+        flags |= SWITCH;
+    }
+
+    return flags;
+}
+
+// Doom 64 packs the trigger type into the upper bits of the special; the
+// low eight bits are the action itself.
+#define D64_SPECIAL_SHOOT 0x2000
+#define D64_SPECIAL_USE   0x4000
+
+// Doom 64 wall scrolling is set with line flags rather than specials.
+#define D64_ML_SCROLL 0x1e0000
+
+// Returns the SPECIAL_* flags for the given Doom 64 format linedef, which
+// depend on its flags and tag as well as its special.
+unsigned int L_Doom64SpecialFlags(unsigned int type, unsigned int line_flags,
+                                  unsigned int tag)
+{
+    unsigned int flags = 0;
+
+    if ((type & (D64_SPECIAL_SHOOT | D64_SPECIAL_USE)) != 0)
+    {
+        flags |= SWITCH;
+    }
+    if ((line_flags & D64_ML_SCROLL) != 0)
+    {
+        flags |= FRONT;
+    }
+
+    // Macros can change the textures of any line with a tag, on either
+    // side; there is no way to tell which tags they use without decoding
+    // the MACROS lump, so tagged lines are never merged.
+    if (tag != 0)
+    {
+        flags |= FRONT | BACK;
+    }
+
+    return flags;
+}
+
+// Stair builders and donuts move sectors that are found by walking from
+// the tagged sector to its neighbors, so those sectors need not be tagged.
+static const unsigned short neighbor_movers[] = {
+    7,   8,   100, 127, 256, 257, 258, 259, // Stairs
+    9,   146, 155, 191,                     // Donuts
+};
+
+static bool IsInList(const unsigned short *list, unsigned int len,
+                     unsigned int type)
+{
+    unsigned int i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (type == list[i])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if the given Doom format linedef type can move sectors
+// that do not have its tag.
+static bool MovesNeighborSectors(unsigned int type)
+{
+    // Boom generalized stairs.
+    if (type >= 0x3000 && type < 0x3400)
+    {
+        return true;
+    }
+
+    return IsInList(neighbor_movers,
+                    sizeof(neighbor_movers) / sizeof(*neighbor_movers), type);
+}
+
+// Doom format specials that never find sectors by their tag: manual doors
+// act on the sector behind the line, and the others do not move sectors.
+static const unsigned short untagged_specials[] = {
+    1,  26, 27, 28, 31, 32, 33, 34, 117, 118, // Manual doors
+    11, 51, 52, 124, 197, 198,                // Exits
+    39, 97, 125, 126,                         // Teleports
+    48, 85, 255,                              // Wall scrollers
+};
+
+// Boom generalized specials start here, and have their trigger type in
+// the bottom three bits; D1 and DR triggers are manual.
+#define GENERALIZED_FIRST  0x2f80
+#define GENERALIZED_MANUAL 6
+
+// Returns true if the given Doom format linedef can move sectors that do
+// not have a tag. Stair builders and donuts move sectors that are found
+// from the tagged one; and the engine looks up sectors without treating
+// tag 0 specially, so a special with tag 0 moves every sector that has no
+// tag, unless it is one that does not use its tag.
+bool L_MovesUntaggedSectors(unsigned int type, unsigned int tag)
+{
+    if (MovesNeighborSectors(type))
+    {
+        return true;
+    }
+
+    if (type == 0 || tag != 0)
+    {
+        return false;
+    }
+
+    if (type >= GENERALIZED_FIRST)
+    {
+        return (type & GENERALIZED_MANUAL) != GENERALIZED_MANUAL;
+    }
+
+    return !IsInList(untagged_specials,
+                     sizeof(untagged_specials) / sizeof(*untagged_specials),
+                     type);
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright(C) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *
+ * Tables of linedef specials, describing which specials read or change
+ * sidedefs during play and so must not share them with other linedefs.
+ */
+
+#ifndef __SPECIALS_H_INCLUDED__
+#define __SPECIALS_H_INCLUDED__
+
+#include <stdbool.h>
+
+// The special reads or changes the line's own front sidedef; for example
+// switches change the texture of their front sidedef when used.
+#define SPECIAL_FRONT_UNSAFE 0x01
+
+// The special reads or changes the line's own back sidedef.
+#define SPECIAL_BACK_UNSAFE 0x02
+
+// The special changes the front sidedefs of the lines that share its tag;
+// for example Boom's wall scrollers.
+#define SPECIAL_TAGGED_UNSAFE 0x04
+
+unsigned int L_DoomSpecialFlags(unsigned int type);
+unsigned int L_HexenSpecialFlags(unsigned int type, unsigned int line_flags);
+unsigned int L_Doom64SpecialFlags(unsigned int type, unsigned int line_flags,
+                                  unsigned int tag);
+bool L_MovesUntaggedSectors(unsigned int type, unsigned int tag);
+
+#endif
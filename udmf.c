@@ -0,0 +1,1122 @@
+/*
+ * Copyright(C) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *
+ * Compression of UDMF (Universal Doom Map Format) levels. Identical
+ * sidedefs in the TEXTMAP lump are combined in the same way as for
+ * binary format levels, and the text itself is minified.
+ */
+
+#include "udmf.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "errors.h"
+#include "sha1.h"
+#include "sidedefs.h"
+#include "waddir.h"
+#include "wadptr.h"
+
+#define NO_SIDEDEF UINT32_MAX
+
+// A piece of text within the TEXTMAP lump. Nothing is copied out of the
+// lump when it is parsed; everything refers back to the original data.
+typedef struct {
+    uint32_t start, len;
+} span_t;
+
+typedef enum {
+    TOKEN_END,
+    TOKEN_WORD,   // Identifier, number or keyword (true, false)
+    TOKEN_STRING, // Quoted string, including the quotes
+    TOKEN_OPEN_BRACE,
+    TOKEN_CLOSE_BRACE,
+    TOKEN_EQUALS,
+    TOKEN_SEMICOLON,
+    TOKEN_ERROR,
+} token_type_t;
+
+typedef struct {
+    const char *data;
+    size_t pos, len;
+    unsigned int line;
+} tokenizer_t;
+
+typedef struct {
+    span_t key, value;
+} field_t;
+
+typedef enum {
+    BLOCK_ASSIGNMENT, // Top-level "key = value;", eg. the namespace
+    BLOCK_LINEDEF,
+    BLOCK_SIDEDEF,
+    BLOCK_SECTOR,
+    BLOCK_THING,
+    BLOCK_OTHER,
+} block_type_t;
+
+typedef struct {
+    block_type_t type;
+    span_t name;
+    uint32_t first_field, num_fields;
+    // Index into the textmap's linedef or sidedef array, as appropriate.
+    uint32_t index;
+} block_t;
+
+typedef struct {
+    uint32_t block;
+    // The fields of the sidedef that are not set to default values, in
+    // canonical order, so that sidedefs can be compared for equality.
+    uint32_t first_canon, num_canon;
+    uint32_t hash;
+} udmf_sidedef_t;
+
+typedef struct {
+    uint32_t block;
+    // Sidedef numbers, for front and back; new_sides are after packing.
+    uint32_t sides[2], new_sides[2];
+    uint8_t merge_domain;
+} udmf_linedef_t;
+
+typedef struct {
+    char *data;
+    size_t len;
+
+    field_t *fields;
+    uint32_t num_fields, fields_size;
+    block_t *blocks;
+    uint32_t num_blocks, blocks_size;
+
+    udmf_sidedef_t *sidedefs;
+    uint32_t num_sidedefs;
+    udmf_linedef_t *linedefs;
+    uint32_t num_linedefs;
+
+    // Field indexes of sidedef fields, as referenced by udmf_sidedef_t.
+    uint32_t *canon;
+} textmap_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t len, size;
+} buffer_t;
+
+// Fields that are set to their default value can be omitted. In addition
+// to the fields listed here, any field set to false is omitted.
+static const struct {
+    block_type_t type;
+    const char *key;
+    const char *value;
+} default_fields[] = {
+    {BLOCK_LINEDEF, "id", "-1"},
+    {BLOCK_LINEDEF, "special", "0"},
+    {BLOCK_LINEDEF, "arg0", "0"},
+    {BLOCK_LINEDEF, "arg1", "0"},
+    {BLOCK_LINEDEF, "arg2", "0"},
+    {BLOCK_LINEDEF, "arg3", "0"},
+    {BLOCK_LINEDEF, "arg4", "0"},
+    {BLOCK_LINEDEF, "sideback", "-1"},
+    {BLOCK_SIDEDEF, "offsetx", "0"},
+    {BLOCK_SIDEDEF, "offsety", "0"},
+    {BLOCK_SIDEDEF, "texturetop", "\"-\""},
+    {BLOCK_SIDEDEF, "texturebottom", "\"-\""},
+    {BLOCK_SIDEDEF, "texturemiddle", "\"-\""},
+    {BLOCK_SECTOR, "heightfloor", "0"},
+    {BLOCK_SECTOR, "heightceiling", "0"},
+    {BLOCK_SECTOR, "lightlevel", "160"},
+    {BLOCK_SECTOR, "special", "0"},
+    {BLOCK_SECTOR, "id", "0"},
+    {BLOCK_THING, "id", "0"},
+    {BLOCK_THING, "height", "0"},
+    {BLOCK_THING, "angle", "0"},
+    {BLOCK_THING, "special", "0"},
+    {BLOCK_THING, "arg0", "0"},
+    {BLOCK_THING, "arg1", "0"},
+    {BLOCK_THING, "arg2", "0"},
+    {BLOCK_THING, "arg3", "0"},
+    {BLOCK_THING, "arg4", "0"},
+};
+
+static bool SpanEquals(const textmap_t *tm, span_t s, const char *str);
+static bool ParseNumber(const textmap_t *tm, span_t s, double *result);
+
+static bool IsWordChar(char c)
+{
+    return isalnum((unsigned char) c) || c == '_' || c == '.' || c == '+' ||
+           c == '-';
+}
+
+// Skips over whitespace and comments, returning false if the end of the
+// data is reached.
+static bool SkipWhitespace(tokenizer_t *t)
+{
+    while (t->pos < t->len)
+    {
+        char c = t->data[t->pos];
+
+        if (c == '\n')
+        {
+            ++t->line;
+            ++t->pos;
+        }
+        else if (isspace((unsigned char) c))
+        {
+            ++t->pos;
+        }
+        else if (c == '/' && t->pos + 1 < t->len && t->data[t->pos + 1] == '/')
+        {
+            while (t->pos < t->len && t->data[t->pos] != '\n')
+            {
+                ++t->pos;
+            }
+        }
+        else if (c == '/' && t->pos + 1 < t->len && t->data[t->pos + 1] == '*')
+        {
+            t->pos += 2;
+            while (t->pos < t->len &&
+                   (t->data[t->pos] != '*' || t->pos + 1 >= t->len ||
+                    t->data[t->pos + 1] != '/'))
+            {
+                t->line += t->data[t->pos] == '\n';
+                ++t->pos;
+            }
+            t->pos += 2;
+        }
+        else
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static token_type_t NextToken(tokenizer_t *t, span_t *span)
+{
+    char c;
+
+    if (!SkipWhitespace(t))
+    {
+        return TOKEN_END;
+    }
+
+    span->start = t->pos;
+    c = t->data[t->pos];
+    ++t->pos;
+
+    switch (c)
+    {
+    case '{':
+        span->len = 1;
+        return TOKEN_OPEN_BRACE;
+    case '}':
+        span->len = 1;
+        return TOKEN_CLOSE_BRACE;
+    case '=':
+        span->len = 1;
+        return TOKEN_EQUALS;
+    case ';':
+        span->len = 1;
+        return TOKEN_SEMICOLON;
+    case '"':
+        while (t->pos < t->len && t->data[t->pos] != '"')
+        {
+            if (t->data[t->pos] == '\\')
+            {
+                ++t->pos;
+            }
+            ++t->pos;
+        }
+        if (t->pos >= t->len)
+        {
+            return TOKEN_ERROR;
+        }
+        ++t->pos;
+        span->len = t->pos - span->start;
+        return TOKEN_STRING;
+    default:
+        if (!IsWordChar(c))
+        {
+            return TOKEN_ERROR;
+        }
+        while (t->pos < t->len && IsWordChar(t->data[t->pos]))
+        {
+            ++t->pos;
+        }
+        span->len = t->pos - span->start;
+        return TOKEN_WORD;
+    }
+}
+
+static block_type_t BlockType(const textmap_t *tm, span_t name)
+{
+    if (SpanEquals(tm, name, "linedef"))
+    {
+        return BLOCK_LINEDEF;
+    }
+    else if (SpanEquals(tm, name, "sidedef"))
+    {
+        return BLOCK_SIDEDEF;
+    }
+    else if (SpanEquals(tm, name, "sector"))
+    {
+        return BLOCK_SECTOR;
+    }
+    else if (SpanEquals(tm, name, "thing"))
+    {
+        return BLOCK_THING;
+    }
+    return BLOCK_OTHER;
+}
+
+static void AddBlock(textmap_t *tm, block_type_t type, span_t name)
+{
+    block_t *b;
+
+    if (tm->num_blocks >= tm->blocks_size)
+    {
+        tm->blocks_size = tm->blocks_size * 2 + 64;
+        tm->blocks = REALLOC_ARRAY(block_t, tm->blocks, tm->blocks_size);
+    }
+
+    b = &tm->blocks[tm->num_blocks];
+    ++tm->num_blocks;
+    b->type = type;
+    b->name = name;
+    b->first_field = tm->num_fields;
+    b->num_fields = 0;
+    b->index = 0;
+}
+
+// Parses the value and terminating semicolon of a "key = value;"
+// assignment, adding it to the current block.
+static bool ParseValue(tokenizer_t *t, textmap_t *tm, span_t key)
+{
+    token_type_t tok;
+    span_t value, semicolon;
+
+    tok = NextToken(t, &value);
+    if ((tok != TOKEN_WORD && tok != TOKEN_STRING) ||
+        NextToken(t, &semicolon) != TOKEN_SEMICOLON)
+    {
+        return false;
+    }
+
+    if (tm->num_fields >= tm->fields_size)
+    {
+        tm->fields_size = tm->fields_size * 2 + 256;
+        tm->fields = REALLOC_ARRAY(field_t, tm->fields, tm->fields_size);
+    }
+
+    tm->fields[tm->num_fields].key = key;
+    tm->fields[tm->num_fields].value = value;
+    ++tm->num_fields;
+    ++tm->blocks[tm->num_blocks - 1].num_fields;
+
+    return true;
+}
+
+static bool ParseBlock(tokenizer_t *t, textmap_t *tm, span_t name)
+{
+    token_type_t tok;
+    span_t key, equals;
+
+    AddBlock(tm, BlockType(tm, name), name);
+
+    for (;;)
+    {
+        tok = NextToken(t, &key);
+        if (tok == TOKEN_CLOSE_BRACE)
+        {
+            return true;
+        }
+        if (tok != TOKEN_WORD || NextToken(t, &equals) != TOKEN_EQUALS ||
+            !ParseValue(t, tm, key))
+        {
+            return false;
+        }
+    }
+}
+
+// Parses the whole lump in a single pass, building lists of the blocks
+// and fields that it contains.
+static bool ParseTextmap(textmap_t *tm)
+{
+    tokenizer_t t;
+    token_type_t tok;
+    span_t name, span;
+
+    t.data = tm->data;
+    t.pos = 0;
+    t.len = tm->len;
+    t.line = 1;
+
+    for (;;)
+    {
+        tok = NextToken(&t, &name);
+        if (tok == TOKEN_END)
+        {
+            return true;
+        }
+        if (tok != TOKEN_WORD)
+        {
+            break;
+        }
+
+        tok = NextToken(&t, &span);
+        if (tok == TOKEN_EQUALS)
+        {
+            AddBlock(tm, BLOCK_ASSIGNMENT, name);
+            if (!ParseValue(&t, tm, name))
+            {
+                break;
+            }
+        }
+        else if (tok != TOKEN_OPEN_BRACE || !ParseBlock(&t, tm, name))
+        {
+            break;
+        }
+    }
+
+    Warning("Parse error on line %u", t.line);
+    return false;
+}
+
+static bool SpanEquals(const textmap_t *tm, span_t s, const char *str)
+{
+    return strlen(str) == s.len &&
+           !strncasecmp(tm->data + s.start, str, s.len);
+}
+
+static int CompareSpans(const textmap_t *tm, span_t s1, span_t s2,
+                        bool fold_case)
+{
+    const char *p1 = tm->data + s1.start, *p2 = tm->data + s2.start;
+    uint32_t i;
+
+    for (i = 0; i < s1.len && i < s2.len; i++)
+    {
+        int c1 = (unsigned char) p1[i], c2 = (unsigned char) p2[i];
+        if (fold_case)
+        {
+            c1 = tolower(c1);
+            c2 = tolower(c2);
+        }
+        if (c1 != c2)
+        {
+            return c1 - c2;
+        }
+    }
+
+    return (int) s1.len - (int) s2.len;
+}
+
+static bool ParseNumber(const textmap_t *tm, span_t s, double *result)
+{
+    char buf[32], *end;
+
+    if (s.len == 0 || s.len >= sizeof(buf))
+    {
+        return false;
+    }
+    memcpy(buf, tm->data + s.start, s.len);
+    buf[s.len] = '\0';
+
+    // Integers can be given in octal, which strtod() would get wrong.
+    if (strpbrk(buf, ".eE") == NULL || strpbrk(buf, "xX") != NULL)
+    {
+        *result = strtol(buf, &end, 0);
+    }
+    else
+    {
+        *result = strtod(buf, &end);
+    }
+
+    return *end == '\0';
+}
+
+static bool IsDefaultField(const textmap_t *tm, block_type_t type,
+                           const field_t *f)
+{
+    double value, default_value;
+    unsigned int i;
+
+    if (SpanEquals(tm, f->value, "false"))
+    {
+        return true;
+    }
+
+    for (i = 0; i < sizeof(default_fields) / sizeof(*default_fields); i++)
+    {
+        if (default_fields[i].type != type ||
+            !SpanEquals(tm, f->key, default_fields[i].key))
+        {
+            continue;
+        }
+        if (default_fields[i].value[0] == '"')
+        {
+            return SpanEquals(tm, f->value, default_fields[i].value);
+        }
+        default_value = strtod(default_fields[i].value, NULL);
+        return ParseNumber(tm, f->value, &value) && value == default_value;
+    }
+
+    return false;
+}
+
+// Writes the indexes of the fields of the given block that are not set to
+// default values to the given array, sorted by key, returning the number
+// of fields. Two blocks with the same sorted fields are equivalent.
+static uint32_t SortFields(const textmap_t *tm, const block_t *b,
+                           uint32_t *result)
+{
+    uint32_t i, j, num_result = 0;
+
+    for (i = b->first_field; i < b->first_field + b->num_fields; i++)
+    {
+        const field_t *f = &tm->fields[i];
+
+        if (IsDefaultField(tm, b->type, f))
+        {
+            continue;
+        }
+
+        // Blocks only have a handful of fields, so insertion sort is fine.
+        for (j = num_result; j > 0; j--)
+        {
+            const field_t *f2 = &tm->fields[result[j - 1]];
+            int cmp = CompareSpans(tm, f2->key, f->key, true);
+            if (cmp < 0 ||
+                (cmp == 0 && CompareSpans(tm, f2->value, f->value, false) <= 0))
+            {
+                break;
+            }
+            result[j] = result[j - 1];
+        }
+        result[j] = i;
+        ++num_result;
+    }
+
+    return num_result;
+}
+
+static uint32_t HashSpan(uint32_t h, const textmap_t *tm, span_t s,
+                         bool fold_case)
+{
+    const char *p = tm->data + s.start;
+    uint32_t i;
+
+    for (i = 0; i < s.len; i++)
+    {
+        h ^= fold_case ? tolower((unsigned char) p[i]) : (unsigned char) p[i];
+        h *= 16777619;
+    }
+
+    // Terminator, so that "ab" + "c" does not hash the same as "a" + "bc".
+    h ^= 0xff;
+    return h * 16777619;
+}
+
+static void AnalyzeSidedef(textmap_t *tm, uint32_t block_index)
+{
+    udmf_sidedef_t *sd = &tm->sidedefs[tm->num_sidedefs];
+    const block_t *b = &tm->blocks[block_index];
+    uint32_t i, h = 2166136261;
+
+    sd->block = block_index;
+    sd->first_canon = b->first_field;
+    sd->num_canon = SortFields(tm, b, &tm->canon[b->first_field]);
+
+    for (i = 0; i < sd->num_canon; i++)
+    {
+        const field_t *f = &tm->fields[tm->canon[sd->first_canon + i]];
+        h = HashSpan(h, tm, f->key, true);
+        h = HashSpan(h, tm, f->value, false);
+    }
+    sd->hash = h;
+
+    tm->blocks[block_index].index = tm->num_sidedefs;
+    ++tm->num_sidedefs;
+}
+
+static bool ParseSidedefRef(const textmap_t *tm, span_t s, uint32_t *result)
+{
+    double value;
+
+    if (!ParseNumber(tm, s, &value))
+    {
+        return false;
+    }
+    if (value == -1)
+    {
+        *result = NO_SIDEDEF;
+        return true;
+    }
+    if (value < 0 || value >= NO_SIDEDEF || value != (uint32_t) value)
+    {
+        return false;
+    }
+    *result = (uint32_t) value;
+    return true;
+}
+
+// Calculates the merge domain of a linedef. This is more conservative than
+// for binary format levels (see LinedefMergeDomains in sidedefs.c): UDMF
+// levels can use any of the many specials that source ports have added,
+// so all special lines get their own sidedefs. UDMF line IDs can also be
+// targeted by ACS scripts and line specials in ways that tags in binary
+// levels cannot, so any line with an ID is treated as a special line.
+static uint8_t LinedefMergeDomain(const textmap_t *tm, const block_t *b)
+{
+    double id = -1, special = 0;
+    uint32_t i;
+
+    for (i = b->first_field; i < b->first_field + b->num_fields; i++)
+    {
+        const field_t *f = &tm->fields[i];
+
+        if (SpanEquals(tm, f->key, "id"))
+        {
+            if (!ParseNumber(tm, f->value, &id))
+            {
+                return MERGE_DOMAIN_SPECIAL;
+            }
+        }
+        else if (SpanEquals(tm, f->key, "special"))
+        {
+            if (!ParseNumber(tm, f->value, &special))
+            {
+                return MERGE_DOMAIN_SPECIAL;
+            }
+        }
+        else if (SpanEquals(tm, f->key, "moreids"))
+        {
+            return MERGE_DOMAIN_SPECIAL;
+        }
+    }
+
+    if (id >= MERGE_RANGE_START && id <= MERGE_RANGE_END &&
+        id == (uint32_t) id)
+    {
+        return (uint32_t) id + 2 - MERGE_RANGE_START;
+    }
+    if (special != 0 || (id != -1 && id != 0))
+    {
+        return MERGE_DOMAIN_SPECIAL;
+    }
+    return 1;
+}
+
+static bool AnalyzeLinedef(textmap_t *tm, uint32_t block_index)
+{
+    udmf_linedef_t *ld = &tm->linedefs[tm->num_linedefs];
+    const block_t *b = &tm->blocks[block_index];
+    uint32_t i;
+
+    ld->block = block_index;
+    ld->sides[0] = NO_SIDEDEF;
+    ld->sides[1] = NO_SIDEDEF;
+    ld->new_sides[0] = NO_SIDEDEF;
+    ld->new_sides[1] = NO_SIDEDEF;
+    ld->merge_domain = LinedefMergeDomain(tm, b);
+
+    for (i = b->first_field; i < b->first_field + b->num_fields; i++)
+    {
+        const field_t *f = &tm->fields[i];
+
+        if ((SpanEquals(tm, f->key, "sidefront") &&
+             !ParseSidedefRef(tm, f->value, &ld->sides[0])) ||
+            (SpanEquals(tm, f->key, "sideback") &&
+             !ParseSidedefRef(tm, f->value, &ld->sides[1])))
+        {
+            Warning("Invalid sidedef reference for linedef %u",
+                    tm->num_linedefs);
+            return false;
+        }
+    }
+
+    tm->blocks[block_index].index = tm->num_linedefs;
+    ++tm->num_linedefs;
+    return true;
+}
+
+// Builds the lists of linedefs and sidedefs after the lump is parsed.
+static bool AnalyzeTextmap(textmap_t *tm)
+{
+    uint32_t i, j;
+
+    tm->sidedefs = ALLOC_ARRAY(udmf_sidedef_t, tm->num_blocks);
+    tm->linedefs = ALLOC_ARRAY(udmf_linedef_t, tm->num_blocks);
+    tm->canon = ALLOC_ARRAY(uint32_t, tm->num_fields);
+
+    for (i = 0; i < tm->num_blocks; i++)
+    {
+        if (tm->blocks[i].type == BLOCK_SIDEDEF)
+        {
+            AnalyzeSidedef(tm, i);
+        }
+        else if (tm->blocks[i].type == BLOCK_LINEDEF &&
+                 !AnalyzeLinedef(tm, i))
+        {
+            return false;
+        }
+    }
+
+    for (i = 0; i < tm->num_linedefs; i++)
+    {
+        for (j = 0; j < 2; j++)
+        {
+            uint32_t s = tm->linedefs[i].sides[j];
+            if (s != NO_SIDEDEF && s >= tm->num_sidedefs)
+            {
+                Warning("Linedef %u references sidedef %u, but "
+                        "there are only %u sidedefs",
+                        i, s, tm->num_sidedefs);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void FreeTextmap(textmap_t *tm)
+{
+    free(tm->data);
+    free(tm->fields);
+    free(tm->blocks);
+    free(tm->sidedefs);
+    free(tm->linedefs);
+    free(tm->canon);
+}
+
+static bool LoadTextmap(wad_file_t *wf, unsigned int lumpnum, textmap_t *tm)
+{
+    memset(tm, 0, sizeof(textmap_t));
+    tm->data = (char *) CacheLump(wf, lumpnum);
+    tm->len = wf->entries[lumpnum].length;
+
+    if (!ParseTextmap(tm) || !AnalyzeTextmap(tm))
+    {
+        FreeTextmap(tm);
+        return false;
+    }
+
+    return true;
+}
+
+static bool SidedefsEqual(const textmap_t *tm, uint32_t s1, uint32_t s2)
+{
+    const udmf_sidedef_t *sd1 = &tm->sidedefs[s1], *sd2 = &tm->sidedefs[s2];
+    uint32_t i;
+
+    if (sd1->hash != sd2->hash || sd1->num_canon != sd2->num_canon)
+    {
+        return false;
+    }
+
+    for (i = 0; i < sd1->num_canon; i++)
+    {
+        const field_t *f1 = &tm->fields[tm->canon[sd1->first_canon + i]];
+        const field_t *f2 = &tm->fields[tm->canon[sd2->first_canon + i]];
+
+        if (CompareSpans(tm, f1->key, f2->key, true) != 0 ||
+            CompareSpans(tm, f1->value, f2->value, false) != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Assigns new sidedef numbers to the sides of every linedef. If merge is
+// true, identical sidedefs in the same merge domain are shared; otherwise
+// every side gets its own sidedef. Sidedefs that are not referenced by any
+// linedef are dropped. Returns an array mapping from new sidedef number to
+// the original sidedef.
+static uint32_t *PackSidedefs(textmap_t *tm, bool merge, uint32_t *num_result)
+{
+    uint32_t *result, *table = NULL, mask = 0;
+    uint8_t *domains;
+    uint32_t i, j, num = 0;
+
+    result = ALLOC_ARRAY(uint32_t, tm->num_linedefs * 2);
+    domains = ALLOC_ARRAY(uint8_t, tm->num_linedefs * 2);
+
+    if (merge)
+    {
+        for (mask = 255; mask < tm->num_linedefs * 4; mask = mask * 2 + 1)
+        {
+        }
+        table = ALLOC_ARRAY(uint32_t, mask + 1);
+        for (i = 0; i <= mask; i++)
+        {
+            table[i] = NO_SIDEDEF;
+        }
+    }
+
+    for (i = 0; i < tm->num_linedefs; i++)
+    {
+        udmf_linedef_t *ld = &tm->linedefs[i];
+        uint8_t domain = ld->merge_domain;
+
+        for (j = 0; j < 2; j++)
+        {
+            uint32_t s = ld->sides[j], slot = 0, n = NO_SIDEDEF;
+
+            if (s == NO_SIDEDEF)
+            {
+                continue;
+            }
+
+            // Sidedefs in MERGE_DOMAIN_SPECIAL are never merged.
+            if (merge && domain != MERGE_DOMAIN_SPECIAL)
+            {
+                slot = (tm->sidedefs[s].hash ^ (domain * 0x9e3779b9)) & mask;
+                while ((n = table[slot]) != NO_SIDEDEF)
+                {
+                    if (domains[n] == domain && SidedefsEqual(tm, result[n], s))
+                    {
+                        break;
+                    }
+                    slot = (slot + 1) & mask;
+                }
+            }
+
+            if (n == NO_SIDEDEF)
+            {
+                n = num;
+                ++num;
+                result[n] = s;
+                domains[n] = domain;
+                if (merge && domain != MERGE_DOMAIN_SPECIAL)
+                {
+                    table[slot] = n;
+                }
+            }
+
+            ld->new_sides[j] = n;
+        }
+    }
+
+    free(table);
+    free(domains);
+
+    *num_result = num;
+    return result;
+}
+
+static void AppendData(buffer_t *buf, const void *data, size_t len)
+{
+    if (buf->len + len > buf->size)
+    {
+        buf->size = (buf->len + len) * 2;
+        buf->data = REALLOC_ARRAY(uint8_t, buf->data, buf->size);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void AppendString(buffer_t *buf, const char *s)
+{
+    AppendData(buf, s, strlen(s));
+}
+
+static void AppendSpan(buffer_t *buf, const textmap_t *tm, span_t s)
+{
+    AppendData(buf, tm->data + s.start, s.len);
+}
+
+// Writes a block. In pretty mode every field gets its own line; otherwise
+// all whitespace is left out. Fields set to default values are omitted.
+static void WriteBlock(const textmap_t *tm, const block_t *b, bool pretty,
+                       buffer_t *buf)
+{
+    const udmf_linedef_t *ld = NULL;
+    char num[16];
+    uint32_t i;
+
+    if (b->type == BLOCK_ASSIGNMENT)
+    {
+        const field_t *f = &tm->fields[b->first_field];
+        AppendSpan(buf, tm, f->key);
+        AppendString(buf, pretty ? " = " : "=");
+        AppendSpan(buf, tm, f->value);
+        AppendString(buf, ";\n");
+        return;
+    }
+    if (b->type == BLOCK_LINEDEF)
+    {
+        ld = &tm->linedefs[b->index];
+    }
+
+    AppendString(buf, pretty ? "\n" : "");
+    AppendSpan(buf, tm, b->name);
+    AppendString(buf, pretty ? "\n{\n" : "{");
+
+    for (i = b->first_field; i < b->first_field + b->num_fields; i++)
+    {
+        const field_t *f = &tm->fields[i];
+        span_t value = f->value;
+        int side = -1;
+
+        if (IsDefaultField(tm, b->type, f))
+        {
+            continue;
+        }
+
+        AppendSpan(buf, tm, f->key);
+        AppendString(buf, pretty ? " = " : "=");
+
+        if (ld != NULL && SpanEquals(tm, f->key, "sidefront"))
+        {
+            side = 0;
+        }
+        else if (ld != NULL && SpanEquals(tm, f->key, "sideback"))
+        {
+            side = 1;
+        }
+
+        if (side >= 0 && ld->new_sides[side] != NO_SIDEDEF)
+        {
+            snprintf(num, sizeof(num), "%u", ld->new_sides[side]);
+            AppendString(buf, num);
+        }
+        else
+        {
+            AppendSpan(buf, tm, value);
+        }
+
+        AppendString(buf, pretty ? ";\n" : ";");
+    }
+
+    AppendString(buf, "}\n");
+}
+
+// Writes out a new TEXTMAP lump, with the given sidedefs in place of the
+// original ones. The new sidedefs are written where the first sidedef
+// originally appeared.
+static void WriteTextmap(const textmap_t *tm, const uint32_t *sidedef_map,
+                         uint32_t num_sidedefs, bool pretty, lump_t *result)
+{
+    buffer_t buf = {NULL, 0, 0};
+    bool sidedefs_written = false;
+    uint32_t i, j;
+
+    for (i = 0; i < tm->num_blocks; i++)
+    {
+        if (tm->blocks[i].type != BLOCK_SIDEDEF)
+        {
+            WriteBlock(tm, &tm->blocks[i], pretty, &buf);
+        }
+        else if (!sidedefs_written)
+        {
+            for (j = 0; j < num_sidedefs; j++)
+            {
+                const udmf_sidedef_t *sd = &tm->sidedefs[sidedef_map[j]];
+                WriteBlock(tm, &tm->blocks[sd->block], pretty, &buf);
+            }
+            sidedefs_written = true;
+        }
+    }
+
+    result->data = buf.data;
+    result->len = buf.len;
+}
+
+static bool RebuildTextmap(wad_file_t *wf, unsigned int lumpnum, bool pack,
+                           lump_t *result)
+{
+    textmap_t tm;
+    uint32_t *sidedef_map, num_sidedefs;
+
+    if (!LoadTextmap(wf, lumpnum, &tm))
+    {
+        result->data = CacheLump(wf, lumpnum);
+        result->len = wf->entries[lumpnum].length;
+        return false;
+    }
+
+    sidedef_map = PackSidedefs(&tm, pack, &num_sidedefs);
+    WriteTextmap(&tm, sidedef_map, num_sidedefs, !pack, result);
+
+    free(sidedef_map);
+    FreeTextmap(&tm);
+
+    return true;
+}
+
+bool U_IsTextmap(wad_file_t *wf, unsigned int lumpnum)
+{
+    return !strncmp(wf->entries[lumpnum].name, "TEXTMAP", 8);
+}
+
+// Packs the sidedefs in the given TEXTMAP lump and minifies it. If the
+// lump cannot be parsed, the result is a copy of the original lump.
+bool U_Pack(wad_file_t *wf, unsigned int lumpnum, lump_t *result)
+{
+    return RebuildTextmap(wf, lumpnum, true, result);
+}
+
+// Gives every linedef side in the given TEXTMAP lump its own sidedef, and
+// writes it out in a readable format.
+bool U_Unpack(wad_file_t *wf, unsigned int lumpnum, lump_t *result)
+{
+    return RebuildTextmap(wf, lumpnum, false, result);
+}
+
+// Returns true if any sidedef in the TEXTMAP lump is shared by more than
+// one linedef side.
+bool U_IsPacked(wad_file_t *wf, unsigned int lumpnum)
+{
+    textmap_t tm;
+    uint8_t *refs;
+    bool result = false;
+    uint32_t i, j;
+
+    if (!LoadTextmap(wf, lumpnum, &tm))
+    {
+        return false;
+    }
+
+    refs = ALLOC_ARRAY(uint8_t, tm.num_sidedefs);
+    memset(refs, 0, tm.num_sidedefs);
+
+    for (i = 0; i < tm.num_linedefs && !result; i++)
+    {
+        for (j = 0; j < 2; j++)
+        {
+            uint32_t s = tm.linedefs[i].sides[j];
+            if (s != NO_SIDEDEF)
+            {
+                result = result || refs[s];
+                refs[s] = 1;
+            }
+        }
+    }
+
+    free(refs);
+    FreeTextmap(&tm);
+
+    return result;
+}
+
+static void HashLength(sha1_context_t *ctx, uint32_t len)
+{
+    uint8_t buf[4];
+
+    buf[0] = len & 0xff;
+    buf[1] = (len >> 8) & 0xff;
+    buf[2] = (len >> 16) & 0xff;
+    buf[3] = (len >> 24) & 0xff;
+    SHA1_Update(ctx, buf, 4);
+}
+
+static void HashFolded(sha1_context_t *ctx, const textmap_t *tm, span_t s)
+{
+    uint8_t buf[64];
+    uint32_t i, n;
+
+    for (i = 0; i < s.len; i += n)
+    {
+        for (n = 0; n < sizeof(buf) && i + n < s.len; n++)
+        {
+            buf[n] = tolower((unsigned char) tm->data[s.start + i + n]);
+        }
+        SHA1_Update(ctx, buf, n);
+    }
+    HashLength(ctx, s.len);
+}
+
+static void HashFields(sha1_context_t *ctx, const textmap_t *tm,
+                       const uint32_t *fields, uint32_t num_fields,
+                       bool hide_sides)
+{
+    uint32_t i;
+
+    HashLength(ctx, num_fields);
+
+    for (i = 0; i < num_fields; i++)
+    {
+        const field_t *f = &tm->fields[fields[i]];
+
+        HashFolded(ctx, tm, f->key);
+
+        // Sidedef numbers change when sidedefs are packed; sidedefs are
+        // hashed separately in the order they are referenced.
+        if (hide_sides && (SpanEquals(tm, f->key, "sidefront") ||
+                           SpanEquals(tm, f->key, "sideback")))
+        {
+            continue;
+        }
+        SHA1_Update(ctx, (uint8_t *) tm->data + f->value.start,
+                    f->value.len);
+        HashLength(ctx, f->value.len);
+    }
+}
+
+// Calculates a hash of the given TEXTMAP lump that is the same whether or
+// not its sidedefs are packed and regardless of formatting.
+bool U_HashTextmap(wad_file_t *wf, unsigned int lumpnum, sha1_digest_t hash)
+{
+    sha1_context_t ctx;
+    textmap_t tm;
+    uint32_t *fields;
+    uint32_t i, j, num_fields;
+
+    if (!LoadTextmap(wf, lumpnum, &tm))
+    {
+        return false;
+    }
+
+    SHA1_Init(&ctx);
+    fields = ALLOC_ARRAY(uint32_t, tm.num_fields);
+
+    for (i = 0; i < tm.num_blocks; i++)
+    {
+        const block_t *b = &tm.blocks[i];
+
+        if (b->type == BLOCK_SIDEDEF)
+        {
+            continue;
+        }
+
+        HashFolded(&ctx, &tm, b->name);
+        num_fields = SortFields(&tm, b, fields);
+        HashFields(&ctx, &tm, fields, num_fields, b->type == BLOCK_LINEDEF);
+    }
+
+    for (i = 0; i < tm.num_linedefs; i++)
+    {
+        for (j = 0; j < 2; j++)
+        {
+            uint32_t s = tm.linedefs[i].sides[j];
+            if (s != NO_SIDEDEF)
+            {
+                const udmf_sidedef_t *sd = &tm.sidedefs[s];
+                HashFields(&ctx, &tm, &tm.canon[sd->first_canon],
+                           sd->num_canon, false);
+            }
+        }
+    }
+
+    SHA1_Final(hash, &ctx);
+
+    free(fields);
+    FreeTextmap(&tm);
+
+    return true;
+}
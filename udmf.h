@@ -0,0 +1,30 @@
+/*
+ * Copyright(C) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *
+ * Compression of UDMF (Universal Doom Map Format) levels. Identical
+ * sidedefs in the TEXTMAP lump are combined in the same way as for
+ * binary format levels, and the text itself is minified.
+ */
+
+#ifndef __UDMF_H_INCLUDED__
+#define __UDMF_H_INCLUDED__
+
+#include <stdbool.h>
+
+#include "sha1.h"
+#include "waddir.h"
+
+bool U_IsTextmap(wad_file_t *wf, unsigned int lumpnum);
+bool U_Pack(wad_file_t *wf, unsigned int lumpnum, lump_t *result);
+bool U_Unpack(wad_file_t *wf, unsigned int lumpnum, lump_t *result);
+bool U_IsPacked(wad_file_t *wf, unsigned int lumpnum);
+bool U_HashTextmap(wad_file_t *wf, unsigned int lumpnum, sha1_digest_t hash);
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ * Copyright(C) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *
+ * Rebuilding of the VERTEXES lump. Vertices that are not used by any
+ * linedef or seg, or that duplicate other vertices, are removed, and the
+ * SEGS lump is renumbered to match.
+ */
+
+#include "vertices.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "waddir.h"
+#include "wadptr.h"
+
+#define VERTEX_SIZE 4
+
+#define SEG_VERT1 0
+#define SEG_VERT2 2
+#define SEG_SIZE  12
+
+#define NODE_SIZE 28
+
+// Signatures of the nonstandard node formats, which are stored in the
+// NODES lump (or in ZNODES). The ZDoom extended formats have vertex
+// lists of their own, and DeePBSP's format has 16-byte segs with 32-bit
+// vertex numbers.
+static const struct
+{
+    const char *signature;
+    size_t len;
+} nonstandard_node_formats[] = {
+    {"XNOD", 4}, {"ZNOD", 4}, {"XGLN", 4}, {"ZGLN", 4},
+    {"XGL2", 4}, {"ZGL2", 4}, {"XGL3", 4}, {"ZGL3", 4},
+    {"xNd4\0\0\0\0", 8},
+};
+
+// Only the standard node format is understood. GL nodes are stored in
+// separate lumps that refer to vertices by number, and other formats
+// lay out SEGS differently, so levels using any of them are skipped.
+// A NODES lump that is not a whole number of standard nodes means a
+// format we do not recognize, so it is skipped too.
+static bool CheckNodes(wad_file_t *wf, unsigned int vertex_num)
+{
+    unsigned int nodes_num = vertex_num + 3;
+    uint8_t *nodes;
+    unsigned int i;
+    bool result = true;
+
+    if (nodes_num >= wf->num_entries ||
+        strncmp(wf->entries[vertex_num].name, "VERTEXES", 8) != 0 ||
+        strncmp(wf->entries[vertex_num + 1].name, "SEGS", 8) != 0 ||
+        strncmp(wf->entries[nodes_num].name, "NODES", 8) != 0 ||
+        (wf->entries[vertex_num].length % VERTEX_SIZE) != 0 ||
+        (wf->entries[vertex_num + 1].length % SEG_SIZE) != 0 ||
+        (wf->entries[nodes_num].length % NODE_SIZE) != 0 ||
+        EntryExists(wf, "GL_VERT") >= 0)
+    {
+        return false;
+    }
+
+    if (wf->entries[nodes_num].length < 4)
+    {
+        return true;
+    }
+
+    nodes = CacheLump(wf, nodes_num);
+    for (i = 0; i < sizeof(nonstandard_node_formats) /
+                        sizeof(*nonstandard_node_formats); i++)
+    {
+        if (wf->entries[nodes_num].length >=
+                nonstandard_node_formats[i].len &&
+            memcmp(nodes, nonstandard_node_formats[i].signature,
+                   nonstandard_node_formats[i].len) == 0)
+        {
+            result = false;
+            break;
+        }
+    }
+    free(nodes);
+
+    return result;
+}
+
+static uint32_t VertexPosition(const uint8_t *vertexes, uint32_t v)
+{
+    const uint8_t *p = vertexes + v * VERTEX_SIZE;
+    return READ_SHORT(p) | ((uint32_t) READ_SHORT(p + 2) << 16);
+}
+
+static uint32_t HashPosition(uint32_t pos)
+{
+    pos *= 0x9e3779b1;
+    return pos ^ (pos >> 16);
+}
+
+// Node builders add vertices where they split lines, and these are often
+// exact duplicates of existing vertices or of each other. Returns an array
+// mapping each vertex to the first vertex at the same position.
+static uint32_t *FindDuplicates(const uint8_t *vertexes, size_t num_vertices)
+{
+    uint32_t *first, *slots;
+    size_t i, h, mask;
+
+    mask = 1;
+    while (mask < num_vertices * 2)
+    {
+        mask <<= 1;
+    }
+    slots = ALLOC_ARRAY(uint32_t, mask);
+    memset(slots, 0xff, sizeof(uint32_t) * mask);
+    --mask;
+
+    first = ALLOC_ARRAY(uint32_t, num_vertices);
+    for (i = 0; i < num_vertices; i++)
+    {
+        uint32_t pos = VertexPosition(vertexes, i);
+
+        for (h = HashPosition(pos) & mask; slots[h] != NO_VERTEX;
+             h = (h + 1) & mask)
+        {
+            if (VertexPosition(vertexes, slots[h]) == pos)
+            {
+                break;
+            }
+        }
+        if (slots[h] == NO_VERTEX)
+        {
+            slots[h] = i;
+        }
+        first[i] = slots[h];
+    }
+
+    free(slots);
+    return first;
+}
+
+static bool MarkVertex(uint8_t *used, const uint32_t *first,
+                       size_t num_vertices, uint32_t v)
+{
+    if (v >= num_vertices)
+    {
+        return false;
+    }
+    v = first[v];
+    used[v / 8] |= 1 << (v % 8);
+    return true;
+}
+
+static bool VertexUsed(const uint8_t *used, uint32_t v)
+{
+    return (used[v / 8] & (1 << (v % 8))) != 0;
+}
+
+// Builds a bitmap of the vertices used by the linedefs and segs, where
+// duplicate vertices count as uses of the first vertex at that position.
+// Returns NULL if any of them refer to a vertex that does not exist.
+static uint8_t *FindUsedVertices(const uint16_t *line_vertices,
+                                 size_t num_lines, const uint8_t *segs,
+                                 size_t num_segs, const uint32_t *first,
+                                 size_t num_vertices)
+{
+    uint8_t *used;
+    size_t i;
+
+    used = ALLOC_ARRAY(uint8_t, (num_vertices + 7) / 8);
+    memset(used, 0, (num_vertices + 7) / 8);
+
+    for (i = 0; i < num_lines * 2; i++)
+    {
+        if (!MarkVertex(used, first, num_vertices, line_vertices[i]))
+        {
+            free(used);
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < num_segs; i++)
+    {
+        const uint8_t *seg = segs + i * SEG_SIZE;
+        if (!MarkVertex(used, first, num_vertices,
+                        READ_SHORT(seg + SEG_VERT1)) ||
+            !MarkVertex(used, first, num_vertices,
+                        READ_SHORT(seg + SEG_VERT2)))
+        {
+            free(used);
+            return NULL;
+        }
+    }
+
+    return used;
+}
+
+// Rebuilds the VERTEXES lump at the given index, which must be followed by
+// its SEGS lump, dropping the vertices that are not used by any linedef or
+// seg. If merge_duplicates is true, vertices at the same position are also
+// combined into one. The vertices of the linedefs are given as pairs in
+// line_vertices. If anything changed, returns true along with the new
+// VERTEXES and SEGS lumps and a map from old to new vertex numbers for the
+// caller to update the linedefs; all of these must be freed by the caller.
+bool V_RebuildVertices(wad_file_t *wf, unsigned int vertex_num,
+                       const uint16_t *line_vertices, size_t num_lines,
+                       bool merge_duplicates, uint32_t **vertex_map,
+                       lump_t *vertexes_lump, lump_t *segs_lump)
+{
+    uint8_t *vertexes, *segs, *used;
+    uint32_t *first, *map;
+    size_t i, num_vertices, num_segs, new_num_vertices = 0;
+
+    if (!CheckNodes(wf, vertex_num))
+    {
+        return false;
+    }
+
+    num_vertices = wf->entries[vertex_num].length / VERTEX_SIZE;
+    num_segs = wf->entries[vertex_num + 1].length / SEG_SIZE;
+    vertexes = CacheLump(wf, vertex_num);
+    segs = CacheLump(wf, vertex_num + 1);
+
+    if (merge_duplicates)
+    {
+        first = FindDuplicates(vertexes, num_vertices);
+    }
+    else
+    {
+        first = ALLOC_ARRAY(uint32_t, num_vertices);
+        for (i = 0; i < num_vertices; i++)
+        {
+            first[i] = i;
+        }
+    }
+
+    used = FindUsedVertices(line_vertices, num_lines, segs, num_segs, first,
+                            num_vertices);
+    if (used == NULL)
+    {
+        free(first);
+        free(vertexes);
+        free(segs);
+        return false;
+    }
+
+    // Vertices are numbered in their original order; duplicates get the
+    // number of the first vertex at their position, which always precedes
+    // them.
+    map = ALLOC_ARRAY(uint32_t, num_vertices);
+    for (i = 0; i < num_vertices; i++)
+    {
+        if (first[i] != i)
+        {
+            map[i] = map[first[i]];
+        }
+        else if (VertexUsed(used, i))
+        {
+            map[i] = new_num_vertices++;
+        }
+        else
+        {
+            map[i] = NO_VERTEX;
+        }
+    }
+    free(used);
+    free(first);
+
+    if (new_num_vertices == num_vertices || new_num_vertices == 0)
+    {
+        free(map);
+        free(vertexes);
+        free(segs);
+        return false;
+    }
+
+    vertexes_lump->len = new_num_vertices * VERTEX_SIZE;
+    vertexes_lump->data = ALLOC_ARRAY(uint8_t, vertexes_lump->len);
+    for (i = 0; i < num_vertices; i++)
+    {
+        if (map[i] != NO_VERTEX)
+        {
+            memcpy(vertexes_lump->data + map[i] * VERTEX_SIZE,
+                   vertexes + i * VERTEX_SIZE, VERTEX_SIZE);
+        }
+    }
+    free(vertexes);
+
+    for (i = 0; i < num_segs; i++)
+    {
+        uint8_t *seg = segs + i * SEG_SIZE;
+        uint32_t v1 = map[READ_SHORT(seg + SEG_VERT1)];
+        uint32_t v2 = map[READ_SHORT(seg + SEG_VERT2)];
+        WRITE_SHORT(seg + SEG_VERT1, v1);
+        WRITE_SHORT(seg + SEG_VERT2, v2);
+    }
+    if (num_segs > 0)
+    {
+        segs_lump->data = segs;
+        segs_lump->len = num_segs * SEG_SIZE;
+    }
+    else
+    {
+        free(segs);
+    }
+
+    *vertex_map = map;
+    return true;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright(C) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *
+ * Rebuilding of the VERTEXES lump. Vertices that are not used by any
+ * linedef or seg, or that duplicate other vertices, are removed, and the
+ * SEGS lump is renumbered to match.
+ */
+
+#ifndef __VERTICES_H_INCLUDED__
+#define __VERTICES_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "waddir.h"
+
+#define NO_VERTEX UINT32_MAX
+
+bool V_RebuildVertices(wad_file_t *wf, unsigned int vertex_num,
+                       const uint16_t *line_vertices, size_t num_lines,
+                       bool merge_duplicates, uint32_t **vertex_map,
+                       lump_t *vertexes_lump, lump_t *segs_lump);
+
+#endif
@@ -0,0 +1,413 @@
+/*
+ * Copyright(C) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *
+ * Compares the lumps in two WAD files, ignoring differences that are
+ * only the result of compression.
+ */
+
+#include "waddiff.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blockmap.h"
+#include "errors.h"
+#include "graphics.h"
+#include "reject.h"
+#include "sha1.h"
+#include "sidedefs.h"
+#include "sort.h"
+#include "udmf.h"
+#include "waddir.h"
+#include "wadptr.h"
+
+#define NO_MATCH UINT32_MAX
+
+typedef struct {
+    // Lumps are identified by name, but the same name can appear many
+    // times in a WAD. Level lumps are qualified by the name of the level
+    // they belong to, and any remaining duplicates are numbered in order.
+    char level[8];
+    char name[8];
+    unsigned int occurrence;
+
+    sha1_digest_t hash;
+    uint32_t match;
+} diff_entry_t;
+
+typedef struct {
+    diff_entry_t *entries;
+    unsigned int num_entries;
+} diff_list_t;
+
+static void HashData(uint8_t *data, size_t data_len, sha1_digest_t hash)
+{
+    sha1_context_t ctx;
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, data, data_len);
+    SHA1_Final(hash, &ctx);
+}
+
+static void HashRawLump(wad_file_t *wf, unsigned int lumpnum,
+                        sha1_digest_t hash)
+{
+    uint8_t *cached = CacheLump(wf, lumpnum);
+    HashData(cached, wf->entries[lumpnum].length, hash);
+    free(cached);
+}
+
+// Calculates a hash of a lump that wadptr knows how to compress, which is
+// the same whether or not the lump is compressed. Returns false if this is
+// not such a lump.
+static bool HashCompressedLump(wad_file_t *wf, unsigned int lumpnum,
+                               lump_type_t type, squash_context_t *squash_ctx,
+                               sha1_digest_t hash)
+{
+    graphic_header_t header;
+
+    if (type == LUMP_GRAPHIC)
+    {
+        return S_IsGraphic(wf, lumpnum, &header) &&
+               S_HashGraphic(squash_ctx, wf, lumpnum, &header, hash);
+    }
+    if (type != LUMP_LEVEL)
+    {
+        return false;
+    }
+    if (!strncmp(wf->entries[lumpnum].name, "BLOCKMAP", 8))
+    {
+        return B_HashBlockmap(wf, lumpnum, hash);
+    }
+    if (!strncmp(wf->entries[lumpnum].name, "REJECT", 8))
+    {
+        return R_HashReject(wf, lumpnum, hash);
+    }
+    if (U_IsTextmap(wf, lumpnum))
+    {
+        return U_HashTextmap(wf, lumpnum, hash);
+    }
+    return false;
+}
+
+// Hashes every lump in the given WAD. Lumps that wadptr knows how to
+// compress are hashed in a form that does not depend on whether they are
+// compressed, so that a compressed and a decompressed copy of the same
+// WAD compare as equivalent.
+static void HashEntries(wad_file_t *wf, diff_list_t *list)
+{
+    sha1_digest_t sidedefs_hash;
+    bool have_sidedefs_hash = false;
+    const char *level = NULL;
+    squash_context_t squash_ctx;
+    lump_type_t *types;
+    unsigned int i;
+
+    list->num_entries = wf->num_entries;
+    list->entries = ALLOC_ARRAY(diff_entry_t, wf->num_entries);
+    types = ClassifyLumps(wf);
+    S_InitContext(&squash_ctx);
+
+    for (i = 0; i < wf->num_entries; i++)
+    {
+        diff_entry_t *d = &list->entries[i];
+        char *name = wf->entries[i].name;
+
+        SetContextLump(name);
+
+        // The level name is the marker lump preceding the level lumps.
+        if (!IsLevelEntry(name))
+        {
+            level = NULL;
+        }
+        else if (level == NULL && i > 0)
+        {
+            level = wf->entries[i - 1].name;
+        }
+
+        memset(d, 0, sizeof(diff_entry_t));
+        memcpy(d->name, name, 8);
+        if (level != NULL)
+        {
+            memcpy(d->level, level, 8);
+        }
+        d->match = NO_MATCH;
+
+        // An empty REJECT lump stands for a table with no bits set.
+        if (wf->entries[i].length == 0 && strncmp(name, "REJECT", 8) != 0)
+        {
+            HashData(NULL, 0, d->hash);
+        }
+        else if (have_sidedefs_hash && IsSidedefs(wf, i))
+        {
+            memcpy(d->hash, sidedefs_hash, sizeof(sha1_digest_t));
+        }
+        else if (i + 1 < wf->num_entries && IsSidedefs(wf, i + 1) &&
+                 P_HashLevel(wf, i + 1, d->hash, sidedefs_hash))
+        {
+            // The SIDEDEFS hash was calculated at the same time, and
+            // gets used on the next iteration.
+            have_sidedefs_hash = true;
+            continue;
+        }
+        else if (!HashCompressedLump(wf, i, types[i], &squash_ctx, d->hash))
+        {
+            HashRawLump(wf, i, d->hash);
+        }
+
+        have_sidedefs_hash = false;
+    }
+
+    S_FreeContext(&squash_ctx);
+    free(types);
+    SetContextLump(NULL);
+}
+
+static int CompareEntries(const diff_entry_t *d1, const diff_entry_t *d2)
+{
+    int result = strncmp(d1->level, d2->level, 8);
+    if (result == 0)
+    {
+        result = strncmp(d1->name, d2->name, 8);
+    }
+    if (result == 0)
+    {
+        result = (int) d1->occurrence - (int) d2->occurrence;
+    }
+    return result;
+}
+
+static int CompareFunc(unsigned int index1, unsigned int index2,
+                       const void *callback_data)
+{
+    const diff_list_t *list = callback_data;
+    return CompareEntries(&list->entries[index1], &list->entries[index2]);
+}
+
+// Returns a map of the list's entries sorted by name. As a side effect,
+// entries with duplicate names are numbered in directory order.
+static unsigned int *SortEntries(diff_list_t *list)
+{
+    unsigned int *sorted_map;
+    unsigned int i;
+
+    // Ties are broken by index, so duplicates are sorted in directory
+    // order and can be numbered as we go.
+    sorted_map = MakeSortedMap(list->num_entries, CompareFunc, list);
+
+    for (i = 1; i < list->num_entries; i++)
+    {
+        diff_entry_t *prev = &list->entries[sorted_map[i - 1]];
+        diff_entry_t *d = &list->entries[sorted_map[i]];
+
+        if (CompareEntries(prev, d) == 0)
+        {
+            d->occurrence = prev->occurrence + 1;
+        }
+    }
+
+    return sorted_map;
+}
+
+// Pairs up entries in the two lists that have the same name.
+static void MatchEntries(diff_list_t *list1, diff_list_t *list2)
+{
+    unsigned int *map1 = SortEntries(list1), *map2 = SortEntries(list2);
+    unsigned int i1 = 0, i2 = 0;
+
+    while (i1 < list1->num_entries && i2 < list2->num_entries)
+    {
+        diff_entry_t *d1 = &list1->entries[map1[i1]];
+        diff_entry_t *d2 = &list2->entries[map2[i2]];
+        int cmp = CompareEntries(d1, d2);
+
+        if (cmp == 0)
+        {
+            d1->match = map2[i2];
+            d2->match = map1[i1];
+        }
+        if (cmp <= 0)
+        {
+            ++i1;
+        }
+        if (cmp >= 0)
+        {
+            ++i2;
+        }
+    }
+
+    free(map1);
+    free(map2);
+}
+
+// A lump has moved if it appears in a different position relative to the
+// other lumps that appear in both WADs. We find the longest subsequence
+// of matched lumps that appear in the same order in both WADs; any lumps
+// outside of that subsequence have moved. Returns an array of flags
+// indexed by entry number in the first list.
+static bool *FindMovedEntries(const diff_list_t *list1)
+{
+    unsigned int n = list1->num_entries;
+    unsigned int *tails, *prev;
+    unsigned int i, num_tails = 0;
+    bool *moved;
+
+    // tails[k] is the index of the entry that ends the increasing
+    // subsequence of length k+1 with the smallest possible final value.
+    tails = ALLOC_ARRAY(unsigned int, n);
+    prev = ALLOC_ARRAY(unsigned int, n);
+    moved = ALLOC_ARRAY(bool, n);
+
+    for (i = 0; i < n; i++)
+    {
+        uint32_t match = list1->entries[i].match;
+        unsigned int lo = 0, hi = num_tails;
+
+        moved[i] = match != NO_MATCH;
+        if (match == NO_MATCH)
+        {
+            continue;
+        }
+
+        while (lo < hi)
+        {
+            unsigned int mid = (lo + hi) / 2;
+            if (list1->entries[tails[mid]].match < match)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+
+        prev[i] = lo > 0 ? tails[lo - 1] : NO_MATCH;
+        tails[lo] = i;
+        if (lo == num_tails)
+        {
+            ++num_tails;
+        }
+    }
+
+    if (num_tails > 0)
+    {
+        for (i = tails[num_tails - 1]; i != NO_MATCH; i = prev[i])
+        {
+            moved[i] = false;
+        }
+    }
+
+    free(tails);
+    free(prev);
+    return moved;
+}
+
+static const char *EntryName(const diff_entry_t *d)
+{
+    static char buf[32];
+    size_t len;
+
+    if (d->level[0] != '\0')
+    {
+        snprintf(buf, sizeof(buf), "%.8s/%.8s", d->level, d->name);
+    }
+    else
+    {
+        snprintf(buf, sizeof(buf), "%.8s", d->name);
+    }
+
+    if (d->occurrence > 0)
+    {
+        len = strlen(buf);
+        snprintf(buf + len, sizeof(buf) - len, " (#%u)", d->occurrence + 1);
+    }
+
+    return buf;
+}
+
+// Compares the two given WAD files and prints a list of the lumps that
+// were added, removed, modified or moved. Returns true if the two WADs
+// are equivalent.
+bool DiffWads(const char *filename1, const char *filename2)
+{
+    wad_file_t wf1, wf2;
+    diff_list_t list1, list2;
+    bool *moved;
+    unsigned int i;
+    bool result = true;
+
+    if (!OpenWadFile(&wf1, filename1))
+    {
+        return false;
+    }
+    if (!OpenWadFile(&wf2, filename2))
+    {
+        CloseWadFile(&wf1);
+        return false;
+    }
+
+    SetContextFilename(filename1);
+    HashEntries(&wf1, &list1);
+    SetContextFilename(filename2);
+    HashEntries(&wf2, &list2);
+    SetContextFilename(NULL);
+
+    CloseWadFile(&wf1);
+    CloseWadFile(&wf2);
+
+    MatchEntries(&list1, &list2);
+    moved = FindMovedEntries(&list1);
+
+    for (i = 0; i < list1.num_entries; i++)
+    {
+        const diff_entry_t *d = &list1.entries[i];
+
+        if (d->match == NO_MATCH)
+        {
+            printf("Removed:  %s\n", EntryName(d));
+        }
+        else if (memcmp(d->hash, list2.entries[d->match].hash,
+                        sizeof(sha1_digest_t)) != 0)
+        {
+            // Lumps that have been modified are only reported as such,
+            // even if they have also moved.
+            printf("Modified: %s\n", EntryName(d));
+        }
+        else if (moved[i])
+        {
+            printf("Moved:    %s\n", EntryName(d));
+        }
+        else
+        {
+            continue;
+        }
+        result = false;
+    }
+
+    for (i = 0; i < list2.num_entries; i++)
+    {
+        const diff_entry_t *d = &list2.entries[i];
+
+        if (d->match == NO_MATCH)
+        {
+            printf("Added:    %s\n", EntryName(d));
+            result = false;
+        }
+    }
+
+    free(moved);
+    free(list1.entries);
+    free(list2.entries);
+
+    return result;
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright(C) 2025 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *
+ * Compares the lumps in two WAD files, ignoring differences that are
+ * only the result of compression.
+ */
+
+#ifndef __WADDIFF_H_INCLUDED__
+#define __WADDIFF_H_INCLUDED__
+
+#include <stdbool.h>
+
+bool DiffWads(const char *filename1, const char *filename2);
+
+#endif
@@ -228,27 +228,36 @@ int EntryExists(wad_file_t *wf, char *entrytofind)
     return -1;
 }
 
-// Load a lump into memory.
-// The name is misleading; nothing is being cached.
-void *CacheLump(wad_file_t *wf, unsigned int entrynum)
+// Reads len bytes of the given lump, starting at offset, into buf. The
+// caller must check that the range is within the lump.
+void ReadLump(wad_file_t *wf, unsigned int entrynum, size_t offset, void *buf,
+              size_t len)
 {
-    uint8_t *working = ALLOC_ARRAY(uint8_t, wf->entries[entrynum].length);
     size_t read;
 
-    if (fseek(wf->fp, wf->entries[entrynum].offset, SEEK_SET) != 0)
+    if (fseek(wf->fp, wf->entries[entrynum].offset + offset, SEEK_SET) != 0)
     {
         perror("fseek");
         ErrorExit("Error during seek to read %.8s lump, offset 0x%08x",
-                  wf->entries[entrynum].name, wf->entries[entrynum].offset);
+                  wf->entries[entrynum].name,
+                  wf->entries[entrynum].offset + (uint32_t) offset);
     }
-    read = fread(working, 1, wf->entries[entrynum].length, wf->fp);
-    if (read < wf->entries[entrynum].length)
+    read = fread(buf, 1, len, wf->fp);
+    if (read < len)
     {
         perror("fread");
         ErrorExit("Error reading %.8s lump: %d of %d bytes read",
-                  wf->entries[entrynum].name, read,
-                  wf->entries[entrynum].length);
+                  wf->entries[entrynum].name, (int) read, (int) len);
     }
+}
+
+// Load a lump into memory.
+// The name is misleading; nothing is being cached.
+void *CacheLump(wad_file_t *wf, unsigned int entrynum)
+{
+    uint8_t *working = ALLOC_ARRAY(uint8_t, wf->entries[entrynum].length);
+
+    ReadLump(wf, entrynum, 0, working, wf->entries[entrynum].length);
 
     return working;
 }
@@ -295,3 +304,138 @@ bool IsLevelEntry(char *s)
     }
     return false;
 }
+
+// LINEDEFS and SIDEDEFS lumps follow each other in Doom WADs. This is
+// baked into the engine - Doom doesn't actually even look at the names.
+bool IsSidedefs(wad_file_t *wf, unsigned int lumpnum)
+{
+    return !strncmp(wf->entries[lumpnum].name, "SIDEDEFS", 8) && lumpnum > 0 &&
+           !strncmp(wf->entries[lumpnum - 1].name, "LINEDEFS", 8);
+}
+
+// Namespaces are marked by a pair of lumps, eg. S_START and S_END, and give
+// the type of all the lumps between them.
+static const struct {
+    const char *start, *end;
+    lump_type_t type;
+} namespaces[] = {
+    {"S_START", "S_END", LUMP_GRAPHIC},   // Sprites
+    {"SS_START", "SS_END", LUMP_GRAPHIC}, // Sprites (DeuTex)
+    {"P_START", "P_END", LUMP_GRAPHIC},   // Patches
+    {"PP_START", "PP_END", LUMP_GRAPHIC}, // Patches (DeuTex)
+    {"TX_START", "TX_END", LUMP_GRAPHIC}, // ZDoom textures
+    {"HI_START", "HI_END", LUMP_GRAPHIC}, // ZDoom hi-res textures
+    {"F_START", "F_END", LUMP_FLAT},      // Flats
+    {"FF_START", "FF_END", LUMP_FLAT},    // Flats (DeuTex)
+    {"C_START", "C_END", LUMP_OTHER},     // Boom colormaps
+    {"A_START", "A_END", LUMP_OTHER},     // ZDoom ACS libraries
+    {"VX_START", "VX_END", LUMP_OTHER},   // ZDoom voxels
+    {"DS_START", "DS_END", LUMP_SOUND},   // Eternity sounds
+};
+
+// Lumps found outside of any namespace that are known not to be graphics.
+static const char *other_lump_names[] = {
+    "PLAYPAL",  "COLORMAP", "ENDOOM",   "ENDTEXT",  "ENDSTRF",
+    "GENMIDI",  "DMXGUS",   "DMXGUSC",  "TEXTURE1", "TEXTURE2",
+    "PNAMES",   "DEMO1",    "DEMO2",    "DEMO3",    "DEMO4",
+};
+
+// The patch and flat namespaces can contain numbered sub-namespaces, eg.
+// P1_START ... P1_END, whose markers do not change the namespace.
+static bool IsSubNamespaceMarker(const char *s)
+{
+    return (s[0] == 'P' || s[0] == 'F') && s[1] >= '1' && s[1] <= '3' &&
+           (!strncmp(s + 2, "_START", 6) || !strncmp(s + 2, "_END", 6));
+}
+
+// Lumps outside of any namespace are classified by name. Anything that
+// is not known to be something else could be a graphic.
+static lump_type_t ClassifyByName(wad_file_t *wf, unsigned int lumpnum)
+{
+    const char *s = wf->entries[lumpnum].name;
+    unsigned int i;
+
+    if (IsLevelEntry(wf->entries[lumpnum].name) ||
+        (lumpnum + 1 < wf->num_entries &&
+         (!strncmp(wf->entries[lumpnum + 1].name, "THINGS", 8) ||
+          !strncmp(wf->entries[lumpnum + 1].name, "TEXTMAP", 8))))
+    {
+        return LUMP_LEVEL;
+    }
+    if (!strncmp(s, "DS", 2) || !strncmp(s, "DP", 2))
+    {
+        return LUMP_SOUND;
+    }
+    if (!strncmp(s, "D_", 2))
+    {
+        return LUMP_MUSIC;
+    }
+    for (i = 0; i < sizeof(other_lump_names) / sizeof(*other_lump_names); i++)
+    {
+        if (!strncmp(s, other_lump_names[i], 8))
+        {
+            return LUMP_OTHER;
+        }
+    }
+
+    if (wf->entries[lumpnum].length == 4096 || // flat
+        wf->entries[lumpnum].length == 4000)   // endoom
+    {
+        // It could be a graphic, but better safe than sorry
+        return LUMP_OTHER;
+    }
+
+    return LUMP_GRAPHIC;
+}
+
+// Works out the type of every lump in the WAD in a single pass over the
+// directory, using the namespace markers, level structure and lump names.
+// Returns an array with an entry for each lump, which must be freed by the
+// caller.
+lump_type_t *ClassifyLumps(wad_file_t *wf)
+{
+    lump_type_t *types;
+    int ns = -1;
+    unsigned int i, j;
+
+    types = ALLOC_ARRAY(lump_type_t, wf->num_entries);
+
+    for (i = 0; i < wf->num_entries; i++)
+    {
+        const char *s = wf->entries[i].name;
+        bool marker = IsSubNamespaceMarker(s);
+
+        for (j = 0; !marker && j < sizeof(namespaces) / sizeof(*namespaces);
+             j++)
+        {
+            if (!strncmp(s, namespaces[j].start, 8))
+            {
+                ns = j;
+                marker = true;
+            }
+            else if (!strncmp(s, namespaces[j].end, 8))
+            {
+                // Any end marker ends the namespace, since DeuTex-style
+                // markers are often mixed with the others, eg.
+                // SS_START ... S_END.
+                ns = -1;
+                marker = true;
+            }
+        }
+
+        if (marker)
+        {
+            types[i] = LUMP_OTHER;
+        }
+        else if (ns >= 0)
+        {
+            types[i] = namespaces[ns].type;
+        }
+        else
+        {
+            types[i] = ClassifyByName(wf, i);
+        }
+    }
+
+    return types;
+}
@@ -29,6 +29,24 @@ typedef enum {
     WAD_FILE_PWAD,
 } wad_file_type_t;
 
+// Contents of a lump that has been generated in memory, to be written out
+// to a new WAD file.
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} lump_t;
+
+// What kind of data a lump holds, as decided by ClassifyLumps() from its
+// name and where it is in the directory.
+typedef enum {
+    LUMP_OTHER,   // Anything that is not compressed
+    LUMP_LEVEL,   // Level marker or one of the lumps that make up a level
+    LUMP_GRAPHIC, // Possibly a picture in the patch format
+    LUMP_FLAT,    // Floor or ceiling texture
+    LUMP_SOUND,   // Sound effect
+    LUMP_MUSIC,   // Music track
+} lump_type_t;
+
 typedef struct {
     FILE *fp;
     wad_file_type_t type;
@@ -54,6 +72,8 @@ bool OpenWadFile(wad_file_t *wf, const char *filename);
 void CloseWadFile(wad_file_t *wf);
 
 int EntryExists(wad_file_t *wf, char *entrytofind);
+void ReadLump(wad_file_t *wf, unsigned int entrynum, size_t offset, void *buf,
+              size_t len);
 void *CacheLump(wad_file_t *wf, unsigned int entrynum);
 
 void WriteWadDirectory(FILE *fp, wad_file_type_t type, entry_t *entries,
@@ -61,5 +81,7 @@ void WriteWadDirectory(FILE *fp, wad_file_type_t type, entry_t *entries,
 uint32_t WriteWadLump(FILE *fp, void *buf, size_t len);
 
 bool IsLevelEntry(char *s);
+bool IsSidedefs(wad_file_t *wf, unsigned int lumpnum);
+lump_type_t *ClassifyLumps(wad_file_t *wf);
 
 #endif
@@ -23,6 +23,18 @@ extern bool allowmerge;  // lump merging on
 extern bool extsides;    // extended sidedefs limit
 extern bool extblocks;   // extended blockmap limit
 extern bool wipesides;   // clear unneeded texture references
+extern bool mergesectors; // merge identical sectors
+extern bool prune;        // remove unused level data
+extern bool buildblocks;  // rebuild blockmaps from linedefs
+extern bool nozeroblocks; // strip leading zeros from block lists
+extern bool emptyreject;  // leave out REJECT tables with no bits set
+
+// SYS_BIG_ENDIAN is defined when building for a big-endian host. It can
+// also be given on the command line, for compilers that do not say.
+#if !defined(SYS_BIG_ENDIAN) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SYS_BIG_ENDIAN
+#endif
 
 #ifdef _WIN32
 #define DIRSEP "\\"